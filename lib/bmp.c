@@ -1,8 +1,18 @@
 #include "bmp.h"
+#include "pixel_convert.h"
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PIXELS_SIZE_ALIGN 64
 
 typedef struct {
   char identifier[2];
@@ -23,116 +33,283 @@ typedef struct {
   uint32_t importantColors;
 } __attribute__((packed)) bmp_header_t;
 
-static uint8_t * read_padded_rgb_data(FILE * fp, bmp_header_t head);
+// Rows are read and written in blocks of up to this many
+// rows, so that each block is one read or write call.
+#define STREAM_BLOCK_ROWS 64
+
+static int check_header(bmp_header_t * head, size_t fileSize, int * heightOut,
+                        int * topDownOut);
+static void fill_header(bmp_header_t * header, int width, int height);
+static int row_pitch(int width, int bitsPerPixel);
+static void expand_row(const uint8_t * source, cl_uchar4 * dest, int width, int bytesPerPixel);
 
 bmp_t * bmp_read(const char * path) {
   assert(sizeof(cl_uchar4) == 4);
 
-  FILE * fp = fopen(path, "r");
-  if (fp == NULL) {
+  bmp_mapping_t * map = bmp_map(path);
+  if (!map) {
     return NULL;
   }
 
-  bmp_header_t head;
-  if (fread(&head, sizeof(head), 1, fp) != 1) {
-    fclose(fp);
+  bmp_t * res = (bmp_t *)malloc(sizeof(bmp_t));
+  if (!res) {
+    bmp_unmap(map);
+    return NULL;
+  }
+  res->width = map->width;
+  res->height = map->height;
+  res->pixels = bmp_alloc_pixels(map->width, map->height);
+  if (!res->pixels) {
+    free(res);
+    bmp_unmap(map);
     return NULL;
   }
 
-  if (head.bitsPerPixel != 24 && head.bitsPerPixel != 32) {
-    fclose(fp);
+  // Rows are expanded straight out of the mapping, so the
+  // file data is touched once on its way to the pixels.
+  for (int y = 0; y < map->height; ++y) {
+    bmp_mapping_decode_row(map, y, res->pixels + (size_t)y*map->width);
+  }
+
+  bmp_unmap(map);
+  return res;
+}
+
+bmp_mapping_t * bmp_map(const char * path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
     return NULL;
   }
 
-  if (fseek(fp, (long)head.dataOffset, SEEK_SET)) {
-    fclose(fp);
+  struct stat info;
+  if (fstat(fd, &info) || (size_t)info.st_size < sizeof(bmp_header_t)) {
+    close(fd);
     return NULL;
   }
 
-  uint8_t * pixelData;
-  if (head.bitsPerPixel == 24) {
-    pixelData = read_padded_rgb_data(fp, head);
-  } else {
-    size_t dataSize = 4 * head.width * head.height;
-    pixelData = (uint8_t *)malloc(dataSize);
-    if (pixelData) {
-      if (fread(pixelData, 1, dataSize, fp) != dataSize) {
-        free(pixelData);
-        pixelData = NULL;
-      }
-    }
+  // A private writable mapping lets the pages back an
+  // OpenCL buffer; nothing is ever written to the file.
+  size_t mapSize = (size_t)info.st_size;
+  void * base = mmap(NULL, mapSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return NULL;
   }
 
-  fclose(fp);
+  bmp_header_t head;
+  memcpy(&head, base, sizeof(head));
+  int height;
+  int topDown;
+  if (check_header(&head, mapSize, &height, &topDown)) {
+    munmap(base, mapSize);
+    return NULL;
+  }
+  size_t pitch = row_pitch((int)head.width, head.bitsPerPixel);
 
-  if (!pixelData) {
+  bmp_mapping_t * map = (bmp_mapping_t *)malloc(sizeof(bmp_mapping_t));
+  if (!map) {
+    munmap(base, mapSize);
     return NULL;
   }
+  map->width = (int)head.width;
+  map->height = (int)height;
+  map->bitsPerPixel = head.bitsPerPixel;
+  map->topDown = topDown;
+  map->rowPitch = pitch;
+  map->dataOffset = head.dataOffset;
+  map->base = base;
+  map->mapSize = mapSize;
+  return map;
+}
 
-  bmp_t * res = (bmp_t *)malloc(sizeof(bmp_t));
+const uint8_t * bmp_mapping_row(bmp_mapping_t * map, int y) {
+  size_t storedRow = (map->topDown ? map->height - 1 - y : y);
+  return (const uint8_t *)map->base + map->dataOffset + storedRow*map->rowPitch;
+}
 
-  if (!res) {
-    free(pixelData);
+void bmp_mapping_decode_row(bmp_mapping_t * map, int y, cl_uchar4 * dest) {
+  expand_row(bmp_mapping_row(map, y), dest, map->width, map->bitsPerPixel / 8);
+}
+
+void bmp_unmap(bmp_mapping_t * map) {
+  munmap(map->base, map->mapSize);
+  free(map);
+}
+
+bmp_reader_t * bmp_reader_open(const char * path) {
+  FILE * fp = fopen(path, "rb");
+  if (!fp) {
     return NULL;
   }
 
-  res->width = (int)head.width;
-  res->height = (int)head.height;
-  res->pixels = (cl_uchar4 *)pixelData;
+  bmp_header_t head;
+  int height;
+  int topDown;
+  long fileSize = -1;
+  if (!fseek(fp, 0, SEEK_END)) {
+    fileSize = ftell(fp);
+  }
+  if (fileSize < 0 || fseek(fp, 0, SEEK_SET)) {
+    int error = errno;
+    fclose(fp);
+    errno = error;
+    return NULL;
+  }
 
-  return res;
+  // A read error leaves errno as it is, while a file too
+  // short for a header, or with a header which doesn't fit
+  // it, is rejected with EINVAL.
+  if (fread(&head, sizeof(head), 1, fp) != 1 ||
+      check_header(&head, (size_t)fileSize, &height, &topDown)) {
+    int error = (ferror(fp) ? errno : EINVAL);
+    fclose(fp);
+    errno = error;
+    return NULL;
+  }
+
+  bmp_reader_t * reader = (bmp_reader_t *)malloc(sizeof(bmp_reader_t));
+  if (!reader) {
+    fclose(fp);
+    return NULL;
+  }
+  bzero(reader, sizeof(bmp_reader_t));
+  reader->width = (int)head.width;
+  reader->height = height;
+  reader->bitsPerPixel = head.bitsPerPixel;
+  reader->topDown = topDown;
+  reader->rowPitch = row_pitch(reader->width, reader->bitsPerPixel);
+  reader->dataOffset = head.dataOffset;
+  reader->fp = fp;
+  reader->block = (uint8_t *)malloc(reader->rowPitch * STREAM_BLOCK_ROWS);
+  if (!reader->block) {
+    bmp_reader_close(reader);
+    return NULL;
+  }
+  return reader;
 }
 
-int bmp_write(bmp_t * b, const char * path) {
-  FILE * fp = fopen(path, "w");
-  if (fp == NULL) {
+int bmp_reader_read(bmp_reader_t * reader, int y, int count, cl_uchar4 * rows, size_t pitch) {
+  if (y < 0 || count < 0 || y + count > reader->height) {
     return -1;
   }
+  int bytesPerPixel = reader->bitsPerPixel / 8;
+  while (count > 0) {
+    int blockRows = (count < STREAM_BLOCK_ROWS ? count : STREAM_BLOCK_ROWS);
 
-  bmp_header_t header;
-  bzero(&header, sizeof(header));
-
-  memcpy(header.identifier, "BM", 2);
-  header.fileSize = sizeof(header) + (b->width*b->height*3);
-  header.dataOffset = sizeof(header);
-  header.headerSize = 40;
-  header.width = b->width;
-  header.height = b->height;
-  header.planeCount = 1;
-  header.bitsPerPixel = 24;
-  header.imageSize = b->width * b->height * 3;
+    // In a top-down file the block is stored in reverse,
+    // starting with its last row.
+    size_t storedRow = (reader->topDown ? reader->height - y - blockRows : y);
+    long offset = (long)(reader->dataOffset + storedRow*reader->rowPitch);
+    size_t blockSize = reader->rowPitch * blockRows;
+    if (fseek(reader->fp, offset, SEEK_SET) ||
+        fread(reader->block, 1, blockSize, reader->fp) != blockSize) {
+      return -1;
+    }
+    for (int i = 0; i < blockRows; ++i) {
+      int blockRow = (reader->topDown ? blockRows - 1 - i : i);
+      expand_row(reader->block + blockRow*reader->rowPitch, rows, reader->width,
+        bytesPerPixel);
+      rows = (cl_uchar4 *)((char *)rows + pitch);
+    }
+    y += blockRows;
+    count -= blockRows;
+  }
+  return 0;
+}
+
+void bmp_reader_close(bmp_reader_t * reader) {
+  if (reader->fp) {
+    fclose(reader->fp);
+  }
+  free(reader->block);
+  free(reader);
+}
+
+bmp_writer_t * bmp_writer_open(const char * path, int width, int height) {
+  if (width <= 0 || height <= 0) {
+    return NULL;
+  }
+
+  FILE * fp = fopen(path, "wb");
+  if (!fp) {
+    return NULL;
+  }
 
+  bmp_header_t header;
+  fill_header(&header, width, height);
   if (fwrite(&header, sizeof(header), 1, fp) != 1) {
     fclose(fp);
-    return -1;
+    return NULL;
+  }
+
+  bmp_writer_t * writer = (bmp_writer_t *)malloc(sizeof(bmp_writer_t));
+  if (!writer) {
+    fclose(fp);
+    return NULL;
   }
+  bzero(writer, sizeof(bmp_writer_t));
+  writer->width = width;
+  writer->height = height;
+  writer->rowPitch = row_pitch(width, 24);
+  writer->fp = fp;
 
-  size_t pixelCount = b->width * b->height;
-  uint8_t * packedData = (uint8_t *)malloc(pixelCount * 3);
-  if (!packedData) {
+  // Padding bytes stay zero since only pixels are ever
+  // written into the block.
+  writer->block = (uint8_t *)calloc(writer->rowPitch * STREAM_BLOCK_ROWS, 1);
+  if (!writer->block) {
     fclose(fp);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+int bmp_writer_write(bmp_writer_t * writer, int y, int count, const cl_uchar4 * rows,
+                     size_t pitch) {
+  if (y < 0 || count < 0 || y + count > writer->height) {
     return -1;
   }
+  const pixel_converter_t * converter = pixel_converter();
+  while (count > 0) {
+    int blockRows = (count < STREAM_BLOCK_ROWS ? count : STREAM_BLOCK_ROWS);
+    for (int i = 0; i < blockRows; ++i) {
+      converter->rgba_to_rgb((const uint8_t *)rows, writer->block + i*writer->rowPitch,
+        writer->width);
+      rows = (const cl_uchar4 *)((const char *)rows + pitch);
+    }
 
-  size_t i;
-  uint8_t * sourceData = (uint8_t *)b->pixels;
-  for (i = 0; i < pixelCount; ++i) {
-    size_t destIdx = i * 3;
-    size_t sourceIdx = i * 4;
-    packedData[destIdx++] = sourceData[sourceIdx++];
-    packedData[destIdx++] = sourceData[sourceIdx++];
-    packedData[destIdx++] = sourceData[sourceIdx++];
+    // Rows written in order need no seek.
+    size_t offset = sizeof(bmp_header_t) + (size_t)y*writer->rowPitch;
+    size_t blockSize = writer->rowPitch * blockRows;
+    if ((y != writer->nextRow && fseek(writer->fp, (long)offset, SEEK_SET)) ||
+        fwrite(writer->block, 1, blockSize, writer->fp) != blockSize) {
+      return -1;
+    }
+    y += blockRows;
+    count -= blockRows;
+    writer->nextRow = y;
+    writer->rowsWritten += blockRows;
   }
+  return 0;
+}
 
-  size_t writeRes = fwrite(packedData, 1, pixelCount*3, fp);
-  free(packedData);
-  fclose(fp);
+int bmp_writer_close(bmp_writer_t * writer) {
+  int res = (fclose(writer->fp) || writer->rowsWritten < writer->height ? -1 : 0);
+  free(writer->block);
+  free(writer);
+  return res;
+}
 
-  if (writeRes == pixelCount*3) {
-    return 0;
-  } else {
+int bmp_write(bmp_t * b, const char * path) {
+  bmp_writer_t * writer = bmp_writer_open(path, b->width, b->height);
+  if (!writer) {
     return -1;
   }
+  int res = bmp_writer_write(writer, 0, b->height, b->pixels, b->width * sizeof(cl_uchar4));
+  if (bmp_writer_close(writer)) {
+    res = -1;
+  }
+  return res;
 }
 
 void bmp_free(bmp_t * b) {
@@ -140,46 +317,71 @@ void bmp_free(bmp_t * b) {
   free(b);
 }
 
-static uint8_t * read_padded_rgb_data(FILE * fp, bmp_header_t head) {
-  size_t lineSize = head.width * 3;
-  size_t linePadding = 0;
-  if (lineSize % 4) {
-    linePadding = 4 - (lineSize % 4);
-    lineSize += linePadding;
+cl_uchar4 * bmp_alloc_pixels(int width, int height) {
+  size_t size = (size_t)width * height * sizeof(cl_uchar4);
+  size = (size + PIXELS_SIZE_ALIGN - 1) / PIXELS_SIZE_ALIGN * PIXELS_SIZE_ALIGN;
+  if (!size) {
+    size = PIXELS_SIZE_ALIGN;
   }
-  size_t dataSize = lineSize * head.height;
-  uint8_t * data = (uint8_t *)malloc(dataSize);
-
-  if (!data) {
-    return NULL;
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if (pageSize < PIXELS_SIZE_ALIGN) {
+    pageSize = PIXELS_SIZE_ALIGN;
   }
-
-  if (fread(data, 1, dataSize, fp) != dataSize) {
-    free(data);
+  void * res;
+  if (posix_memalign(&res, (size_t)pageSize, size)) {
     return NULL;
   }
-  fclose(fp);
-
-  size_t pixelCount = head.width * head.height;
-  uint8_t * paddedBuff = (uint8_t *)malloc(pixelCount * 4);
+  return (cl_uchar4 *)res;
+}
 
-  if (!paddedBuff) {
-    free(data);
-    return NULL;
+// check_header validates a header against the size of its
+// file and decodes the height and orientation.
+static int check_header(bmp_header_t * head, size_t fileSize, int * heightOut,
+                        int * topDownOut) {
+  int32_t height = (int32_t)head->height;
+  int topDown = (height < 0);
+  if (topDown) {
+    height = -height;
+  }
+  if ((head->bitsPerPixel != 24 && head->bitsPerPixel != 32) ||
+      (int32_t)head->width <= 0 || height <= 0) {
+    return -1;
   }
 
-  size_t destIdx = 0;
-  size_t sourceIdx = 0;
-  for (size_t y = 0; y < head.height; ++y) {
-    for (size_t x = 0; x < head.width; ++x) {
-      paddedBuff[destIdx++] = data[sourceIdx++];
-      paddedBuff[destIdx++] = data[sourceIdx++];
-      paddedBuff[destIdx++] = data[sourceIdx++];
-      paddedBuff[destIdx++] = 0;
-    }
-    sourceIdx += linePadding;
+  size_t pitch = row_pitch((int)head->width, head->bitsPerPixel);
+  if (head->dataOffset > fileSize || (fileSize - head->dataOffset) / pitch < (size_t)height) {
+    return -1;
   }
+  (*heightOut) = height;
+  (*topDownOut) = topDown;
+  return 0;
+}
 
-  free(data);
-  return paddedBuff;
+// fill_header makes the header of a bottom-up 24-bit file.
+static void fill_header(bmp_header_t * header, int width, int height) {
+  size_t dataSize = (size_t)row_pitch(width, 24) * height;
+  bzero(header, sizeof(bmp_header_t));
+  memcpy(header->identifier, "BM", 2);
+  header->fileSize = sizeof(bmp_header_t) + dataSize;
+  header->dataOffset = sizeof(bmp_header_t);
+  header->headerSize = 40;
+  header->width = width;
+  header->height = height;
+  header->planeCount = 1;
+  header->bitsPerPixel = 24;
+  header->imageSize = dataSize;
+}
+
+// row_pitch is the size of a stored row, which BMP pads
+// to a multiple of four bytes.
+static int row_pitch(int width, int bitsPerPixel) {
+  return ((width * bitsPerPixel + 31) / 32) * 4;
+}
+
+static void expand_row(const uint8_t * source, cl_uchar4 * dest, int width, int bytesPerPixel) {
+  if (bytesPerPixel == 4) {
+    memcpy(dest, source, (size_t)width * 4);
+  } else {
+    pixel_converter()->rgb_to_rgba(source, (uint8_t *)dest, width);
+  }
 }
@@ -2,15 +2,108 @@
 #define __BMP_H__
 
 #include <OpenCL/opencl.h>
+#include <stdint.h>
+#include <stdio.h>
 
+// bmp_t holds BGRA pixels with the bottom row first, the
+// order in which BMP files normally store them.
 typedef struct {
   int width;
   int height;
   cl_uchar4 * pixels;
 } bmp_t;
 
+// bmp_mapping_t exposes the stored rows of a 24 or 32-bit
+// BMP file mapped into memory, without decoding them.
+typedef struct {
+  int width;
+  int height;
+  int bitsPerPixel;
+
+  // topDown is set for files which store the top row
+  // first (a negative height in the header).
+  int topDown;
+
+  // Stored rows start at dataOffset in the mapping and
+  // are rowPitch bytes apart, including padding.
+  size_t rowPitch;
+  size_t dataOffset;
+
+  void * base;
+  size_t mapSize;
+} bmp_mapping_t;
+
+// bmp_reader_t reads a 24 or 32-bit BMP file a block of
+// rows at a time, in either orientation.
+typedef struct {
+  int width;
+  int height;
+  int bitsPerPixel;
+  int topDown;
+  size_t rowPitch;
+  size_t dataOffset;
+
+  FILE * fp;
+  uint8_t * block;
+} bmp_reader_t;
+
+// bmp_writer_t writes a bottom-up 24-bit BMP file a block
+// of rows at a time.
+typedef struct {
+  int width;
+  int height;
+  size_t rowPitch;
+  int nextRow;
+  int rowsWritten;
+
+  FILE * fp;
+  uint8_t * block;
+} bmp_writer_t;
+
+// bmp_read reads a 24 or 32-bit image. Its pixels are
+// allocated with bmp_alloc_pixels.
 bmp_t * bmp_read(const char * path);
+
+// bmp_map maps a BMP file into memory. The mapping's base
+// is page-aligned, so it can back an OpenCL buffer.
+bmp_mapping_t * bmp_map(const char * path);
+
+// bmp_mapping_row returns the stored row which holds row
+// y of the image, counting from the bottom as bmp_t does.
+const uint8_t * bmp_mapping_row(bmp_mapping_t * map, int y);
+
+// bmp_mapping_decode_row decodes row y into width pixels.
+void bmp_mapping_decode_row(bmp_mapping_t * map, int y, cl_uchar4 * dest);
+void bmp_unmap(bmp_mapping_t * map);
+
+// bmp_reader_read reads count rows starting at row y,
+// counting from the bottom as bmp_t does, into rows which
+// are pitch bytes apart. Rows may be read in any order,
+// but reading them in order avoids seeking backwards.
+//
+// When bmp_reader_open fails, errno is EINVAL if the file
+// is not a BMP image it supports, and otherwise says what
+// went wrong opening or reading it.
+bmp_reader_t * bmp_reader_open(const char * path);
+int bmp_reader_read(bmp_reader_t * reader, int y, int count, cl_uchar4 * rows, size_t pitch);
+void bmp_reader_close(bmp_reader_t * reader);
+
+// bmp_writer_write writes count rows starting at row y,
+// like bmp_reader_read. Memory use does not depend on the
+// image size. bmp_writer_close fails if the file could
+// not be completed, including when fewer than height rows
+// were written, since the header claims the whole image.
+bmp_writer_t * bmp_writer_open(const char * path, int width, int height);
+int bmp_writer_write(bmp_writer_t * writer, int y, int count, const cl_uchar4 * rows,
+                     size_t pitch);
+int bmp_writer_close(bmp_writer_t * writer);
 int bmp_write(bmp_t * b, const char * path);
 void bmp_free(bmp_t * b);
 
+// bmp_alloc_pixels allocates page-aligned pixels, padded
+// to a multiple of 64 bytes, so that they can back an
+// OpenCL buffer without a copy (CL_MEM_USE_HOST_PTR).
+// They are released with free().
+cl_uchar4 * bmp_alloc_pixels(int width, int height);
+
 #endif
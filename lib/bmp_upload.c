@@ -0,0 +1,59 @@
+#include "bmp_upload.h"
+#include "context.h"
+
+#define RAW_BUFF 0
+#define DECODE_KERNEL 0
+
+static const char * decodeKernel = "\
+__kernel void bmp_decode(__global const uchar * raw, __global uchar4 * pixels, \
+                         ulong dataOffset, ulong rowPitch, int width, int height, \
+                         int bytesPerPixel, int topDown) { \
+  int x = get_global_id(0); \
+  int y = get_global_id(1); \
+  int storedRow = (topDown ? height - 1 - y : y); \
+  __global const uchar * source = raw + dataOffset + storedRow*rowPitch + x*bytesPerPixel; \
+  uchar alpha = (bytesPerPixel == 4 ? source[3] : 0); \
+  pixels[x + (size_t)y*width] = (uchar4)(source[0], source[1], source[2], alpha); \
+} \
+";
+
+static const char * decodeKernelNames[1] = {"bmp_decode"};
+
+int bmp_upload(session_t * session, bmp_mapping_t * map, cl_mem dest) {
+  // The whole mapping is used so that the buffer starts
+  // on a page boundary.
+  size_t bufferSizes[1] = {map->mapSize};
+  void * hostPointers[1] = {map->base};
+  context_params_t params;
+  params.program = decodeKernel;
+  params.kernelCount = 1;
+  params.kernelNames = decodeKernelNames;
+  params.bufferCount = 1;
+  params.bufferSizes = bufferSizes;
+  params.hostPointers = hostPointers;
+
+  context_t * ctx = context_create_in(session, &params);
+  if (!ctx) {
+    return -1;
+  }
+
+  cl_ulong dataOffset = map->dataOffset;
+  cl_ulong rowPitch = map->rowPitch;
+  cl_int width = map->width;
+  cl_int height = map->height;
+  cl_int bytesPerPixel = map->bitsPerPixel / 8;
+  cl_int topDown = map->topDown;
+  void * args[8] = {&ctx->buffers[RAW_BUFF], &dest, &dataOffset, &rowPitch, &width, &height,
+    &bytesPerPixel, &topDown};
+  size_t sizes[8] = {sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_ulong), sizeof(cl_ulong),
+    sizeof(cl_int), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int)};
+  size_t workSizes[2] = {map->width, map->height};
+  int res = -1;
+  if (!context_set_params(ctx, DECODE_KERNEL, 8, args, sizes) &&
+      !context_run_nd(ctx, DECODE_KERNEL, 2, NULL, workSizes, NULL)) {
+    res = 0;
+  }
+
+  context_free(ctx);
+  return res;
+}
@@ -0,0 +1,18 @@
+#ifndef __BMP_UPLOAD_H__
+#define __BMP_UPLOAD_H__
+
+#include <OpenCL/opencl.h>
+#include "bmp.h"
+#include "session.h"
+
+// bmp_upload decodes a mapped BMP on the device into dest,
+// which must hold width*height cl_uchar4 pixels, laid out
+// as in a bmp_t.
+//
+// The mapped file backs a buffer directly, so on unified
+// memory devices it is never copied, and otherwise it is
+// copied once by the driver. A kernel then drops the row
+// padding, expands RGB to RGBA and flips top-down files.
+int bmp_upload(session_t * session, bmp_mapping_t * map, cl_mem dest);
+
+#endif
@@ -0,0 +1,337 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MIN_CLASS_SIZE 4096
+#define CLASSES_PER_DOUBLING 4
+
+// Idle buffers beyond this many bytes are released
+// rather than kept for reuse.
+#define MAX_IDLE_BYTES (256 << 20)
+
+static size_t size_class(size_t size);
+static buffer_pool_block_t * add_block(buffer_pool_t * pool);
+static void remove_block(buffer_pool_t * pool, size_t idx);
+static cl_mem arena_acquire(buffer_pool_t * pool, size_t size);
+static int arena_reserve(buffer_pool_t * pool, size_t size, size_t * offsetOut);
+static void arena_return(buffer_pool_t * pool, size_t offset, size_t size);
+static void update_high_water(buffer_pool_t * pool);
+
+buffer_pool_t * buffer_pool_new(cl_context context, cl_device_id device, cl_mem_flags flags,
+                                size_t arenaSize) {
+  buffer_pool_t * pool = (buffer_pool_t *)malloc(sizeof(buffer_pool_t));
+  if (!pool) {
+    return NULL;
+  }
+  bzero(pool, sizeof(buffer_pool_t));
+  pool->context = context;
+  pool->flags = flags;
+
+  if (arenaSize) {
+    // Sub-buffer origins must be aligned to the device's
+    // base address alignment, which is given in bits.
+    cl_uint alignBits;
+    if (clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignBits), &alignBits,
+        NULL)) {
+      buffer_pool_free(pool);
+      return NULL;
+    }
+    pool->arenaAlign = (alignBits >= 8 ? alignBits / 8 : 1);
+
+    cl_int statusCode;
+    pool->arena = clCreateBuffer(context, flags, arenaSize, NULL, &statusCode);
+    pool->freeRanges = (buffer_pool_range_t *)malloc(sizeof(buffer_pool_range_t));
+    if (statusCode || !pool->freeRanges) {
+      buffer_pool_free(pool);
+      return NULL;
+    }
+    pool->freeRanges[0].offset = 0;
+    pool->freeRanges[0].size = arenaSize;
+    pool->rangeCount = 1;
+    pool->rangeCapacity = 1;
+    pool->stats.arenaSize = arenaSize;
+    ++pool->stats.creates;
+  }
+
+  return pool;
+}
+
+cl_mem buffer_pool_acquire(buffer_pool_t * pool, size_t size) {
+  if (pool->arena) {
+    cl_mem buffer = arena_acquire(pool, size);
+    if (buffer) {
+      return buffer;
+    }
+  }
+
+  // Reuse an idle buffer of the same class.
+  size_t classSize = size_class(size);
+  for (size_t i = 0; i < pool->blockCount; ++i) {
+    buffer_pool_block_t * block = &pool->blocks[i];
+    if (!block->inUse && !block->inArena && block->size == classSize) {
+      block->inUse = 1;
+      block->requested = size;
+      pool->stats.idleBytes -= classSize;
+      pool->stats.liveBytes += classSize;
+      pool->stats.requestedBytes += size;
+      ++pool->stats.reuses;
+      return block->buffer;
+    }
+  }
+
+  cl_int statusCode;
+  cl_mem buffer = clCreateBuffer(pool->context, pool->flags, classSize, NULL, &statusCode);
+  if (statusCode) {
+    // Idle buffers of other classes may be what is
+    // keeping the device from allocating.
+    buffer_pool_trim(pool);
+    buffer = clCreateBuffer(pool->context, pool->flags, classSize, NULL, &statusCode);
+    if (statusCode) {
+      return NULL;
+    }
+  }
+
+  buffer_pool_block_t * block = add_block(pool);
+  if (!block) {
+    clReleaseMemObject(buffer);
+    return NULL;
+  }
+  block->buffer = buffer;
+  block->size = classSize;
+  block->requested = size;
+  block->inUse = 1;
+  pool->stats.liveBytes += classSize;
+  pool->stats.requestedBytes += size;
+  ++pool->stats.creates;
+  update_high_water(pool);
+  return buffer;
+}
+
+int buffer_pool_release(buffer_pool_t * pool, cl_mem buffer) {
+  for (size_t i = 0; i < pool->blockCount; ++i) {
+    buffer_pool_block_t * block = &pool->blocks[i];
+    if (block->buffer != buffer || !block->inUse) {
+      continue;
+    }
+    pool->stats.liveBytes -= block->size;
+    pool->stats.requestedBytes -= block->requested;
+
+    if (block->inArena) {
+      clReleaseMemObject(buffer);
+      arena_return(pool, block->offset, block->size);
+      remove_block(pool, i);
+    } else if (pool->stats.idleBytes + block->size > MAX_IDLE_BYTES) {
+      clReleaseMemObject(buffer);
+      remove_block(pool, i);
+    } else {
+      block->inUse = 0;
+      block->requested = 0;
+      pool->stats.idleBytes += block->size;
+    }
+    return 0;
+  }
+  return -1;
+}
+
+void buffer_pool_trim(buffer_pool_t * pool) {
+  size_t i = 0;
+  while (i < pool->blockCount) {
+    if (pool->blocks[i].inUse) {
+      ++i;
+      continue;
+    }
+    clReleaseMemObject(pool->blocks[i].buffer);
+    pool->stats.idleBytes -= pool->blocks[i].size;
+    remove_block(pool, i);
+  }
+}
+
+void buffer_pool_stats(buffer_pool_t * pool, buffer_pool_stats_t * out) {
+  (*out) = pool->stats;
+  out->arenaFree = 0;
+  out->arenaLargestFree = 0;
+  for (size_t i = 0; i < pool->rangeCount; ++i) {
+    out->arenaFree += pool->freeRanges[i].size;
+    if (pool->freeRanges[i].size > out->arenaLargestFree) {
+      out->arenaLargestFree = pool->freeRanges[i].size;
+    }
+  }
+}
+
+void buffer_pool_print_stats(buffer_pool_t * pool, FILE * fp) {
+  buffer_pool_stats_t stats;
+  buffer_pool_stats(pool, &stats);
+  double waste = 0;
+  if (stats.liveBytes) {
+    waste = 100.0 * (double)(stats.liveBytes - stats.requestedBytes) / stats.liveBytes;
+  }
+  fprintf(fp, "Buffer pool: %lu creates, %lu reuses, %lu arena allocations, "
+    "%.1f MB high water, %.1f MB idle, %.1f%% lost to size classes.\n",
+    stats.creates, stats.reuses, stats.arenaAllocs,
+    (double)stats.highWaterBytes / (1 << 20), (double)stats.idleBytes / (1 << 20), waste);
+  if (stats.arenaSize) {
+    // Free space outside the largest free range can only
+    // serve smaller requests.
+    double fragmentation = 0;
+    if (stats.arenaFree) {
+      fragmentation = 100.0 * (1 - (double)stats.arenaLargestFree / stats.arenaFree);
+    }
+    fprintf(fp, "Buffer arena: %.1f of %.1f MB free, %.1f%% fragmented.\n",
+      (double)stats.arenaFree / (1 << 20), (double)stats.arenaSize / (1 << 20),
+      fragmentation);
+  }
+}
+
+void buffer_pool_free(buffer_pool_t * pool) {
+  for (size_t i = 0; i < pool->blockCount; ++i) {
+    clReleaseMemObject(pool->blocks[i].buffer);
+  }
+  if (pool->arena) {
+    clReleaseMemObject(pool->arena);
+  }
+  free(pool->blocks);
+  free(pool->freeRanges);
+  free(pool);
+}
+
+// size_class rounds size up to the next of four evenly
+// spaced sizes per power of two, so at most a fifth of
+// a buffer is wasted.
+static size_t size_class(size_t size) {
+  if (size <= MIN_CLASS_SIZE) {
+    return MIN_CLASS_SIZE;
+  }
+  size_t high = MIN_CLASS_SIZE;
+  while (high <= size / 2) {
+    high *= 2;
+  }
+  size_t step = high / CLASSES_PER_DOUBLING;
+  return (size + step - 1) / step * step;
+}
+
+static buffer_pool_block_t * add_block(buffer_pool_t * pool) {
+  if (pool->blockCount == pool->blockCapacity) {
+    size_t capacity = pool->blockCapacity ? pool->blockCapacity * 2 : 16;
+    buffer_pool_block_t * blocks = (buffer_pool_block_t *)realloc(pool->blocks,
+      sizeof(buffer_pool_block_t) * capacity);
+    if (!blocks) {
+      return NULL;
+    }
+    pool->blocks = blocks;
+    pool->blockCapacity = capacity;
+  }
+  buffer_pool_block_t * block = &pool->blocks[pool->blockCount++];
+  bzero(block, sizeof(buffer_pool_block_t));
+  return block;
+}
+
+static void remove_block(buffer_pool_t * pool, size_t idx) {
+  pool->blocks[idx] = pool->blocks[--pool->blockCount];
+}
+
+static cl_mem arena_acquire(buffer_pool_t * pool, size_t size) {
+  size_t alignedSize = (size + pool->arenaAlign - 1) / pool->arenaAlign * pool->arenaAlign;
+  size_t offset;
+  if (arena_reserve(pool, alignedSize, &offset)) {
+    return NULL;
+  }
+
+  cl_int statusCode;
+  cl_buffer_region region = {offset, size};
+  cl_mem buffer = clCreateSubBuffer(pool->arena, CL_MEM_READ_WRITE,
+    CL_BUFFER_CREATE_TYPE_REGION, &region, &statusCode);
+  if (statusCode) {
+    arena_return(pool, offset, alignedSize);
+    return NULL;
+  }
+
+  buffer_pool_block_t * block = add_block(pool);
+  if (!block) {
+    clReleaseMemObject(buffer);
+    arena_return(pool, offset, alignedSize);
+    return NULL;
+  }
+  block->buffer = buffer;
+  block->size = alignedSize;
+  block->requested = size;
+  block->offset = offset;
+  block->inArena = 1;
+  block->inUse = 1;
+  pool->stats.liveBytes += alignedSize;
+  pool->stats.requestedBytes += size;
+  ++pool->stats.arenaAllocs;
+  update_high_water(pool);
+  return buffer;
+}
+
+// arena_reserve takes size bytes from the first free
+// range which is large enough.
+static int arena_reserve(buffer_pool_t * pool, size_t size, size_t * offsetOut) {
+  for (size_t i = 0; i < pool->rangeCount; ++i) {
+    buffer_pool_range_t * range = &pool->freeRanges[i];
+    if (range->size < size) {
+      continue;
+    }
+    (*offsetOut) = range->offset;
+    range->offset += size;
+    range->size -= size;
+    if (!range->size) {
+      memmove(range, range + 1, sizeof(buffer_pool_range_t) * (pool->rangeCount - i - 1));
+      --pool->rangeCount;
+    }
+    return 0;
+  }
+  return -1;
+}
+
+// arena_return puts a range back on the free list, which
+// is kept sorted by offset, merging it with its neighbors.
+static void arena_return(buffer_pool_t * pool, size_t offset, size_t size) {
+  size_t idx = 0;
+  while (idx < pool->rangeCount && pool->freeRanges[idx].offset < offset) {
+    ++idx;
+  }
+
+  int joinsPrev = (idx > 0 &&
+    pool->freeRanges[idx - 1].offset + pool->freeRanges[idx - 1].size == offset);
+  int joinsNext = (idx < pool->rangeCount && offset + size == pool->freeRanges[idx].offset);
+  if (joinsPrev && joinsNext) {
+    pool->freeRanges[idx - 1].size += size + pool->freeRanges[idx].size;
+    memmove(&pool->freeRanges[idx], &pool->freeRanges[idx + 1],
+      sizeof(buffer_pool_range_t) * (pool->rangeCount - idx - 1));
+    --pool->rangeCount;
+    return;
+  } else if (joinsPrev) {
+    pool->freeRanges[idx - 1].size += size;
+    return;
+  } else if (joinsNext) {
+    pool->freeRanges[idx].offset = offset;
+    pool->freeRanges[idx].size += size;
+    return;
+  }
+
+  if (pool->rangeCount == pool->rangeCapacity) {
+    size_t capacity = pool->rangeCapacity * 2;
+    buffer_pool_range_t * ranges = (buffer_pool_range_t *)realloc(pool->freeRanges,
+      sizeof(buffer_pool_range_t) * capacity);
+    if (!ranges) {
+      // The range is leaked until the pool is freed.
+      return;
+    }
+    pool->freeRanges = ranges;
+    pool->rangeCapacity = capacity;
+  }
+  memmove(&pool->freeRanges[idx + 1], &pool->freeRanges[idx],
+    sizeof(buffer_pool_range_t) * (pool->rangeCount - idx));
+  pool->freeRanges[idx].offset = offset;
+  pool->freeRanges[idx].size = size;
+  ++pool->rangeCount;
+}
+
+static void update_high_water(buffer_pool_t * pool) {
+  size_t total = pool->stats.liveBytes + pool->stats.idleBytes;
+  if (total > pool->stats.highWaterBytes) {
+    pool->stats.highWaterBytes = total;
+  }
+}
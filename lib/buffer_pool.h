@@ -0,0 +1,85 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <OpenCL/opencl.h>
+#include <stdio.h>
+
+typedef struct {
+  cl_mem buffer;
+  size_t size;
+  size_t requested;
+  size_t offset;
+  int inArena;
+  int inUse;
+} buffer_pool_block_t;
+
+typedef struct {
+  size_t offset;
+  size_t size;
+} buffer_pool_range_t;
+
+typedef struct {
+  unsigned long creates;
+  unsigned long reuses;
+  unsigned long arenaAllocs;
+
+  // liveBytes is held by buffers in use, of which
+  // requestedBytes was asked for; the rest is lost to
+  // rounding up to size classes.
+  size_t liveBytes;
+  size_t requestedBytes;
+  size_t idleBytes;
+  size_t highWaterBytes;
+
+  size_t arenaSize;
+  size_t arenaFree;
+  size_t arenaLargestFree;
+} buffer_pool_stats_t;
+
+// buffer_pool_t recycles device buffers across jobs.
+// Buffers are rounded up to size classes (four per power
+// of two) and idle ones are handed out again instead of
+// being released. If the pool has an arena, buffers are
+// first carved from it as sub-buffers.
+typedef struct {
+  cl_context context;
+  cl_mem_flags flags;
+  buffer_pool_stats_t stats;
+
+  size_t blockCount;
+  size_t blockCapacity;
+  buffer_pool_block_t * blocks;
+
+  cl_mem arena;
+  size_t arenaAlign;
+  size_t rangeCount;
+  size_t rangeCapacity;
+  buffer_pool_range_t * freeRanges;
+} buffer_pool_t;
+
+// buffer_pool_new creates a pool of buffers created with
+// flags. If arenaSize is non-zero, one buffer of that size
+// is allocated up front to carve sub-buffers from.
+buffer_pool_t * buffer_pool_new(cl_context context, cl_device_id device, cl_mem_flags flags,
+                                size_t arenaSize);
+
+// buffer_pool_acquire returns a buffer of at least size
+// bytes, or NULL on error.
+cl_mem buffer_pool_acquire(buffer_pool_t * pool, size_t size);
+
+// buffer_pool_release returns a buffer to the pool. It
+// fails, leaving the buffer alone, if the buffer did not
+// come from the pool. No commands may still use it.
+int buffer_pool_release(buffer_pool_t * pool, cl_mem buffer);
+
+// buffer_pool_trim releases every idle buffer.
+void buffer_pool_trim(buffer_pool_t * pool);
+
+void buffer_pool_stats(buffer_pool_t * pool, buffer_pool_stats_t * out);
+void buffer_pool_print_stats(buffer_pool_t * pool, FILE * fp);
+
+// buffer_pool_free releases the pool and every buffer it
+// still holds.
+void buffer_pool_free(buffer_pool_t * pool);
+
+#endif
@@ -1,68 +1,50 @@
 #include "context.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
-#ifndef PRINT_PROGRAM_LOG
-#define PRINT_PROGRAM_LOG 1
-#endif
+// Trace lanes for profiled commands, one per queue.
+#define COMPUTE_LANE 0
+#define UPLOAD_LANE 1
+#define DOWNLOAD_LANE 2
 
 static context_t * allocate_context(context_params_t * params);
+static cl_event * event_ptr(context_t * ctx, cl_event * event, cl_event * eventOut);
+static void finish_event(context_t * ctx, const char * label, int lane, cl_event * event,
+                         cl_event * eventOut);
 
 context_t * context_create(context_params_t * params) {
-  cl_uint resultCount;
-  cl_int statusCode;
-
-  cl_platform_id platform;
-  if (clGetPlatformIDs(1, &platform, &resultCount) || resultCount != 1) {
+  session_t * session = session_create(NULL);
+  if (!session) {
     return NULL;
   }
 
-  cl_device_id devices[10];
-  if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 10, devices, &resultCount)) {
-    return NULL;
-  } else if (resultCount == 0) {
-    return NULL;
-  }
-  cl_device_id device = devices[resultCount - 1];
-
-  context_t * ctx = allocate_context(params);
-
-  ctx->platform = platform;
-  ctx->device = device;
-
-  ctx->context = clCreateContext(0, 1, &device, NULL, NULL, &statusCode);
-  if (statusCode) {
-    context_free(ctx);
+  context_t * ctx = context_create_in(session, params);
+  if (!ctx) {
+    session_free(session);
     return NULL;
   }
+  ctx->ownsSession = 1;
+  return ctx;
+}
 
-  ctx->queue = clCreateCommandQueue(ctx->context, device, 0, &statusCode);
-  if (statusCode) {
-    context_free(ctx);
-    return NULL;
-  }
+context_t * context_create_in(session_t * session, context_params_t * params) {
+  cl_int statusCode;
 
-  size_t programLen = strlen(params->program);
-  ctx->program = clCreateProgramWithSource(ctx->context, 1, &params->program,
-    &programLen, &statusCode);
-  if (statusCode) {
-    context_free(ctx);
+  context_t * ctx = allocate_context(params);
+  if (!ctx) {
     return NULL;
   }
 
-  if (clBuildProgram(ctx->program, 1, &device, NULL, NULL, NULL)) {
-    if (PRINT_PROGRAM_LOG) {
-      size_t logSize;
-      clGetProgramBuildInfo(ctx->program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
-
-      char * logInfo = (char *)malloc(logSize);
-      clGetProgramBuildInfo(ctx->program, device, CL_PROGRAM_BUILD_LOG, logSize, logInfo, NULL);
-
-      printf("%s\n", logInfo);
-      free(logInfo);
-    }
+  ctx->session = session;
+  ctx->context = session->context;
+  ctx->queue = session->queue;
+  ctx->transferQueue = session->transferQueue;
+  ctx->downloadQueue = session->downloadQueue;
 
+  ctx->program = session_program(session, params->program);
+  if (!ctx->program) {
     context_free(ctx);
     return NULL;
   }
@@ -79,7 +61,14 @@ context_t * context_create(context_params_t * params) {
   for (size_t i = 0; i < params->bufferCount; ++i) {
     size_t size = params->bufferSizes[i];
     ctx->bufferSizes[i] = size;
-    ctx->buffers[i] = clCreateBuffer(ctx->context, CL_MEM_READ_WRITE, size, NULL, &statusCode);
+    void * hostPtr = (params->hostPointers ? params->hostPointers[i] : NULL);
+    if (hostPtr) {
+      ctx->buffers[i] = clCreateBuffer(ctx->context, CL_MEM_READ_WRITE|CL_MEM_USE_HOST_PTR,
+        size, hostPtr, &statusCode);
+    } else {
+      ctx->buffers[i] = buffer_pool_acquire(session->pool, size);
+      statusCode = (ctx->buffers[i] ? CL_SUCCESS : CL_OUT_OF_RESOURCES);
+    }
     if (statusCode) {
       context_free(ctx);
       return NULL;
@@ -101,28 +90,43 @@ int context_set_params(context_t * ctx, int kernelIdx, size_t count,
   return 0;
 }
 
+int context_resize_buffer(context_t * ctx, int bufIdx, size_t size) {
+  cl_mem buffer = buffer_pool_acquire(ctx->session->pool, size);
+  if (!buffer) {
+    return -1;
+  }
+  if (buffer_pool_release(ctx->session->pool, ctx->buffers[bufIdx])) {
+    clReleaseMemObject(ctx->buffers[bufIdx]);
+  }
+  ctx->buffers[bufIdx] = buffer;
+  ctx->bufferSizes[bufIdx] = size;
+  return 0;
+}
+
 void * context_map(context_t * ctx, int bufIdx, cl_bool write) {
-  cl_map_flags flags = CL_MAP_READ;
-  if (write) {
-    flags |= CL_MAP_WRITE;
+  cl_event event;
+  void * res = context_map_async(ctx, bufIdx, write, 0, NULL, &event);
+  if (!res) {
+    return NULL;
   }
-  return clEnqueueMapBuffer(ctx->queue, ctx->buffers[bufIdx], CL_TRUE, flags, 0,
-    ctx->bufferSizes[bufIdx], 0, NULL, NULL, NULL);
+  cl_int status = clWaitForEvents(1, &event);
+  clReleaseEvent(event);
+  return status ? NULL : res;
 }
 
 void context_unmap(context_t * ctx, int bufIdx, void * ptr) {
   cl_event event;
-  if (clEnqueueUnmapMemObject(ctx->queue, ctx->buffers[bufIdx], ptr, 0, NULL, &event)) {
+  if (context_unmap_async(ctx, bufIdx, ptr, 0, NULL, &event)) {
     return;
   }
   clWaitForEvents(1, &event);
   clReleaseEvent(event);
 }
 
-int context_run_nd(context_t * ctx, int kernelIdx, size_t dim, size_t * offsets, size_t * sizes) {
+int context_run_nd(context_t * ctx, int kernelIdx, size_t dim, size_t * offsets, size_t * sizes,
+                   size_t * localSizes) {
   cl_event event;
-  if (clEnqueueNDRangeKernel(ctx->queue, ctx->kernels[kernelIdx], dim, offsets, sizes,
-      NULL, 0, NULL, &event)) {
+  if (context_run_nd_async(ctx, kernelIdx, dim, offsets, sizes, localSizes, 0, NULL, &event)) {
     return -1;
   }
 
@@ -135,25 +139,199 @@ int context_run_nd(context_t * ctx, int kernelIdx, size_t dim, size_t * offsets,
   }
 }
 
+void * context_map_async(context_t * ctx, int bufIdx, cl_bool write, cl_uint waitCount,
+                         const cl_event * waitList, cl_event * eventOut) {
+  cl_map_flags flags = CL_MAP_READ;
+  if (write) {
+    flags |= CL_MAP_WRITE;
+  }
+  cl_event event;
+  void * res = clEnqueueMapBuffer(ctx->queue, ctx->buffers[bufIdx], CL_FALSE, flags, 0,
+    ctx->bufferSizes[bufIdx], waitCount, waitList, event_ptr(ctx, &event, eventOut), NULL);
+  if (res) {
+    finish_event(ctx, "map", COMPUTE_LANE, &event, eventOut);
+  }
+  return res;
+}
+
+int context_unmap_async(context_t * ctx, int bufIdx, void * ptr, cl_uint waitCount,
+                        const cl_event * waitList, cl_event * eventOut) {
+  cl_event event;
+  if (clEnqueueUnmapMemObject(ctx->queue, ctx->buffers[bufIdx], ptr, waitCount, waitList,
+      event_ptr(ctx, &event, eventOut))) {
+    return -1;
+  }
+  finish_event(ctx, "unmap", COMPUTE_LANE, &event, eventOut);
+  return 0;
+}
+
+int context_write_async(context_t * ctx, int bufIdx, size_t offset, size_t size,
+                        const void * ptr, cl_uint waitCount, const cl_event * waitList,
+                        cl_event * eventOut) {
+  cl_event event;
+  if (clEnqueueWriteBuffer(ctx->queue, ctx->buffers[bufIdx], CL_FALSE, offset, size, ptr,
+      waitCount, waitList, event_ptr(ctx, &event, eventOut))) {
+    return -1;
+  }
+  finish_event(ctx, "write", COMPUTE_LANE, &event, eventOut);
+  return 0;
+}
+
+int context_read_async(context_t * ctx, int bufIdx, size_t offset, size_t size, void * ptr,
+                       cl_uint waitCount, const cl_event * waitList, cl_event * eventOut) {
+  cl_event event;
+  if (clEnqueueReadBuffer(ctx->queue, ctx->buffers[bufIdx], CL_FALSE, offset, size, ptr,
+      waitCount, waitList, event_ptr(ctx, &event, eventOut))) {
+    return -1;
+  }
+  finish_event(ctx, "read", COMPUTE_LANE, &event, eventOut);
+  return 0;
+}
+
+int context_run_nd_async(context_t * ctx, int kernelIdx, size_t dim, size_t * offsets,
+                         size_t * sizes, size_t * localSizes, cl_uint waitCount,
+                         const cl_event * waitList, cl_event * eventOut) {
+  cl_event event;
+  cl_kernel kernel = ctx->kernels[kernelIdx];
+  if (clEnqueueNDRangeKernel(ctx->queue, kernel, dim, offsets, sizes,
+      localSizes, waitCount, waitList, event_ptr(ctx, &event, eventOut))) {
+    return -1;
+  }
+  if (ctx->session->profile) {
+    char name[PROFILE_MAX_LABEL];
+    if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL)) {
+      strcpy(name, "kernel");
+    }
+    finish_event(ctx, name, COMPUTE_LANE, &event, eventOut);
+  } else {
+    finish_event(ctx, NULL, COMPUTE_LANE, &event, eventOut);
+  }
+  return 0;
+}
+
+int context_upload_async(context_t * ctx, int bufIdx, size_t offset, size_t size,
+                         const void * ptr, cl_uint waitCount, const cl_event * waitList,
+                         cl_event * eventOut) {
+  cl_event event;
+  if (clEnqueueWriteBuffer(ctx->transferQueue, ctx->buffers[bufIdx], CL_FALSE, offset, size,
+      ptr, waitCount, waitList, event_ptr(ctx, &event, eventOut))) {
+    return -1;
+  }
+  finish_event(ctx, "upload", UPLOAD_LANE, &event, eventOut);
+  return 0;
+}
+
+int context_download_async(context_t * ctx, int bufIdx, size_t offset, size_t size,
+                           void * ptr, cl_uint waitCount, const cl_event * waitList,
+                           cl_event * eventOut) {
+  cl_event event;
+  if (clEnqueueReadBuffer(ctx->downloadQueue, ctx->buffers[bufIdx], CL_FALSE, offset, size,
+      ptr, waitCount, waitList, event_ptr(ctx, &event, eventOut))) {
+    return -1;
+  }
+  finish_event(ctx, "download", DOWNLOAD_LANE, &event, eventOut);
+  return 0;
+}
+
+int context_upload_rows_async(context_t * ctx, int bufIdx, size_t offset, size_t bufferPitch,
+                              const void * ptr, size_t hostPitch, size_t rowSize,
+                              size_t rowCount, cl_uint waitCount, const cl_event * waitList,
+                              cl_event * eventOut) {
+  size_t bufferOrigin[3] = {offset, 0, 0};
+  size_t hostOrigin[3] = {0, 0, 0};
+  size_t region[3] = {rowSize, rowCount, 1};
+  cl_event event;
+  if (clEnqueueWriteBufferRect(ctx->transferQueue, ctx->buffers[bufIdx], CL_FALSE,
+      bufferOrigin, hostOrigin, region, bufferPitch, 0, hostPitch, 0, ptr, waitCount,
+      waitList, event_ptr(ctx, &event, eventOut))) {
+    return -1;
+  }
+  finish_event(ctx, "upload", UPLOAD_LANE, &event, eventOut);
+  return 0;
+}
+
+int context_download_rows_async(context_t * ctx, int bufIdx, size_t offset,
+                                size_t bufferPitch, void * ptr, size_t hostPitch,
+                                size_t rowSize, size_t rowCount, cl_uint waitCount,
+                                const cl_event * waitList, cl_event * eventOut) {
+  size_t bufferOrigin[3] = {offset, 0, 0};
+  size_t hostOrigin[3] = {0, 0, 0};
+  size_t region[3] = {rowSize, rowCount, 1};
+  cl_event event;
+  if (clEnqueueReadBufferRect(ctx->downloadQueue, ctx->buffers[bufIdx], CL_FALSE,
+      bufferOrigin, hostOrigin, region, bufferPitch, 0, hostPitch, 0, ptr, waitCount,
+      waitList, event_ptr(ctx, &event, eventOut))) {
+    return -1;
+  }
+  finish_event(ctx, "download", DOWNLOAD_LANE, &event, eventOut);
+  return 0;
+}
+
+size_t context_work_group_size(context_t * ctx, int kernelIdx) {
+  size_t size;
+  if (clGetKernelWorkGroupInfo(ctx->kernels[kernelIdx], ctx->session->device,
+      CL_KERNEL_WORK_GROUP_SIZE, sizeof(size), &size, NULL)) {
+    return 0;
+  }
+  return size;
+}
+
+size_t context_work_item_size(context_t * ctx, size_t dim) {
+  cl_uint dims;
+  if (clGetDeviceInfo(ctx->session->device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(dims),
+      &dims, NULL) || dim >= dims) {
+    return 0;
+  }
+  size_t * sizes = malloc(sizeof(size_t) * dims);
+  if (!sizes) {
+    return 0;
+  }
+  size_t size = 0;
+  if (!clGetDeviceInfo(ctx->session->device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+      sizeof(size_t) * dims, sizes, NULL)) {
+    size = sizes[dim];
+  }
+  free(sizes);
+  return size;
+}
+
+int context_flush(context_t * ctx) {
+  if (clFlush(ctx->transferQueue) || clFlush(ctx->queue) || clFlush(ctx->downloadQueue)) {
+    return -1;
+  }
+  return 0;
+}
+
+int context_finish(context_t * ctx) {
+  if (clFinish(ctx->transferQueue) || clFinish(ctx->queue) || clFinish(ctx->downloadQueue)) {
+    return -1;
+  }
+  return 0;
+}
+
 void context_free(context_t * ctx) {
   if (ctx->queue) {
     clFlush(ctx->queue);
     clFinish(ctx->queue);
   }
+  if (ctx->transferQueue) {
+    clFlush(ctx->transferQueue);
+    clFinish(ctx->transferQueue);
+  }
+  if (ctx->downloadQueue) {
+    clFlush(ctx->downloadQueue);
+    clFinish(ctx->downloadQueue);
+  }
   for (size_t i = 0; i < ctx->kernelCount; ++i) {
     clReleaseKernel(ctx->kernels[i]);
   }
-  if (ctx->program) {
-    clReleaseProgram(ctx->program);
-  }
   for (size_t i = 0; i < ctx->bufferCount; ++i) {
-    clReleaseMemObject(ctx->buffers[i]);
-  }
-  if (ctx->queue) {
-    clReleaseCommandQueue(ctx->queue);
+    if (buffer_pool_release(ctx->session->pool, ctx->buffers[i])) {
+      clReleaseMemObject(ctx->buffers[i]);
+    }
   }
-  if (ctx->context) {
-    clReleaseContext(ctx->context);
+  if (ctx->ownsSession) {
+    session_free(ctx->session);
   }
   free(ctx->kernels);
   free(ctx->buffers);
@@ -194,3 +372,27 @@ static context_t * allocate_context(context_params_t * params) {
 
   return res;
 }
+
+// event_ptr returns the event pointer to pass to an
+// enqueue call. An event is needed whenever the caller
+// asked for one or the session is being profiled.
+static cl_event * event_ptr(context_t * ctx, cl_event * event, cl_event * eventOut) {
+  if (eventOut || ctx->session->profile) {
+    return event;
+  }
+  return NULL;
+}
+
+// finish_event records an event filled in via event_ptr and
+// hands it to the caller or releases it.
+static void finish_event(context_t * ctx, const char * label, int lane, cl_event * event,
+                         cl_event * eventOut) {
+  if (ctx->session->profile) {
+    profile_add(ctx->session->profile, label, lane, *event);
+  }
+  if (eventOut) {
+    (*eventOut) = *event;
+  } else if (ctx->session->profile) {
+    clReleaseEvent(*event);
+  }
+}
@@ -2,12 +2,16 @@
 #define __CONTEXT_H__
 
 #include <OpenCL/opencl.h>
+#include "session.h"
 
 typedef struct {
-  cl_platform_id platform;
-  cl_device_id device;
+  session_t * session;
+  int ownsSession;
+
   cl_context context;
   cl_command_queue queue;
+  cl_command_queue transferQueue;
+  cl_command_queue downloadQueue;
   cl_program program;
 
   size_t kernelCount;
@@ -25,14 +29,104 @@ typedef struct {
 
   size_t bufferCount;
   size_t * bufferSizes;
+
+  // hostPointers, if non-NULL, gives host memory to back
+  // each buffer (CL_MEM_USE_HOST_PTR), or NULL for buffers
+  // the context should allocate. On unified memory devices
+  // mapping such a buffer returns the host memory itself.
+  // It must stay valid until the context is freed.
+  void ** hostPointers;
 } context_params_t;
 
+// context_create creates a context with its own private
+// session, which is released by context_free.
 context_t * context_create(context_params_t * params);
+
+// context_create_in creates a context which borrows the
+// device, queues, programs and buffer pool of an existing
+// session. Buffers without host pointers come from the
+// pool and go back to it in context_free.
+// The session must outlive the context.
+context_t * context_create_in(session_t * session, context_params_t * params);
+
 int context_set_params(context_t * ctx, int kernelIdx, size_t count,
                        void ** params, size_t * sizes);
+// context_resize_buffer replaces a buffer from the pool by
+// one of size bytes, for buffers whose size is only known
+// once the kernels are built. The old contents are lost,
+// and no queued commands may still use the buffer.
+int context_resize_buffer(context_t * ctx, int bufIdx, size_t size);
+
 void * context_map(context_t * ctx, int bufIdx, cl_bool write);
 void context_unmap(context_t * ctx, int bufIdx, void * ptr);
-int context_run_nd(context_t * ctx, int kernelIdx, size_t dim, size_t * offsets, size_t * sizes);
+
+// context_run_nd runs a kernel over an N-D range. If
+// localSizes is NULL, the implementation picks the
+// work-group size.
+int context_run_nd(context_t * ctx, int kernelIdx, size_t dim, size_t * offsets, size_t * sizes,
+                   size_t * localSizes);
+
+// context_work_group_size returns the largest work-group
+// size the device supports for a kernel, or 0 on error.
+size_t context_work_group_size(context_t * ctx, int kernelIdx);
+
+// context_work_item_size returns the most work-items the
+// device allows in a work-group along dimension dim, or 0
+// on error or if it has no such dimension.
+size_t context_work_item_size(context_t * ctx, size_t dim);
+
+// The _async variants enqueue work without waiting for it.
+// Each waits on the events in waitList before it starts
+// and, if eventOut is non-NULL, stores an event which the
+// caller must release. A pointer returned by
+// context_map_async may not be used until its event is
+// complete. Host memory passed to context_write_async and
+// context_read_async must stay valid until the same.
+void * context_map_async(context_t * ctx, int bufIdx, cl_bool write, cl_uint waitCount,
+                         const cl_event * waitList, cl_event * eventOut);
+int context_unmap_async(context_t * ctx, int bufIdx, void * ptr, cl_uint waitCount,
+                        const cl_event * waitList, cl_event * eventOut);
+int context_write_async(context_t * ctx, int bufIdx, size_t offset, size_t size,
+                        const void * ptr, cl_uint waitCount, const cl_event * waitList,
+                        cl_event * eventOut);
+int context_read_async(context_t * ctx, int bufIdx, size_t offset, size_t size, void * ptr,
+                       cl_uint waitCount, const cl_event * waitList, cl_event * eventOut);
+int context_run_nd_async(context_t * ctx, int kernelIdx, size_t dim, size_t * offsets,
+                         size_t * sizes, size_t * localSizes, cl_uint waitCount,
+                         const cl_event * waitList, cl_event * eventOut);
+
+// context_upload_async and context_download_async are like
+// context_write_async and context_read_async, but they run
+// on the session's upload and download queues so that they
+// can overlap kernels and each other. They are not ordered
+// with the main queue or with each other, so use events to
+// order them against kernels.
+int context_upload_async(context_t * ctx, int bufIdx, size_t offset, size_t size,
+                         const void * ptr, cl_uint waitCount, const cl_event * waitList,
+                         cl_event * eventOut);
+int context_download_async(context_t * ctx, int bufIdx, size_t offset, size_t size,
+                           void * ptr, cl_uint waitCount, const cl_event * waitList,
+                           cl_event * eventOut);
+
+// context_upload_rows_async and context_download_rows_async
+// copy rowCount rows of rowSize bytes on the same queues
+// between a buffer starting at offset and host memory,
+// where consecutive rows are bufferPitch and hostPitch
+// bytes apart respectively.
+int context_upload_rows_async(context_t * ctx, int bufIdx, size_t offset, size_t bufferPitch,
+                              const void * ptr, size_t hostPitch, size_t rowSize,
+                              size_t rowCount, cl_uint waitCount, const cl_event * waitList,
+                              cl_event * eventOut);
+int context_download_rows_async(context_t * ctx, int bufIdx, size_t offset,
+                                size_t bufferPitch, void * ptr, size_t hostPitch,
+                                size_t rowSize, size_t rowCount, cl_uint waitCount,
+                                const cl_event * waitList, cl_event * eventOut);
+
+// context_flush submits queued work on all queues to the
+// device, and context_finish additionally waits for it to
+// complete.
+int context_flush(context_t * ctx);
+int context_finish(context_t * ctx);
 void context_free(context_t * context);
 
 #endif
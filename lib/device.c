@@ -0,0 +1,191 @@
+#include "device.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define DEVICE_ENV "LEARNING_CL_DEVICE"
+#define MAX_PLATFORMS 16
+#define MAX_DEVICES 64
+
+#define ATTR_COUNT 13
+
+static int device_matches(device_select_t * select, device_attributes_t * attrs);
+static unsigned long long device_score(device_attributes_t * attrs);
+
+int device_get_attributes(cl_device_id dev, device_attributes_t * out) {
+  bzero(out, sizeof(device_attributes_t));
+
+  void * attrPointers[ATTR_COUNT] = {
+    out->name, out->driverVersion, out->deviceVersion, out->deviceVendor,
+    &out->globalCache, &out->globalCacheLine, &out->globalMemSize,
+    &out->clockFrequency, &out->computeUnits, &out->workGroupSize,
+    &out->localMemSize, &out->type, &out->maxAllocSize
+  };
+
+  cl_device_info attrs[ATTR_COUNT] = {
+    CL_DEVICE_NAME, CL_DRIVER_VERSION, CL_DEVICE_VERSION, CL_DEVICE_VENDOR,
+    CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE,
+    CL_DEVICE_GLOBAL_MEM_SIZE, CL_DEVICE_MAX_CLOCK_FREQUENCY, CL_DEVICE_MAX_COMPUTE_UNITS,
+    CL_DEVICE_MAX_WORK_GROUP_SIZE, CL_DEVICE_LOCAL_MEM_SIZE, CL_DEVICE_TYPE,
+    CL_DEVICE_MAX_MEM_ALLOC_SIZE
+  };
+
+  size_t attrSizes[ATTR_COUNT] = {
+    DEVICE_MAX_STRING-1, DEVICE_MAX_STRING-1, DEVICE_MAX_STRING-1, DEVICE_MAX_STRING-1,
+    sizeof(cl_ulong), sizeof(cl_uint), sizeof(cl_ulong), sizeof(cl_uint), sizeof(cl_uint),
+    sizeof(size_t), sizeof(cl_ulong), sizeof(cl_device_type), sizeof(cl_ulong)
+  };
+
+  for (size_t i = 0; i < ATTR_COUNT; ++i) {
+    if (clGetDeviceInfo(dev, attrs[i], attrSizes[i], attrPointers[i], NULL)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int device_list(size_t max, cl_device_id * devices, cl_platform_id * platforms,
+                size_t * countOut) {
+  cl_uint platformCount;
+  cl_platform_id platformIds[MAX_PLATFORMS];
+  if (clGetPlatformIDs(MAX_PLATFORMS, platformIds, &platformCount)) {
+    return -1;
+  }
+  // The counts returned are totals, which may be more than
+  // were written.
+  if (platformCount > MAX_PLATFORMS) {
+    platformCount = MAX_PLATFORMS;
+  }
+
+  size_t count = 0;
+  for (cl_uint i = 0; i < platformCount && count < max; ++i) {
+    cl_uint deviceCount;
+    if (clGetDeviceIDs(platformIds[i], CL_DEVICE_TYPE_ALL, (cl_uint)(max - count),
+        devices + count, &deviceCount)) {
+      // Platforms with no devices report CL_DEVICE_NOT_FOUND.
+      continue;
+    }
+    if (deviceCount > max - count) {
+      deviceCount = (cl_uint)(max - count);
+    }
+    for (cl_uint j = 0; j < deviceCount; ++j) {
+      if (platforms) {
+        platforms[count + j] = platformIds[i];
+      }
+    }
+    count += deviceCount;
+  }
+
+  (*countOut) = count;
+  return 0;
+}
+
+cl_device_id device_select(device_select_t * select, cl_platform_id * platformOut) {
+  device_select_t envSelect;
+  if (!select) {
+    bzero(&envSelect, sizeof(envSelect));
+    const char * spec = getenv(DEVICE_ENV);
+    if (spec && spec[0] && device_select_parse(spec, &envSelect)) {
+      return NULL;
+    }
+    select = &envSelect;
+  }
+
+  size_t count;
+  cl_device_id devices[MAX_DEVICES];
+  cl_platform_id platforms[MAX_DEVICES];
+  if (device_list(MAX_DEVICES, devices, platforms, &count)) {
+    return NULL;
+  }
+
+  if (select->policy == DEVICE_SELECT_INDEX) {
+    if (select->index < 0 || (size_t)select->index >= count) {
+      return NULL;
+    }
+    if (platformOut) {
+      (*platformOut) = platforms[select->index];
+    }
+    return devices[select->index];
+  }
+
+  int bestIdx = -1;
+  int bestIsGPU = 0;
+  unsigned long long bestScore = 0;
+  for (size_t i = 0; i < count; ++i) {
+    device_attributes_t attrs;
+    if (device_get_attributes(devices[i], &attrs) || !device_matches(select, &attrs)) {
+      continue;
+    }
+    if (select->policy == DEVICE_SELECT_NAME) {
+      bestIdx = (int)i;
+      break;
+    }
+    int isGPU = (attrs.type & CL_DEVICE_TYPE_GPU) != 0;
+    unsigned long long score = device_score(&attrs);
+    int better = bestIdx < 0 || score > bestScore;
+    if (select->policy == DEVICE_SELECT_DEFAULT && bestIdx >= 0 && isGPU != bestIsGPU) {
+      better = isGPU;
+    }
+    if (better) {
+      bestIdx = (int)i;
+      bestIsGPU = isGPU;
+      bestScore = score;
+    }
+  }
+
+  if (bestIdx < 0) {
+    return NULL;
+  }
+  if (platformOut) {
+    (*platformOut) = platforms[bestIdx];
+  }
+  return devices[bestIdx];
+}
+
+int device_select_parse(const char * spec, device_select_t * out) {
+  bzero(out, sizeof(device_select_t));
+  if (!strcasecmp(spec, "gpu")) {
+    out->policy = DEVICE_SELECT_TYPE;
+    out->type = CL_DEVICE_TYPE_GPU;
+  } else if (!strcasecmp(spec, "cpu")) {
+    out->policy = DEVICE_SELECT_TYPE;
+    out->type = CL_DEVICE_TYPE_CPU;
+  } else if (!strcasecmp(spec, "accelerator")) {
+    out->policy = DEVICE_SELECT_TYPE;
+    out->type = CL_DEVICE_TYPE_ACCELERATOR;
+  } else if (!strcasecmp(spec, "fastest")) {
+    out->policy = DEVICE_SELECT_FASTEST;
+  } else if (!strncasecmp(spec, "index:", 6)) {
+    char * end;
+    long index = strtol(spec + 6, &end, 10);
+    if (end == spec + 6 || *end || index < 0) {
+      return -1;
+    }
+    out->policy = DEVICE_SELECT_INDEX;
+    out->index = (int)index;
+  } else if (!strncasecmp(spec, "name:", 5)) {
+    out->policy = DEVICE_SELECT_NAME;
+    out->name = spec + 5;
+  } else {
+    out->policy = DEVICE_SELECT_NAME;
+    out->name = spec;
+  }
+  return 0;
+}
+
+static int device_matches(device_select_t * select, device_attributes_t * attrs) {
+  switch (select->policy) {
+    case DEVICE_SELECT_TYPE:
+      return (attrs->type & select->type) != 0;
+    case DEVICE_SELECT_NAME:
+      return select->name && (strstr(attrs->name, select->name) ||
+        strstr(attrs->deviceVendor, select->name));
+    default:
+      return 1;
+  }
+}
+
+static unsigned long long device_score(device_attributes_t * attrs) {
+  return (unsigned long long)attrs->computeUnits * (unsigned long long)attrs->clockFrequency;
+}
@@ -0,0 +1,67 @@
+#ifndef __DEVICE_H__
+#define __DEVICE_H__
+
+#include <OpenCL/opencl.h>
+
+#define DEVICE_MAX_STRING 256
+
+typedef struct {
+  cl_device_type type;
+
+  cl_ulong globalCache;
+  cl_uint globalCacheLine;
+
+  cl_ulong globalMemSize;
+  cl_ulong localMemSize;
+  cl_ulong maxAllocSize;
+
+  cl_uint clockFrequency;
+  cl_uint computeUnits;
+  size_t workGroupSize;
+
+  char name[DEVICE_MAX_STRING];
+  char driverVersion[DEVICE_MAX_STRING];
+  char deviceVersion[DEVICE_MAX_STRING];
+  char deviceVendor[DEVICE_MAX_STRING];
+} device_attributes_t;
+
+typedef enum {
+  // Prefer the fastest GPU, falling back to the fastest
+  // device of any type (e.g. a CPU runtime like PoCL).
+  DEVICE_SELECT_DEFAULT = 0,
+  // The fastest device whose type matches type.
+  DEVICE_SELECT_TYPE,
+  // The first device whose name or vendor contains name.
+  DEVICE_SELECT_NAME,
+  // The device at index in device_list order.
+  DEVICE_SELECT_INDEX,
+  // The device with the most compute units * clock.
+  DEVICE_SELECT_FASTEST
+} device_policy_t;
+
+typedef struct {
+  device_policy_t policy;
+  cl_device_type type;
+  const char * name;
+  int index;
+} device_select_t;
+
+int device_get_attributes(cl_device_id dev, device_attributes_t * out);
+
+// device_list lists the devices of every platform.
+// The platforms array may be NULL.
+int device_list(size_t max, cl_device_id * devices, cl_platform_id * platforms,
+                size_t * countOut);
+
+// device_select picks a device according to select.
+// If select is NULL, the policy is parsed from the
+// $LEARNING_CL_DEVICE environment variable.
+cl_device_id device_select(device_select_t * select, cl_platform_id * platformOut);
+
+// device_select_parse parses a policy string: "gpu",
+// "cpu", "accelerator", "fastest", "index:N" or
+// "name:SUBSTRING". Any other string is treated as a
+// name substring. The result points into spec.
+int device_select_parse(const char * spec, device_select_t * out);
+
+#endif
@@ -0,0 +1,208 @@
+#include "pixel_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_CONVERT_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define PIXEL_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+static void rgb_to_rgba_scalar(const uint8_t * source, uint8_t * dest, size_t count);
+static void rgba_to_rgb_scalar(const uint8_t * source, uint8_t * dest, size_t count);
+
+static const pixel_converter_t scalarConverter = {
+  "scalar", rgb_to_rgba_scalar, rgba_to_rgb_scalar
+};
+
+#ifdef PIXEL_CONVERT_X86
+
+static void rgb_to_rgba_ssse3(const uint8_t * source, uint8_t * dest, size_t count);
+static void rgba_to_rgb_ssse3(const uint8_t * source, uint8_t * dest, size_t count);
+static void rgb_to_rgba_avx2(const uint8_t * source, uint8_t * dest, size_t count);
+static void rgba_to_rgb_avx2(const uint8_t * source, uint8_t * dest, size_t count);
+
+static const pixel_converter_t ssse3Converter = {
+  "ssse3", rgb_to_rgba_ssse3, rgba_to_rgb_ssse3
+};
+static const pixel_converter_t avx2Converter = {
+  "avx2", rgb_to_rgba_avx2, rgba_to_rgb_avx2
+};
+
+#endif
+
+#ifdef PIXEL_CONVERT_NEON
+
+static void rgb_to_rgba_neon(const uint8_t * source, uint8_t * dest, size_t count);
+static void rgba_to_rgb_neon(const uint8_t * source, uint8_t * dest, size_t count);
+
+static const pixel_converter_t neonConverter = {
+  "neon", rgb_to_rgba_neon, rgba_to_rgb_neon
+};
+
+#endif
+
+const pixel_converter_t * pixel_converter() {
+  static const pixel_converter_t * best = NULL;
+  if (!best) {
+    const pixel_converter_t * converters[4];
+    size_t count = pixel_converters(converters, 4);
+    best = converters[count - 1];
+  }
+  return best;
+}
+
+size_t pixel_converters(const pixel_converter_t ** out, size_t max) {
+  const pixel_converter_t * supported[4];
+  size_t count = 0;
+  supported[count++] = &scalarConverter;
+#ifdef PIXEL_CONVERT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    supported[count++] = &ssse3Converter;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    supported[count++] = &avx2Converter;
+  }
+#endif
+#ifdef PIXEL_CONVERT_NEON
+  supported[count++] = &neonConverter;
+#endif
+  for (size_t i = 0; i < count && i < max; ++i) {
+    out[i] = supported[i];
+  }
+  return count;
+}
+
+static void rgb_to_rgba_scalar(const uint8_t * source, uint8_t * dest, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    dest[0] = source[0];
+    dest[1] = source[1];
+    dest[2] = source[2];
+    dest[3] = 0;
+    dest += 4;
+    source += 3;
+  }
+}
+
+static void rgba_to_rgb_scalar(const uint8_t * source, uint8_t * dest, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    dest[0] = source[0];
+    dest[1] = source[1];
+    dest[2] = source[2];
+    dest += 3;
+    source += 4;
+  }
+}
+
+#ifdef PIXEL_CONVERT_X86
+
+// Each loop handles 16 pixels and leaves the rest to the
+// scalar loop. Loads never read past the last pixel.
+
+__attribute__((target("ssse3")))
+static void rgb_to_rgba_ssse3(const uint8_t * source, uint8_t * dest, size_t count) {
+  const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(source + i*3));
+    __m128i b = _mm_loadu_si128((const __m128i *)(source + i*3 + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(source + i*3 + 32));
+    __m128i * out = (__m128i *)(dest + i*4);
+    _mm_storeu_si128(out, _mm_shuffle_epi8(a, expand));
+    _mm_storeu_si128(out + 1, _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), expand));
+    _mm_storeu_si128(out + 2, _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), expand));
+    _mm_storeu_si128(out + 3, _mm_shuffle_epi8(_mm_srli_si128(c, 4), expand));
+  }
+  rgb_to_rgba_scalar(source + i*3, dest + i*4, count - i);
+}
+
+__attribute__((target("ssse3")))
+static void rgba_to_rgb_ssse3(const uint8_t * source, uint8_t * dest, size_t count) {
+  const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m128i * in = (const __m128i *)(source + i*4);
+    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(in), pack);
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), pack);
+    __m128i c = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), pack);
+    __m128i d = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), pack);
+    __m128i * out = (__m128i *)(dest + i*3);
+    _mm_storeu_si128(out, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+    _mm_storeu_si128(out + 1, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+    _mm_storeu_si128(out + 2, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+  }
+  rgba_to_rgb_scalar(source + i*4, dest + i*3, count - i);
+}
+
+// The AVX2 loops move the second group of four pixels of
+// each 24 bytes into the upper lane, since shuffles do
+// not cross lanes.
+
+__attribute__((target("avx2")))
+static void rgb_to_rgba_avx2(const uint8_t * source, uint8_t * dest, size_t count) {
+  const __m256i expand = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+  size_t i = 0;
+  // Each 32-byte load covers 8 pixels plus 8 bytes more,
+  // so the last load must stop 3 pixels early.
+  for (; i + 19 <= count; i += 16) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(source + i*3));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(source + i*3 + 24));
+    __m256i * out = (__m256i *)(dest + i*4);
+    _mm256_storeu_si256(out, _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(a, spread),
+      expand));
+    _mm256_storeu_si256(out + 1, _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(b, spread),
+      expand));
+  }
+  rgb_to_rgba_ssse3(source + i*3, dest + i*4, count - i);
+}
+
+__attribute__((target("avx2")))
+static void rgba_to_rgb_avx2(const uint8_t * source, uint8_t * dest, size_t count) {
+  const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  const __m256i gather = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(source + i*4));
+    v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack), gather);
+    _mm_storeu_si128((__m128i *)(dest + i*3), _mm256_castsi256_si128(v));
+    _mm_storel_epi64((__m128i *)(dest + i*3 + 16), _mm256_extracti128_si256(v, 1));
+  }
+  rgba_to_rgb_scalar(source + i*4, dest + i*3, count - i);
+}
+
+#endif
+
+#ifdef PIXEL_CONVERT_NEON
+
+static void rgb_to_rgba_neon(const uint8_t * source, uint8_t * dest, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x3_t rgb = vld3q_u8(source + i*3);
+    uint8x16x4_t rgba;
+    rgba.val[0] = rgb.val[0];
+    rgba.val[1] = rgb.val[1];
+    rgba.val[2] = rgb.val[2];
+    rgba.val[3] = vdupq_n_u8(0);
+    vst4q_u8(dest + i*4, rgba);
+  }
+  rgb_to_rgba_scalar(source + i*3, dest + i*4, count - i);
+}
+
+static void rgba_to_rgb_neon(const uint8_t * source, uint8_t * dest, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t rgba = vld4q_u8(source + i*4);
+    uint8x16x3_t rgb;
+    rgb.val[0] = rgba.val[0];
+    rgb.val[1] = rgba.val[1];
+    rgb.val[2] = rgba.val[2];
+    vst3q_u8(dest + i*3, rgb);
+  }
+  rgba_to_rgb_scalar(source + i*4, dest + i*3, count - i);
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __PIXEL_CONVERT_H__
+#define __PIXEL_CONVERT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// pixel_converter_t converts between packed 3-byte pixels
+// and 4-byte pixels. Alpha is set to 0 when expanding and
+// dropped when packing. Rows with padding are converted
+// one row at a time.
+typedef struct {
+  const char * name;
+  void (*rgb_to_rgba)(const uint8_t * source, uint8_t * dest, size_t count);
+  void (*rgba_to_rgb)(const uint8_t * source, uint8_t * dest, size_t count);
+} pixel_converter_t;
+
+// pixel_converter returns the fastest converter which
+// the CPU supports.
+const pixel_converter_t * pixel_converter();
+
+// pixel_converters lists up to max converters which the
+// CPU supports, starting with the scalar one, and returns
+// how many there are.
+size_t pixel_converters(const pixel_converter_t ** out, size_t max);
+
+#endif
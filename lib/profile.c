@@ -0,0 +1,184 @@
+#include "profile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Pending events are collected in batches so that long
+// runs do not keep every event alive.
+#define MAX_PENDING 4096
+
+static int record_event(profile_t * profile, profile_pending_t * pending);
+static int compare_ulong(const void * a, const void * b);
+static int compare_label(const void * a, const void * b);
+static void print_label_summary(const char * label, cl_ulong * durations, size_t count,
+                                FILE * fp);
+
+profile_t * profile_new() {
+  profile_t * profile = (profile_t *)malloc(sizeof(profile_t));
+  if (!profile) {
+    return NULL;
+  }
+  bzero(profile, sizeof(profile_t));
+  return profile;
+}
+
+int profile_add(profile_t * profile, const char * label, int lane, cl_event event) {
+  if (profile->pendingCount == MAX_PENDING && profile_collect(profile)) {
+    return -1;
+  }
+
+  if (profile->pendingCount == profile->pendingCapacity) {
+    size_t capacity = profile->pendingCapacity ? profile->pendingCapacity * 2 : 64;
+    profile_pending_t * pending = (profile_pending_t *)realloc(profile->pending,
+      sizeof(profile_pending_t) * capacity);
+    if (!pending) {
+      return -1;
+    }
+    profile->pending = pending;
+    profile->pendingCapacity = capacity;
+  }
+
+  if (clRetainEvent(event)) {
+    return -1;
+  }
+  profile_pending_t * entry = &profile->pending[profile->pendingCount++];
+  snprintf(entry->label, sizeof(entry->label), "%s", label);
+  entry->lane = lane;
+  entry->event = event;
+  return 0;
+}
+
+int profile_collect(profile_t * profile) {
+  int res = 0;
+  for (size_t i = 0; i < profile->pendingCount; ++i) {
+    if (record_event(profile, &profile->pending[i])) {
+      res = -1;
+    }
+    clReleaseEvent(profile->pending[i].event);
+  }
+  profile->pendingCount = 0;
+  return res;
+}
+
+void profile_print_summary(profile_t * profile, FILE * fp) {
+  size_t count = profile->recordCount;
+  profile_record_t * sorted = (profile_record_t *)malloc(sizeof(profile_record_t) * (count + 1));
+  cl_ulong * durations = (cl_ulong *)malloc(sizeof(cl_ulong) * (count + 1));
+  if (!sorted || !durations) {
+    free(sorted);
+    free(durations);
+    return;
+  }
+  memcpy(sorted, profile->records, sizeof(profile_record_t) * count);
+  qsort(sorted, count, sizeof(profile_record_t), compare_label);
+
+  fprintf(fp, "%-24s %8s %12s %12s %12s\n", "command", "count", "total (us)", "p50 (us)",
+    "p99 (us)");
+  size_t groupStart = 0;
+  for (size_t i = 0; i < count; ++i) {
+    durations[i - groupStart] = sorted[i].end - sorted[i].start;
+    if (i + 1 == count || strcmp(sorted[i + 1].label, sorted[groupStart].label)) {
+      print_label_summary(sorted[groupStart].label, durations, i + 1 - groupStart, fp);
+      groupStart = i + 1;
+    }
+  }
+
+  free(sorted);
+  free(durations);
+}
+
+int profile_write_trace(profile_t * profile, const char * path) {
+  FILE * fp = fopen(path, "w");
+  if (!fp) {
+    return -1;
+  }
+
+  cl_ulong origin = 0;
+  for (size_t i = 0; i < profile->recordCount; ++i) {
+    if (i == 0 || profile->records[i].queued < origin) {
+      origin = profile->records[i].queued;
+    }
+  }
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (size_t i = 0; i < profile->recordCount; ++i) {
+    profile_record_t * r = &profile->records[i];
+    fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"queued_us\":%.3f,\"submit_us\":%.3f}}\n",
+      i ? "," : "", r->label, r->lane, (double)(r->start - origin) / 1000.0,
+      (double)(r->end - r->start) / 1000.0, (double)(r->queued - origin) / 1000.0,
+      (double)(r->submit - origin) / 1000.0);
+  }
+  fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+
+  return fclose(fp) ? -1 : 0;
+}
+
+void profile_free(profile_t * profile) {
+  for (size_t i = 0; i < profile->pendingCount; ++i) {
+    clReleaseEvent(profile->pending[i].event);
+  }
+  free(profile->pending);
+  free(profile->records);
+  free(profile);
+}
+
+static int record_event(profile_t * profile, profile_pending_t * pending) {
+  if (clWaitForEvents(1, &pending->event)) {
+    return -1;
+  }
+
+  if (profile->recordCount == profile->recordCapacity) {
+    size_t capacity = profile->recordCapacity ? profile->recordCapacity * 2 : 64;
+    profile_record_t * records = (profile_record_t *)realloc(profile->records,
+      sizeof(profile_record_t) * capacity);
+    if (!records) {
+      return -1;
+    }
+    profile->records = records;
+    profile->recordCapacity = capacity;
+  }
+
+  profile_record_t record;
+  memcpy(record.label, pending->label, sizeof(record.label));
+  record.lane = pending->lane;
+
+  cl_profiling_info infos[4] = {
+    CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+    CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END
+  };
+  cl_ulong * outputs[4] = {&record.queued, &record.submit, &record.start, &record.end};
+  for (int i = 0; i < 4; ++i) {
+    if (clGetEventProfilingInfo(pending->event, infos[i], sizeof(cl_ulong), outputs[i], NULL)) {
+      return -1;
+    }
+  }
+
+  profile->records[profile->recordCount++] = record;
+  return 0;
+}
+
+static int compare_ulong(const void * a, const void * b) {
+  cl_ulong x = *(const cl_ulong *)a;
+  cl_ulong y = *(const cl_ulong *)b;
+  return (x > y) - (x < y);
+}
+
+static int compare_label(const void * a, const void * b) {
+  return strcmp(((const profile_record_t *)a)->label, ((const profile_record_t *)b)->label);
+}
+
+static void print_label_summary(const char * label, cl_ulong * durations, size_t count,
+                                FILE * fp) {
+  cl_ulong total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += durations[i];
+  }
+  qsort(durations, count, sizeof(cl_ulong), compare_ulong);
+
+  // Nearest-rank percentiles.
+  cl_ulong p50 = durations[(count * 50 + 99) / 100 - 1];
+  cl_ulong p99 = durations[(count * 99 + 99) / 100 - 1];
+  fprintf(fp, "%-24s %8lu %12.1f %12.1f %12.1f\n", label, (unsigned long)count,
+    (double)total / 1000.0, (double)p50 / 1000.0, (double)p99 / 1000.0);
+}
@@ -0,0 +1,58 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <OpenCL/opencl.h>
+#include <stdio.h>
+
+#define PROFILE_MAX_LABEL 64
+
+typedef struct {
+  char label[PROFILE_MAX_LABEL];
+  int lane;
+  cl_ulong queued;
+  cl_ulong submit;
+  cl_ulong start;
+  cl_ulong end;
+} profile_record_t;
+
+typedef struct {
+  char label[PROFILE_MAX_LABEL];
+  int lane;
+  cl_event event;
+} profile_pending_t;
+
+// profile_t records the device timestamps of commands
+// submitted on a queue created with profiling enabled.
+typedef struct {
+  size_t pendingCount;
+  size_t pendingCapacity;
+  profile_pending_t * pending;
+
+  size_t recordCount;
+  size_t recordCapacity;
+  profile_record_t * records;
+} profile_t;
+
+profile_t * profile_new();
+
+// profile_add retains event and records its timestamps
+// once it completes (see profile_collect). The lane is
+// shown as the thread of the event in traces, e.g. one
+// lane per queue.
+int profile_add(profile_t * profile, const char * label, int lane, cl_event event);
+
+// profile_collect waits for every pending event and
+// turns it into a record.
+int profile_collect(profile_t * profile);
+
+// profile_print_summary prints the count, total, p50 and
+// p99 durations of each label.
+void profile_print_summary(profile_t * profile, FILE * fp);
+
+// profile_write_trace writes every record as a Chrome
+// trace (load it in chrome://tracing or Perfetto).
+int profile_write_trace(profile_t * profile, const char * path);
+
+void profile_free(profile_t * profile);
+
+#endif
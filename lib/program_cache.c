@@ -0,0 +1,314 @@
+#include "program_cache.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef PRINT_PROGRAM_LOG
+#define PRINT_PROGRAM_LOG 1
+#endif
+
+#ifndef PRINT_CACHE_LOG
+#define PRINT_CACHE_LOG 0
+#endif
+
+#define CACHE_DIR_ENV "LEARNING_CL_CACHE_DIR"
+#define CACHE_DIR_NAME "learning-cl-cache"
+#define MAX_DEVICE_STRING 256
+#define MAX_PATH 1024
+
+typedef struct cache_entry {
+  uint64_t key;
+  size_t binarySize;
+  unsigned char * binary;
+  struct cache_entry * next;
+} cache_entry_t;
+
+static cache_entry_t * memoryCache = NULL;
+static program_cache_stats_t cacheStats;
+
+static int program_key(cl_device_id device, const char * source, uint64_t * keyOut);
+static uint64_t hash_bytes(uint64_t hash, const void * data, size_t size);
+static int cache_path(uint64_t key, char * pathOut);
+static cache_entry_t * memory_lookup(uint64_t key);
+static cache_entry_t * memory_insert(uint64_t key, unsigned char * binary, size_t size);
+static cache_entry_t * disk_lookup(uint64_t key);
+static void disk_insert(uint64_t key, cache_entry_t * entry);
+static cl_program build_binary(cl_context context, cl_device_id device, cache_entry_t * entry);
+static cl_program build_source(cl_context context, cl_device_id device, const char * source);
+static cache_entry_t * extract_binary(uint64_t key, cl_program program);
+static long long microtime();
+
+cl_program program_cache_build(cl_context context, cl_device_id device,
+                               const char * source) {
+  long long startTime = microtime();
+
+  uint64_t key;
+  if (program_key(device, source, &key)) {
+    cl_program program = build_source(context, device, source);
+    cacheStats.buildMicros += microtime() - startTime;
+    return program;
+  }
+
+  cache_entry_t * entry = memory_lookup(key);
+  if (entry) {
+    cl_program program = build_binary(context, device, entry);
+    if (program) {
+      ++cacheStats.memoryHits;
+      cacheStats.buildMicros += microtime() - startTime;
+      if (PRINT_CACHE_LOG) {
+        fprintf(stderr, "program cache: memory hit %016llx\n", (unsigned long long)key);
+      }
+      return program;
+    }
+  }
+
+  entry = disk_lookup(key);
+  if (entry) {
+    cl_program program = build_binary(context, device, entry);
+    if (program) {
+      ++cacheStats.diskHits;
+      cacheStats.buildMicros += microtime() - startTime;
+      if (PRINT_CACHE_LOG) {
+        fprintf(stderr, "program cache: disk hit %016llx\n", (unsigned long long)key);
+      }
+      return program;
+    }
+  }
+
+  ++cacheStats.misses;
+  cl_program program = build_source(context, device, source);
+  if (program) {
+    entry = extract_binary(key, program);
+    if (entry) {
+      disk_insert(key, entry);
+    }
+  }
+  cacheStats.buildMicros += microtime() - startTime;
+  if (PRINT_CACHE_LOG) {
+    fprintf(stderr, "program cache: miss %016llx\n", (unsigned long long)key);
+  }
+  return program;
+}
+
+void program_cache_stats(program_cache_stats_t * out) {
+  (*out) = cacheStats;
+}
+
+void program_cache_print_stats(FILE * fp) {
+  fprintf(fp, "Program cache: %lu memory hits, %lu disk hits, %lu misses, %.1f ms building.\n",
+    cacheStats.memoryHits, cacheStats.diskHits, cacheStats.misses,
+    (double)cacheStats.buildMicros / 1000.0);
+}
+
+static int program_key(cl_device_id device, const char * source, uint64_t * keyOut) {
+  char name[MAX_DEVICE_STRING];
+  char driver[MAX_DEVICE_STRING];
+  bzero(name, sizeof(name));
+  bzero(driver, sizeof(driver));
+  if (clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name)-1, name, NULL) ||
+      clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver)-1, driver, NULL)) {
+    return -1;
+  }
+
+  // FNV-1a over each string including its terminator.
+  uint64_t hash = 14695981039346656037ULL;
+  hash = hash_bytes(hash, source, strlen(source) + 1);
+  hash = hash_bytes(hash, name, strlen(name) + 1);
+  hash = hash_bytes(hash, driver, strlen(driver) + 1);
+  (*keyOut) = hash;
+  return 0;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void * data, size_t size) {
+  const unsigned char * bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static int cache_path(uint64_t key, char * pathOut) {
+  char dir[MAX_PATH - 64];
+  const char * envDir = getenv(CACHE_DIR_ENV);
+  if (envDir) {
+    if (!envDir[0]) {
+      return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s", envDir);
+  } else {
+    const char * tmpDir = getenv("TMPDIR");
+    if (!tmpDir || !tmpDir[0]) {
+      tmpDir = "/tmp";
+    }
+    snprintf(dir, sizeof(dir), "%s/%s", tmpDir, CACHE_DIR_NAME);
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    return -1;
+  }
+  snprintf(pathOut, MAX_PATH, "%s/%016llx.clbin", dir, (unsigned long long)key);
+  return 0;
+}
+
+static cache_entry_t * memory_lookup(uint64_t key) {
+  for (cache_entry_t * entry = memoryCache; entry; entry = entry->next) {
+    if (entry->key == key) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static cache_entry_t * memory_insert(uint64_t key, unsigned char * binary, size_t size) {
+  cache_entry_t * entry = memory_lookup(key);
+  if (entry) {
+    free(entry->binary);
+  } else {
+    entry = (cache_entry_t *)malloc(sizeof(cache_entry_t));
+    if (!entry) {
+      free(binary);
+      return NULL;
+    }
+    entry->key = key;
+    entry->next = memoryCache;
+    memoryCache = entry;
+  }
+  entry->binary = binary;
+  entry->binarySize = size;
+  return entry;
+}
+
+static cache_entry_t * disk_lookup(uint64_t key) {
+  char path[MAX_PATH];
+  if (cache_path(key, path)) {
+    return NULL;
+  }
+
+  FILE * fp = fopen(path, "rb");
+  if (!fp) {
+    return NULL;
+  }
+
+  if (fseek(fp, 0, SEEK_END)) {
+    fclose(fp);
+    return NULL;
+  }
+  long size = ftell(fp);
+  if (size <= 0 || fseek(fp, 0, SEEK_SET)) {
+    fclose(fp);
+    return NULL;
+  }
+
+  unsigned char * binary = (unsigned char *)malloc((size_t)size);
+  if (!binary) {
+    fclose(fp);
+    return NULL;
+  }
+  if (fread(binary, 1, (size_t)size, fp) != (size_t)size) {
+    free(binary);
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+
+  return memory_insert(key, binary, (size_t)size);
+}
+
+static void disk_insert(uint64_t key, cache_entry_t * entry) {
+  char path[MAX_PATH];
+  if (cache_path(key, path)) {
+    return;
+  }
+
+  // Write to a private file and rename it into place so that
+  // concurrent processes never see a partial binary.
+  char tmpPath[MAX_PATH + 32];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%ld.tmp", path, (long)getpid());
+  FILE * fp = fopen(tmpPath, "wb");
+  if (!fp) {
+    return;
+  }
+  size_t written = fwrite(entry->binary, 1, entry->binarySize, fp);
+  if (fclose(fp) || written != entry->binarySize || rename(tmpPath, path)) {
+    unlink(tmpPath);
+  }
+}
+
+static cl_program build_binary(cl_context context, cl_device_id device, cache_entry_t * entry) {
+  cl_int statusCode;
+  cl_int binaryStatus;
+  const unsigned char * binary = entry->binary;
+  cl_program program = clCreateProgramWithBinary(context, 1, &device, &entry->binarySize,
+    &binary, &binaryStatus, &statusCode);
+  if (statusCode || binaryStatus) {
+    if (program) {
+      clReleaseProgram(program);
+    }
+    return NULL;
+  }
+  if (clBuildProgram(program, 1, &device, NULL, NULL, NULL)) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  return program;
+}
+
+static cl_program build_source(cl_context context, cl_device_id device, const char * source) {
+  cl_int statusCode;
+  size_t sourceLen = strlen(source);
+  cl_program program = clCreateProgramWithSource(context, 1, &source, &sourceLen, &statusCode);
+  if (statusCode) {
+    return NULL;
+  }
+
+  if (clBuildProgram(program, 1, &device, NULL, NULL, NULL)) {
+    if (PRINT_PROGRAM_LOG) {
+      size_t logSize;
+      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+
+      char * logInfo = (char *)malloc(logSize);
+      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, logInfo, NULL);
+
+      printf("%s\n", logInfo);
+      free(logInfo);
+    }
+
+    clReleaseProgram(program);
+    return NULL;
+  }
+
+  return program;
+}
+
+static cache_entry_t * extract_binary(uint64_t key, cl_program program) {
+  size_t binarySize;
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binarySize), &binarySize, NULL)) {
+    return NULL;
+  }
+  if (binarySize == 0) {
+    return NULL;
+  }
+
+  unsigned char * binary = (unsigned char *)malloc(binarySize);
+  if (!binary) {
+    return NULL;
+  }
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL)) {
+    free(binary);
+    return NULL;
+  }
+
+  return memory_insert(key, binary, binarySize);
+}
+
+static long long microtime() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return ((long long)t.tv_sec)*1000000 + (long long)t.tv_usec;
+}
@@ -0,0 +1,28 @@
+#ifndef __PROGRAM_CACHE_H__
+#define __PROGRAM_CACHE_H__
+
+#include <OpenCL/opencl.h>
+#include <stdio.h>
+
+typedef struct {
+  unsigned long memoryHits;
+  unsigned long diskHits;
+  unsigned long misses;
+  long long buildMicros;
+} program_cache_stats_t;
+
+// program_cache_build returns a built program for the
+// given source, reusing a compiled binary when possible.
+//
+// Binaries are keyed on a hash of the source, the device
+// name and the driver version. They are kept in memory
+// for the life of the process and on disk in the
+// directory named by $LEARNING_CL_CACHE_DIR (default
+// $TMPDIR/learning-cl-cache). Setting the variable to an
+// empty string disables the disk cache.
+cl_program program_cache_build(cl_context context, cl_device_id device,
+                               const char * source);
+void program_cache_stats(program_cache_stats_t * out);
+void program_cache_print_stats(FILE * fp);
+
+#endif
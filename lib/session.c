@@ -0,0 +1,182 @@
+#include "session.h"
+#include "program_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define PROFILE_ENV "LEARNING_CL_PROFILE"
+
+session_t * session_create(session_params_t * params) {
+  cl_int statusCode;
+
+  cl_platform_id platform;
+  cl_device_id device = device_select(params ? params->device : NULL, &platform);
+  if (!device) {
+    return NULL;
+  }
+
+  session_t * session = (session_t *)malloc(sizeof(session_t));
+  if (!session) {
+    return NULL;
+  }
+  bzero(session, sizeof(session_t));
+
+  session->platform = platform;
+  session->device = device;
+
+  session->context = clCreateContext(0, 1, &device, NULL, NULL, &statusCode);
+  if (statusCode) {
+    session_free(session);
+    return NULL;
+  }
+
+  if (clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool),
+      &session->unifiedMemory, NULL)) {
+    session->unifiedMemory = CL_FALSE;
+  }
+
+  // Host-allocated memory can be mapped without a copy.
+  cl_mem_flags poolFlags = CL_MEM_READ_WRITE;
+  if (session->unifiedMemory) {
+    poolFlags |= CL_MEM_ALLOC_HOST_PTR;
+  }
+  session->pool = buffer_pool_new(session->context, device, poolFlags,
+    params ? params->arenaSize : 0);
+  if (!session->pool) {
+    session_free(session);
+    return NULL;
+  }
+
+  const char * tracePath = getenv(PROFILE_ENV);
+  if (tracePath && tracePath[0]) {
+    session->tracePath = (char *)malloc(strlen(tracePath) + 1);
+    if (!session->tracePath) {
+      session_free(session);
+      return NULL;
+    }
+    strcpy(session->tracePath, tracePath);
+  }
+
+  cl_command_queue_properties props = 0;
+  if ((params && params->profile) || session->tracePath) {
+    props |= CL_QUEUE_PROFILING_ENABLE;
+    session->profile = profile_new();
+    if (!session->profile) {
+      session_free(session);
+      return NULL;
+    }
+  }
+
+  session->queue = clCreateCommandQueue(session->context, device, props, &statusCode);
+  if (statusCode) {
+    session_free(session);
+    return NULL;
+  }
+
+  session->transferQueue = clCreateCommandQueue(session->context, device, props, &statusCode);
+  if (statusCode) {
+    session_free(session);
+    return NULL;
+  }
+
+  session->downloadQueue = clCreateCommandQueue(session->context, device, props, &statusCode);
+  if (statusCode) {
+    session_free(session);
+    return NULL;
+  }
+
+  return session;
+}
+
+cl_program session_program(session_t * session, const char * source) {
+  for (size_t i = 0; i < session->programCount; ++i) {
+    if (!strcmp(session->programSources[i], source)) {
+      return session->programs[i];
+    }
+  }
+
+  cl_program program = program_cache_build(session->context, session->device, source);
+  if (!program) {
+    return NULL;
+  }
+
+  size_t count = session->programCount + 1;
+  char ** sources = (char **)realloc(session->programSources, sizeof(char *) * count);
+  if (!sources) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  session->programSources = sources;
+
+  cl_program * programs = (cl_program *)realloc(session->programs, sizeof(cl_program) * count);
+  if (!programs) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  session->programs = programs;
+
+  size_t sourceSize = strlen(source) + 1;
+  char * sourceCopy = (char *)malloc(sourceSize);
+  if (!sourceCopy) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  memcpy(sourceCopy, source, sourceSize);
+
+  sources[count - 1] = sourceCopy;
+  programs[count - 1] = program;
+  session->programCount = count;
+  return program;
+}
+
+void session_free(session_t * session) {
+  if (session->queue) {
+    clFlush(session->queue);
+    clFinish(session->queue);
+  }
+  if (session->transferQueue) {
+    clFlush(session->transferQueue);
+    clFinish(session->transferQueue);
+  }
+  if (session->downloadQueue) {
+    clFlush(session->downloadQueue);
+    clFinish(session->downloadQueue);
+  }
+  if (session->profile) {
+    profile_collect(session->profile);
+    if (session->tracePath) {
+      profile_print_summary(session->profile, stderr);
+      if (session->pool) {
+        buffer_pool_print_stats(session->pool, stderr);
+      }
+      if (profile_write_trace(session->profile, session->tracePath)) {
+        fprintf(stderr, "Could not write trace: %s\n", session->tracePath);
+      }
+    }
+    profile_free(session->profile);
+  }
+  for (size_t i = 0; i < session->programCount; ++i) {
+    clReleaseProgram(session->programs[i]);
+    free(session->programSources[i]);
+  }
+  if (session->pool) {
+    buffer_pool_free(session->pool);
+  }
+  if (session->queue) {
+    clReleaseCommandQueue(session->queue);
+  }
+  if (session->transferQueue) {
+    clReleaseCommandQueue(session->transferQueue);
+  }
+  if (session->downloadQueue) {
+    clReleaseCommandQueue(session->downloadQueue);
+  }
+  if (session->context) {
+    clReleaseContext(session->context);
+  }
+  free(session->programs);
+  free(session->programSources);
+  free(session->tracePath);
+  free(session);
+}
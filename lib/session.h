@@ -0,0 +1,67 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <OpenCL/opencl.h>
+#include "buffer_pool.h"
+#include "device.h"
+#include "profile.h"
+
+// session_t holds the long-lived OpenCL state (device,
+// context, queue and built programs) which many jobs
+// can share. Per-job kernels and buffers live in a
+// context_t created against the session.
+typedef struct {
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+
+  // transferQueue and downloadQueue are in-order queues
+  // for uploads and downloads respectively, so that copies
+  // in each direction can overlap kernels running on queue
+  // and each other.
+  cl_command_queue transferQueue;
+  cl_command_queue downloadQueue;
+
+  // unifiedMemory is set when the device shares memory
+  // with the host, so mapping a buffer needs no copy.
+  cl_bool unifiedMemory;
+
+  // pool recycles the buffers of contexts created in the
+  // session.
+  buffer_pool_t * pool;
+
+  // profile is non-NULL when profiling is enabled.
+  profile_t * profile;
+  char * tracePath;
+
+  size_t programCount;
+  char ** programSources;
+  cl_program * programs;
+} session_t;
+
+typedef struct {
+  // device chooses the device (see device_select). If it
+  // is NULL, $LEARNING_CL_DEVICE or the default is used.
+  device_select_t * device;
+
+  // profile enables profiling of every command.
+  int profile;
+
+  // arenaSize, if non-zero, is the size of a device
+  // buffer which the pool carves buffers from.
+  size_t arenaSize;
+} session_params_t;
+
+// session_create creates a session. If params is NULL,
+// defaults are used.
+//
+// If $LEARNING_CL_PROFILE names a file, profiling is
+// enabled and session_free prints a summary to stderr and
+// writes a Chrome trace to that file, along with the
+// buffer pool's statistics.
+session_t * session_create(session_params_t * params);
+cl_program session_program(session_t * session, const char * source);
+void session_free(session_t * session);
+
+#endif
@@ -1,60 +1,622 @@
 #include "blur.h"
+#include "bmp_upload.h"
 #include "context.h"
+#include "device.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
+#define INPUT_BUFF 0
+#define OUTPUT_BUFF 1
+#define WEIGHTS_BUFF 2
+#define TEMP_BUFF 3
+
+#define DIRECT_KERNEL 0
+#define ROWS_KERNEL 1
+#define COLS_KERNEL 2
+#define TILED_KERNEL 3
+#define BOX_ROWS_KERNEL 4
+#define BOX_COLS_KERNEL 5
+
+#define BATCH_ROWS_KERNEL 0
+#define BATCH_COLS_KERNEL 1
+
+// Batch buffers: the shared weights, then for each slot
+// the packed pixels, the float4 temporary, the image
+// table and the row table.
+#define BATCH_WEIGHTS_BUFF 0
+#define BATCH_PIXELS_BUFF(slot) (1 + (slot)*4)
+#define BATCH_TEMP_BUFF(slot) (2 + (slot)*4)
+#define BATCH_IMAGES_BUFF(slot) (3 + (slot)*4)
+#define BATCH_ROWS_BUFF(slot) (4 + (slot)*4)
+#define BATCH_SLOTS 2
+
+#define STRIP_ROWS_KERNEL 0
+#define STRIP_COLS_KERNEL 1
+
+// Strip buffers: the shared weights, then for each slot
+// the strip with its apron rows, the float4 temporary and
+// the blurred rows.
+#define STRIP_WEIGHTS_BUFF 0
+#define STRIP_INPUT_BUFF(slot) (1 + (slot)*3)
+#define STRIP_TEMP_BUFF(slot) (2 + (slot)*3)
+#define STRIP_OUTPUT_BUFF(slot) (3 + (slot)*3)
+#define STRIP_SLOTS 2
+
+// STRIP_PIXELS is the target number of pixels per strip.
+#define STRIP_PIXELS (1 << 22)
+// STRIP_PITCH_ALIGN aligns the rows of the host strips.
+#define STRIP_PITCH_ALIGN 64
+
+// BATCH_PIXELS is the target number of pixels per batch.
+// Larger images get a batch of their own.
+#define BATCH_PIXELS (1 << 21)
+
+#define BOX_COUNT 3
+
+#define MAX_TILE_SIDE 16
+#define MIN_TILE_SIDE 4
+
+static blur_mode_t resolve_mode(blur_options_t * opts, session_t * session, bmp_t * image,
+                                int radius);
+static int choose_tile(size_t maxWorkGroup, cl_ulong localMem, int radius, size_t * tileOut);
+static size_t tile_local_size(size_t * tile, int radius);
 static cl_float * make_weights(int radius, cl_float sigma);
-static context_t * create_blur_context(bmp_t * input, int radius, cl_float * weights);
-static int run_blur_context(context_t * ctx, bmp_t * input, int radius);
+static cl_float * make_weights_2d(int radius, cl_float * weights);
+static void make_box_radii(cl_float sigma, cl_int * radii);
+static context_t * create_context(session_t * session, context_params_t * params);
+static context_t * create_blur_context(session_t * session, bmp_t * input,
+                                       bmp_mapping_t * map, int radius, cl_float * weights,
+                                       cl_uchar4 * output, blur_mode_t mode,
+                                       blur_border_t border, size_t * tile);
+static int run_blur_context(context_t * ctx, bmp_t * input, int radius, cl_float sigma,
+                            blur_mode_t mode, blur_border_t border, size_t * tile);
+static int run_box_passes(context_t * ctx, bmp_t * input, cl_int * radii,
+                          blur_border_t border);
+
+typedef struct {
+  size_t first;
+  size_t count;
+  size_t pixels;
+  size_t rows;
+  size_t maxWidth;
+} blur_batch_t;
+
+typedef struct {
+  cl_uchar4 * pixels;
+  cl_int4 * images;
+  cl_int * rows;
+  blur_batch_t * batch;
+  cl_event download;
+} blur_slot_t;
+
+typedef struct {
+  cl_uchar4 * input;
+  cl_uchar4 * output;
+  int firstRow;
+  int rowCount;
+  int busy;
+  cl_event download;
+} blur_strip_t;
+
+typedef struct {
+  blur_stream_t * stream;
+  blur_border_t border;
+  int radius;
+  int stripRows;
+  size_t pitch;
+
+  // wrapRows holds the top rows which the last strip
+  // needs under BLUR_BORDER_WRAP, read before any rows
+  // are written back.
+  cl_uchar4 * wrapRows;
+  int wrapCount;
+} blur_strips_t;
+
+static int plan_strips(session_t * session, int width, int height, int radius,
+                       int * stripRowsOut);
+static context_t * create_strip_context(session_t * session, blur_strips_t * strips,
+                                        cl_float * weights);
+static int read_strip(blur_strips_t * strips, blur_strip_t * strip);
+static int queue_strip(context_t * ctx, int slotIdx, blur_strips_t * strips,
+                       blur_strip_t * strip);
+static int border_row(int y, int height, blur_border_t border);
+// image_source_t backs a blur_stream_t with a bmp_t, whose
+// rows are read from map instead when it is non-NULL.
+typedef struct {
+  bmp_t * image;
+  bmp_mapping_t * map;
+} image_source_t;
+
+// file_streams_t backs a blur_stream_t with BMP files.
+typedef struct {
+  bmp_reader_t * reader;
+  bmp_writer_t * writer;
+} file_streams_t;
+
+static int blur_in_session(session_t * session, bmp_t * image, bmp_mapping_t * map,
+                           int radius, cl_float sigma, blur_options_t * opts);
+static int stream_files(session_t * session, bmp_reader_t * reader, const char * outputPath,
+                        int radius, cl_float sigma, blur_border_t border);
+static int read_file_rows(blur_stream_t * stream, int y, int count, cl_uchar4 * rows,
+                          size_t pitch);
+static int write_file_rows(blur_stream_t * stream, int y, int count, const cl_uchar4 * rows,
+                           size_t pitch);
+static int read_image_rows(blur_stream_t * stream, int y, int count, cl_uchar4 * rows,
+                           size_t pitch);
+static int write_image_rows(blur_stream_t * stream, int y, int count, const cl_uchar4 * rows,
+                            size_t pitch);
+
+static size_t plan_batches(bmp_t ** images, size_t count, blur_batch_t * batches);
+static context_t * create_batch_context(session_t * session, blur_batch_t * batches,
+                                        size_t batchCount, int radius, cl_float * weights);
+static int queue_batch(context_t * ctx, int slotIdx, blur_slot_t * slot, bmp_t ** images,
+                       cl_int radius, cl_int border);
+static void unpack_batch(blur_slot_t * slot, bmp_t ** images);
 
 int blur_image(bmp_t * image, int radius, cl_float sigma) {
+  return blur_image_with(image, radius, sigma, NULL);
+}
+
+int blur_image_with(bmp_t * image, int radius, cl_float sigma, blur_options_t * opts) {
+  session_t * session = opts ? opts->session : NULL;
+  session_t * ownSession = NULL;
+  if (!session) {
+    session = ownSession = session_create(NULL);
+    if (!session) {
+      return -1;
+    }
+  }
+
+  int res = blur_in_session(session, image, NULL, radius, sigma, opts);
+  if (ownSession) {
+    session_free(ownSession);
+  }
+  return res;
+}
+
+bmp_t * blur_file(const char * path, int radius, cl_float sigma, blur_options_t * opts) {
+  bmp_mapping_t * map = bmp_map(path);
+  if (!map) {
+    return NULL;
+  }
+
+  bmp_t * image = (bmp_t *)malloc(sizeof(bmp_t));
+  if (!image) {
+    bmp_unmap(map);
+    return NULL;
+  }
+  image->width = map->width;
+  image->height = map->height;
+  image->pixels = NULL;
+
+  session_t * session = opts ? opts->session : NULL;
+  session_t * ownSession = NULL;
+  if (!session) {
+    session = ownSession = session_create(NULL);
+  }
+  int res = -1;
+  if (session) {
+    res = blur_in_session(session, image, map, radius, sigma, opts);
+  }
+  if (ownSession) {
+    session_free(ownSession);
+  }
+  bmp_unmap(map);
+
+  if (res) {
+    free(image->pixels);
+    free(image);
+    return NULL;
+  }
+  return image;
+}
+
+int blur_file_to(const char * inputPath, const char * outputPath, int radius, cl_float sigma,
+                 blur_options_t * opts) {
+  bmp_reader_t * reader = bmp_reader_open(inputPath);
+  if (!reader) {
+    return -1;
+  }
+
+  session_t * session = opts ? opts->session : NULL;
+  session_t * ownSession = NULL;
+  if (!session) {
+    session = ownSession = session_create(NULL);
+    if (!session) {
+      bmp_reader_close(reader);
+      return -1;
+    }
+  }
+
+  blur_options_t sessionOpts = {session, BLUR_MODE_AUTO, BLUR_BORDER_CLAMP};
+  if (opts) {
+    sessionOpts.mode = opts->mode;
+    sessionOpts.border = opts->border;
+  }
+  bmp_t shape = {reader->width, reader->height, NULL};
+  int res = -1;
+  if (resolve_mode(&sessionOpts, session, &shape, radius) == BLUR_MODE_STRIPS) {
+    res = stream_files(session, reader, outputPath, radius, sigma, sessionOpts.border);
+    bmp_reader_close(reader);
+  } else {
+    bmp_reader_close(reader);
+    bmp_t * image = blur_file(inputPath, radius, sigma, &sessionOpts);
+    if (image) {
+      res = bmp_write(image, outputPath);
+      bmp_free(image);
+    }
+  }
+
+  if (ownSession) {
+    session_free(ownSession);
+  }
+  return res;
+}
+
+// blur_in_session blurs an image whose pixels are either
+// in image->pixels or, if map is non-NULL, still in the
+// mapped file. The result replaces image->pixels.
+static int blur_in_session(session_t * session, bmp_t * image, bmp_mapping_t * map,
+                           int radius, cl_float sigma, blur_options_t * opts) {
+  blur_mode_t mode = resolve_mode(opts, session, image, radius);
+  blur_border_t border = opts ? opts->border : BLUR_BORDER_CLAMP;
+  if (mode == BLUR_MODE_STRIPS) {
+    // Strips are decoded from the mapping as they are read.
+    if (!image->pixels) {
+      image->pixels = bmp_alloc_pixels(image->width, image->height);
+      if (!image->pixels) {
+        return -1;
+      }
+    }
+    image_source_t source = {image, map};
+    blur_stream_t stream = {image->width, image->height, &source, read_image_rows,
+      write_image_rows};
+    blur_options_t stripOpts = {session, mode, border};
+    return blur_stream(&stream, radius, sigma, &stripOpts);
+  }
+
   cl_float * weights = make_weights(radius, sigma);
   if (!weights) {
     return -1;
   }
 
-  context_t * ctx = create_blur_context(image, radius, weights);
+  // The blurred pixels are written straight into a new
+  // pixel array which then replaces the image's pixels.
+  cl_uchar4 * pixels = bmp_alloc_pixels(image->width, image->height);
+  if (!pixels) {
+    free(weights);
+    return -1;
+  }
+
+  size_t tile[2];
+  context_t * ctx = create_blur_context(session, image, map, radius, weights, pixels, mode,
+    border, tile);
+  if (!ctx && mode == BLUR_MODE_TILED && (!opts || opts->mode == BLUR_MODE_AUTO)) {
+    // The tiled kernel needs more resources than the
+    // device reported up front.
+    mode = BLUR_MODE_SEPARABLE;
+    ctx = create_blur_context(session, image, map, radius, weights, pixels, mode, border,
+      tile);
+  }
   free(weights);
 
-  if (!ctx) {
-    return -1;
+  int res = -1;
+  if (ctx && !run_blur_context(ctx, image, radius, sigma, mode, border, tile)) {
+    // Mapping synchronizes the output with its host memory,
+    // which is free when the device shares that memory.
+    void * output = context_map(ctx, OUTPUT_BUFF, CL_FALSE);
+    if (output) {
+      if (output != (void *)pixels) {
+        memcpy(pixels, output, ctx->bufferSizes[OUTPUT_BUFF]);
+      }
+      context_unmap(ctx, OUTPUT_BUFF, output);
+      res = 0;
+    }
   }
 
-  if (run_blur_context(ctx, image, radius)) {
+  if (ctx) {
     context_free(ctx);
+  }
+  if (res) {
+    free(pixels);
+  } else {
+    free(image->pixels);
+    image->pixels = pixels;
+  }
+  return res;
+}
+
+int blur_stream(blur_stream_t * stream, int radius, cl_float sigma, blur_options_t * opts) {
+  if (stream->width <= 0 || stream->height <= 0) {
     return -1;
   }
 
-  void * output = context_map(ctx, 1, CL_FALSE);
-  if (!output) {
+  session_t * session = opts ? opts->session : NULL;
+  session_t * ownSession = NULL;
+  if (!session) {
+    session = ownSession = session_create(NULL);
+    if (!session) {
+      return -1;
+    }
+  }
+
+  blur_strips_t strips;
+  bzero(&strips, sizeof(strips));
+  strips.stream = stream;
+  strips.border = (opts ? opts->border : BLUR_BORDER_CLAMP);
+  strips.radius = radius;
+  size_t rowSize = stream->width * sizeof(cl_uchar4);
+  strips.pitch = (rowSize + STRIP_PITCH_ALIGN - 1) / STRIP_PITCH_ALIGN * STRIP_PITCH_ALIGN;
+
+  context_t * ctx = NULL;
+  cl_float * weights = make_weights(radius, sigma);
+  if (weights && !plan_strips(session, stream->width, stream->height, radius,
+                              &strips.stripRows)) {
+    ctx = create_strip_context(session, &strips, weights);
+  }
+  free(weights);
+
+  blur_strip_t slots[STRIP_SLOTS];
+  bzero(slots, sizeof(slots));
+  int res = (ctx ? 0 : -1);
+  for (int i = 0; i < STRIP_SLOTS && !res; ++i) {
+    slots[i].input = (cl_uchar4 *)malloc(strips.pitch * (strips.stripRows + radius*2));
+    slots[i].output = (cl_uchar4 *)malloc(strips.pitch * strips.stripRows);
+    if (!slots[i].input || !slots[i].output) {
+      res = -1;
+    }
+  }
+
+  if (!res && strips.border == BLUR_BORDER_WRAP && strips.stripRows < stream->height) {
+    strips.wrapCount = (radius < stream->height ? radius : stream->height);
+    strips.wrapRows = (cl_uchar4 *)malloc(strips.pitch * strips.wrapCount);
+    if (!strips.wrapRows ||
+        stream->read_rows(stream, 0, strips.wrapCount, strips.wrapRows, strips.pitch)) {
+      res = -1;
+    }
+  }
+
+  // A slot's blurred rows are written back just before
+  // the slot is reused. The strip read then starts at
+  // least stripRows - radius rows below them, so every
+  // row is read before it is overwritten.
+  int stripCount = (stream->height + strips.stripRows - 1) / strips.stripRows;
+  for (int i = 0; i < stripCount && !res; ++i) {
+    int slotIdx = i % STRIP_SLOTS;
+    blur_strip_t * strip = &slots[slotIdx];
+    if (strip->busy) {
+      strip->busy = 0;
+      if (clWaitForEvents(1, &strip->download) ||
+          stream->write_rows(stream, strip->firstRow, strip->rowCount, strip->output,
+            strips.pitch)) {
+        res = -1;
+      }
+    }
+    strip->firstRow = i * strips.stripRows;
+    strip->rowCount = stream->height - strip->firstRow;
+    if (strip->rowCount > strips.stripRows) {
+      strip->rowCount = strips.stripRows;
+    }
+    if (res || read_strip(&strips, strip)) {
+      if (strip->download) {
+        clReleaseEvent(strip->download);
+      }
+      res = -1;
+      break;
+    }
+    if (queue_strip(ctx, slotIdx, &strips, strip)) {
+      res = -1;
+      break;
+    }
+    strip->busy = 1;
+    if (context_flush(ctx)) {
+      res = -1;
+      break;
+    }
+  }
+
+  for (int i = 0; i < STRIP_SLOTS; ++i) {
+    blur_strip_t * strip = &slots[(stripCount + i) % STRIP_SLOTS];
+    if (!strip->busy) {
+      continue;
+    }
+    if (clWaitForEvents(1, &strip->download)) {
+      res = -1;
+    } else if (!res && stream->write_rows(stream, strip->firstRow, strip->rowCount,
+                 strip->output, strips.pitch)) {
+      res = -1;
+    }
+    clReleaseEvent(strip->download);
+  }
+
+  // A failed strip may still have its upload queued from
+  // the slot's host memory, and context_free waits for it.
+  if (ctx) {
     context_free(ctx);
+  }
+  for (int i = 0; i < STRIP_SLOTS; ++i) {
+    free(slots[i].input);
+    free(slots[i].output);
+  }
+  free(strips.wrapRows);
+  if (ownSession) {
+    session_free(ownSession);
+  }
+  return res;
+}
+
+int blur_images(bmp_t ** images, size_t count, int radius, cl_float sigma,
+                blur_options_t * opts) {
+  for (size_t i = 0; i < count; ++i) {
+    if (images[i]->width <= 0 || images[i]->height <= 0) {
+      return -1;
+    }
+  }
+  if (!count) {
+    return 0;
+  }
+
+  blur_batch_t * batches = (blur_batch_t *)malloc(sizeof(blur_batch_t) * count);
+  if (!batches) {
     return -1;
   }
-  memcpy(image->pixels, output, ctx->bufferSizes[0]);
-  context_unmap(ctx, 1, output);
+  size_t batchCount = plan_batches(images, count, batches);
 
-  context_free(ctx);
-  return 0;
+  session_t * session = opts ? opts->session : NULL;
+  session_t * ownSession = NULL;
+  if (!session) {
+    session = ownSession = session_create(NULL);
+    if (!session) {
+      free(batches);
+      return -1;
+    }
+  }
+
+  context_t * ctx = NULL;
+  cl_float * weights = make_weights(radius, sigma);
+  if (weights) {
+    ctx = create_batch_context(session, batches, batchCount, radius, weights);
+    free(weights);
+  }
+
+  blur_slot_t slots[BATCH_SLOTS];
+  bzero(slots, sizeof(slots));
+  int res = (ctx ? 0 : -1);
+  for (int i = 0; i < BATCH_SLOTS && !res; ++i) {
+    slots[i].pixels = (cl_uchar4 *)malloc(ctx->bufferSizes[BATCH_PIXELS_BUFF(i)]);
+    slots[i].images = (cl_int4 *)malloc(ctx->bufferSizes[BATCH_IMAGES_BUFF(i)]);
+    slots[i].rows = (cl_int *)malloc(ctx->bufferSizes[BATCH_ROWS_BUFF(i)]);
+    if (!slots[i].pixels || !slots[i].images || !slots[i].rows) {
+      res = -1;
+    }
+  }
+
+  // While the device blurs one batch, the host packs the
+  // next one into the other slot and queues its upload.
+  cl_int borderMode = (opts ? opts->border : BLUR_BORDER_CLAMP);
+  for (size_t i = 0; i < batchCount && !res; ++i) {
+    int slotIdx = i % BATCH_SLOTS;
+    blur_slot_t * slot = &slots[slotIdx];
+    if (slot->batch) {
+      if (clWaitForEvents(1, &slot->download)) {
+        res = -1;
+        break;
+      }
+      unpack_batch(slot, images);
+      slot->batch = NULL;
+    }
+    slot->batch = &batches[i];
+    if (queue_batch(ctx, slotIdx, slot, images, radius, borderMode) || context_flush(ctx)) {
+      if (slot->download) {
+        clReleaseEvent(slot->download);
+        slot->download = NULL;
+      }
+      slot->batch = NULL;
+      res = -1;
+    }
+  }
+
+  // Batches are handed out in order, so the oldest is in
+  // the slot after the last one used.
+  for (size_t i = 0; i < BATCH_SLOTS; ++i) {
+    blur_slot_t * slot = &slots[(batchCount + i) % BATCH_SLOTS];
+    if (!slot->batch) {
+      continue;
+    }
+    if (clWaitForEvents(1, &slot->download)) {
+      res = -1;
+    } else if (!res) {
+      unpack_batch(slot, images);
+    }
+    clReleaseEvent(slot->download);
+  }
+
+  // A failed batch may still have uploads queued from the
+  // slot's host memory, and context_free waits for them.
+  if (ctx) {
+    context_free(ctx);
+  }
+  for (int i = 0; i < BATCH_SLOTS; ++i) {
+    free(slots[i].pixels);
+    free(slots[i].images);
+    free(slots[i].rows);
+  }
+  if (ownSession) {
+    session_free(ownSession);
+  }
+  free(batches);
+  return res;
+}
+
+static blur_mode_t resolve_mode(blur_options_t * opts, session_t * session, bmp_t * image,
+                                int radius) {
+  blur_mode_t mode = opts ? opts->mode : BLUR_MODE_AUTO;
+  if (mode != BLUR_MODE_AUTO) {
+    return mode;
+  }
+
+  device_attributes_t attrs;
+  if (device_get_attributes(session->device, &attrs)) {
+    return BLUR_MODE_SEPARABLE;
+  }
+
+  // The separable temporary is the largest buffer.
+  size_t pixelCount = (size_t)image->width * image->height;
+  if (pixelCount * sizeof(cl_float4) > attrs.maxAllocSize) {
+    return BLUR_MODE_STRIPS;
+  }
+
+  // A Gaussian is always separable, and the tiled kernel
+  // saves global memory traffic when its tile fits.
+  size_t tile[2];
+  if (!choose_tile(attrs.workGroupSize, attrs.localMemSize, radius, tile)) {
+    return BLUR_MODE_TILED;
+  }
+  return BLUR_MODE_SEPARABLE;
+}
+
+// choose_tile picks the largest square work-group which
+// the device allows and whose tile plus apron fits in
+// local memory.
+static int choose_tile(size_t maxWorkGroup, cl_ulong localMem, int radius, size_t * tileOut) {
+  for (size_t side = MAX_TILE_SIDE; side >= MIN_TILE_SIDE; side /= 2) {
+    size_t tile[2] = {side, side};
+    if (side * side <= maxWorkGroup && tile_local_size(tile, radius) <= localMem) {
+      tileOut[0] = tile[0];
+      tileOut[1] = tile[1];
+      return 0;
+    }
+  }
+  return -1;
 }
 
+// tile_local_size is the local memory used by the tiled
+// kernel: the input tile plus its apron, and the output
+// of the horizontal pass over every apron row.
+static size_t tile_local_size(size_t * tile, int radius) {
+  size_t apronHeight = tile[1] + radius*2;
+  return (tile[0] + radius*2) * apronHeight * sizeof(cl_uchar4) +
+    tile[0] * apronHeight * sizeof(cl_float4);
+}
+
+// make_weights creates the normalized 1-D Gaussian.
+// The 2-D Gaussian is its outer product with itself.
 static cl_float * make_weights(int radius, cl_float sigma) {
-  size_t weightsSide = radius*2 + 1;
-  size_t weightCount = weightsSide * weightsSide;
+  size_t weightCount = radius*2 + 1;
   cl_float * weights = (cl_float *)malloc(weightCount * sizeof(cl_float));
   if (!weights) {
     return NULL;
   }
   cl_float weightSum = 0;
   int weightIdx = 0;
-  for (int y = -radius; y <= radius; ++y) {
-    for (int x = -radius; x <= radius; ++x) {
-      cl_float dist = (cl_float)(x*x + y*y);
-      weights[weightIdx] = (cl_float)expf(-(float)dist / (2 * sigma * sigma));
-      weightSum += weights[weightIdx];
-      ++weightIdx;
-    }
+  for (int x = -radius; x <= radius; ++x) {
+    cl_float dist = (cl_float)(x*x);
+    weights[weightIdx] = (cl_float)expf(-(float)dist / (2 * sigma * sigma));
+    weightSum += weights[weightIdx];
+    ++weightIdx;
   }
   cl_float weightNorm = 1 / weightSum;
   while (weightIdx--) {
@@ -63,75 +625,801 @@ static cl_float * make_weights(int radius, cl_float sigma) {
   return weights;
 }
 
+static cl_float * make_weights_2d(int radius, cl_float * weights) {
+  size_t weightsSide = radius*2 + 1;
+  cl_float * weights2d = (cl_float *)malloc(weightsSide * weightsSide * sizeof(cl_float));
+  if (!weights2d) {
+    return NULL;
+  }
+  size_t weightIdx = 0;
+  for (size_t y = 0; y < weightsSide; ++y) {
+    for (size_t x = 0; x < weightsSide; ++x) {
+      weights2d[weightIdx++] = weights[y] * weights[x];
+    }
+  }
+  return weights2d;
+}
+
+// make_box_radii picks the radii of BOX_COUNT box blurs
+// whose combined variance is closest to sigma^2, using
+// widths w and w+2 as in Kovesi's "Fast almost-Gaussian
+// filtering".
+static void make_box_radii(cl_float sigma, cl_int * radii) {
+  float idealWidth = sqrtf(12 * sigma * sigma / BOX_COUNT + 1);
+  int lowWidth = (int)floorf(idealWidth);
+  if (lowWidth % 2 == 0) {
+    --lowWidth;
+  }
+  if (lowWidth < 1) {
+    lowWidth = 1;
+  }
+  float idealLow = (12 * sigma * sigma - BOX_COUNT * lowWidth * lowWidth -
+    4 * BOX_COUNT * lowWidth - 3 * BOX_COUNT) / (-4.0f * lowWidth - 4);
+  int lowCount = (int)roundf(idealLow);
+  for (int i = 0; i < BOX_COUNT; ++i) {
+    int width = (i < lowCount ? lowWidth : lowWidth + 2);
+    radii[i] = (width - 1) / 2;
+  }
+}
+
 static const char * blurKernel = "\
+int border_index(int i, int n, int border) { \
+  if (i >= 0 && i < n) { \
+    return i; \
+  } else if (border == BLUR_BORDER_MIRROR) { \
+    if (n == 1) { \
+      return 0; \
+    } \
+    int period = (n - 1) * 2; \
+    i = abs(i) % period; \
+    return (i < n ? i : period - i); \
+  } else if (border == BLUR_BORDER_WRAP) { \
+    i %= n; \
+    return (i < 0 ? i + n : i); \
+  } \
+  return clamp(i, 0, n - 1); \
+} \
+\
 __kernel void blur(__global uchar4 * input, __global uchar4 * output, \
-                   __global float * weights, int radius, int width) { \
+                   __global float * weights, int radius, int width, int height, \
+                   int border) { \
   int globalX = get_global_id(0); \
   int globalY = get_global_id(1); \
-  int inputRow = globalX + (globalY-radius)*width; \
   int weightIdx = 0; \
   float4 outputFloat = 0; \
   for (int y = globalY-radius; y <= globalY+radius; ++y) { \
-    for (int x = -radius; x <= radius; ++x) { \
-      float4 fIn = convert_float4(input[inputRow + x]); \
+    int inputRow = border_index(y, height, border) * width; \
+    for (int x = globalX-radius; x <= globalX+radius; ++x) { \
+      float4 fIn = convert_float4(input[inputRow + border_index(x, width, border)]); \
       float weight = weights[weightIdx++]; \
       outputFloat += fIn * weight; \
     } \
-    inputRow += width; \
+  } \
+  output[globalX + globalY*width] = convert_uchar4_sat(outputFloat); \
+} \
+\
+__kernel void blur_rows(__global uchar4 * input, __global float4 * output, \
+                        __constant float * weights, int radius, int width, int height, \
+                        int border) { \
+  int globalX = get_global_id(0); \
+  int rowStart = get_global_id(1) * width; \
+  float4 outputFloat = 0; \
+  if (globalX >= radius && globalX + radius < width) { \
+    for (int x = -radius; x <= radius; ++x) { \
+      outputFloat += convert_float4(input[rowStart + globalX + x]) * weights[x + radius]; \
+    } \
+  } else { \
+    for (int x = -radius; x <= radius; ++x) { \
+      int sourceX = border_index(globalX + x, width, border); \
+      outputFloat += convert_float4(input[rowStart + sourceX]) * weights[x + radius]; \
+    } \
+  } \
+  output[rowStart + globalX] = outputFloat; \
+} \
+\
+__kernel void blur_cols(__global float4 * input, __global uchar4 * output, \
+                        __constant float * weights, int radius, int width, int height, \
+                        int border) { \
+  int globalX = get_global_id(0); \
+  int globalY = get_global_id(1); \
+  float4 outputFloat = 0; \
+  if (globalY >= radius && globalY + radius < height) { \
+    int inputIdx = globalX + (globalY-radius)*width; \
+    for (int y = -radius; y <= radius; ++y) { \
+      outputFloat += input[inputIdx] * weights[y + radius]; \
+      inputIdx += width; \
+    } \
+  } else { \
+    for (int y = -radius; y <= radius; ++y) { \
+      int sourceY = border_index(globalY + y, height, border); \
+      outputFloat += input[globalX + sourceY*width] * weights[y + radius]; \
+    } \
+  } \
+  output[globalX + globalY*width] = convert_uchar4_sat(outputFloat); \
+} \
+\
+__kernel void blur_tiled(__global uchar4 * input, __global uchar4 * output, \
+                         __constant float * weights, int radius, int width, int height, \
+                         int border, __local uchar4 * tile, __local float4 * rows) { \
+  int localX = get_local_id(0); \
+  int localY = get_local_id(1); \
+  int tileWidth = get_local_size(0); \
+  int tileHeight = get_local_size(1); \
+  int originX = get_global_id(0) - localX - radius; \
+  int originY = get_global_id(1) - localY - radius; \
+  int apronWidth = tileWidth + radius*2; \
+  int apronHeight = tileHeight + radius*2; \
+  for (int y = localY; y < apronHeight; y += tileHeight) { \
+    int sourceY = border_index(originY + y, height, border); \
+    for (int x = localX; x < apronWidth; x += tileWidth) { \
+      int sourceX = border_index(originX + x, width, border); \
+      tile[x + y*apronWidth] = input[sourceX + sourceY*width]; \
+    } \
+  } \
+  barrier(CLK_LOCAL_MEM_FENCE); \
+  for (int y = localY; y < apronHeight; y += tileHeight) { \
+    float4 rowFloat = 0; \
+    for (int x = 0; x <= radius*2; ++x) { \
+      rowFloat += convert_float4(tile[localX + x + y*apronWidth]) * weights[x]; \
+    } \
+    rows[localX + y*tileWidth] = rowFloat; \
+  } \
+  barrier(CLK_LOCAL_MEM_FENCE); \
+  int globalX = get_global_id(0); \
+  int globalY = get_global_id(1); \
+  if (globalX >= width || globalY >= height) { \
+    return; \
+  } \
+  float4 outputFloat = 0; \
+  for (int y = 0; y <= radius*2; ++y) { \
+    outputFloat += rows[localX + (localY + y)*tileWidth] * weights[y]; \
+  } \
+  output[globalX + globalY*width] = convert_uchar4_sat(outputFloat); \
+} \
+\
+__kernel void box_rows(__global uchar4 * input, __global uchar4 * output, \
+                       int boxRadius, int width, int height, int border) { \
+  int rowStart = get_global_id(0) * width; \
+  int boxWidth = boxRadius*2 + 1; \
+  int4 sum = 0; \
+  for (int x = -boxRadius; x <= boxRadius; ++x) { \
+    sum += convert_int4(input[rowStart + border_index(x, width, border)]); \
+  } \
+  for (int x = 0; x < width; ++x) { \
+    output[rowStart + x] = convert_uchar4_sat((sum + boxWidth/2) / boxWidth); \
+    int addX = border_index(x + boxRadius + 1, width, border); \
+    int removeX = border_index(x - boxRadius, width, border); \
+    sum += convert_int4(input[rowStart + addX]) - convert_int4(input[rowStart + removeX]); \
+  } \
+} \
+\
+__kernel void box_cols(__global uchar4 * input, __global uchar4 * output, \
+                       int boxRadius, int width, int height, int border) { \
+  int col = get_global_id(0); \
+  int boxWidth = boxRadius*2 + 1; \
+  int4 sum = 0; \
+  for (int y = -boxRadius; y <= boxRadius; ++y) { \
+    sum += convert_int4(input[col + border_index(y, height, border)*width]); \
+  } \
+  for (int y = 0; y < height; ++y) { \
+    output[col + y*width] = convert_uchar4_sat((sum + boxWidth/2) / boxWidth); \
+    int addY = border_index(y + boxRadius + 1, height, border); \
+    int removeY = border_index(y - boxRadius, height, border); \
+    sum += convert_int4(input[col + addY*width]) - convert_int4(input[col + removeY*width]); \
+  } \
+} \
+\
+__kernel void batch_rows(__global uchar4 * input, __global float4 * output, \
+                         __constant float * weights, __global int4 * images, \
+                         __global int * rowImages, int radius, int border) { \
+  int globalX = get_global_id(0); \
+  int packedRow = get_global_id(1); \
+  int4 image = images[rowImages[packedRow]]; \
+  int width = image.s1; \
+  if (globalX >= width) { \
+    return; \
+  } \
+  int rowStart = image.s0 + (packedRow - image.s3) * width; \
+  float4 outputFloat = 0; \
+  for (int x = -radius; x <= radius; ++x) { \
+    int sourceX = border_index(globalX + x, width, border); \
+    outputFloat += convert_float4(input[rowStart + sourceX]) * weights[x + radius]; \
+  } \
+  output[rowStart + globalX] = outputFloat; \
+} \
+\
+__kernel void batch_cols(__global float4 * input, __global uchar4 * output, \
+                         __constant float * weights, __global int4 * images, \
+                         __global int * rowImages, int radius, int border) { \
+  int globalX = get_global_id(0); \
+  int packedRow = get_global_id(1); \
+  int4 image = images[rowImages[packedRow]]; \
+  int width = image.s1; \
+  if (globalX >= width) { \
+    return; \
+  } \
+  int localY = packedRow - image.s3; \
+  float4 outputFloat = 0; \
+  for (int y = -radius; y <= radius; ++y) { \
+    int sourceY = border_index(localY + y, image.s2, border); \
+    outputFloat += input[image.s0 + globalX + sourceY*width] * weights[y + radius]; \
+  } \
+  output[image.s0 + globalX + localY*width] = convert_uchar4_sat(outputFloat); \
+} \
+\
+__kernel void strip_cols(__global float4 * input, __global uchar4 * output, \
+                         __constant float * weights, int radius, int width) { \
+  int globalX = get_global_id(0); \
+  int globalY = get_global_id(1); \
+  int inputIdx = globalX + globalY*width; \
+  float4 outputFloat = 0; \
+  for (int y = 0; y <= radius*2; ++y) { \
+    outputFloat += input[inputIdx] * weights[y]; \
+    inputIdx += width; \
   } \
   output[globalX + globalY*width] = convert_uchar4_sat(outputFloat); \
 } \
 ";
 
-static const char * blurKernelName = "blur";
+// blurProgramHeader gives the kernels the border modes'
+// values from blur_border_t, so that border_index and
+// border_row can't disagree about them.
+static const char * blurProgramHeader = "\
+#define BLUR_BORDER_MIRROR %d\n\
+#define BLUR_BORDER_WRAP %d\n\
+%s";
+
+static const char * blurKernelNames[6] = {"blur", "blur_rows", "blur_cols", "blur_tiled",
+  "box_rows", "box_cols"};
+static const char * batchKernelNames[2] = {"batch_rows", "batch_cols"};
+static const char * stripKernelNames[2] = {"blur_rows", "strip_cols"};
+
+// create_context creates a context for params, whose
+// program is set to the blur kernels.
+static context_t * create_context(session_t * session, context_params_t * params) {
+  int length = snprintf(NULL, 0, blurProgramHeader, BLUR_BORDER_MIRROR, BLUR_BORDER_WRAP,
+    blurKernel);
+  char * program = (char *)malloc(length + 1);
+  if (!program) {
+    return NULL;
+  }
+  snprintf(program, length + 1, blurProgramHeader, BLUR_BORDER_MIRROR, BLUR_BORDER_WRAP,
+    blurKernel);
+  params->program = program;
+  context_t * ctx = context_create_in(session, params);
+  free(program);
+  return ctx;
+}
 
-static context_t * create_blur_context(bmp_t * input, cl_int radius, cl_float * weights) {
-  size_t bitmapSize = input->width * input->height * sizeof(cl_uchar4);
-  size_t bufferSizes[3] = {bitmapSize, bitmapSize,
-    (radius*2 + 1) * (radius*2 + 1) * sizeof(cl_float)};
+// create_blur_context creates buffers backed by the
+// input's pixels and by output, so that on unified memory
+// devices neither is copied. If map is non-NULL, the input
+// is decoded on the device from the mapped file instead.
+static context_t * create_blur_context(session_t * session, bmp_t * input,
+                                       bmp_mapping_t * map, cl_int radius, cl_float * weights,
+                                       cl_uchar4 * output, blur_mode_t mode,
+                                       blur_border_t border, size_t * tile) {
+  size_t pixelCount = input->width * input->height;
+  size_t bitmapSize = pixelCount * sizeof(cl_uchar4);
+  size_t weightsSide = radius*2 + 1;
+  size_t weightCount = (mode == BLUR_MODE_DIRECT ? weightsSide * weightsSide : weightsSide);
+  size_t bufferSizes[4] = {bitmapSize, bitmapSize, weightCount * sizeof(cl_float),
+    pixelCount * (mode == BLUR_MODE_BOX ? sizeof(cl_uchar4) : sizeof(cl_float4))};
   context_params_t params;
-  params.program = blurKernel;
-  params.kernelCount = 1;
-  params.kernelNames = &blurKernelName;
-  params.bufferCount = 3;
+  params.kernelCount = 6;
+  params.kernelNames = blurKernelNames;
+  params.bufferCount = (mode == BLUR_MODE_SEPARABLE || mode == BLUR_MODE_BOX ? 4 : 3);
   params.bufferSizes = bufferSizes;
+  void * hostPointers[4] = {(map ? NULL : input->pixels), output, NULL, NULL};
+  params.hostPointers = hostPointers;
 
-  context_t * ctx = context_create(&params);
+  context_t * ctx = create_context(session, &params);
   if (!ctx) {
     return NULL;
   }
 
-  void * inputBuf = context_map(ctx, 0, CL_TRUE);
-  if (!inputBuf) {
+  if (mode == BLUR_MODE_TILED) {
+    device_attributes_t attrs;
+    if (device_get_attributes(session->device, &attrs) ||
+        choose_tile(context_work_group_size(ctx, TILED_KERNEL), attrs.localMemSize,
+          radius, tile)) {
+      context_free(ctx);
+      return NULL;
+    }
+  }
+
+  if (map && bmp_upload(session, map, ctx->buffers[INPUT_BUFF])) {
     context_free(ctx);
     return NULL;
   }
-  memcpy(inputBuf, input->pixels, bitmapSize);
-  context_unmap(ctx, 0, inputBuf);
 
-  void * weightBuf = context_map(ctx, 2, CL_TRUE);
+  void * weightBuf = context_map(ctx, WEIGHTS_BUFF, CL_TRUE);
   if (!weightBuf) {
     context_free(ctx);
     return NULL;
   }
-  memcpy(weightBuf, weights, bufferSizes[2]);
-  context_unmap(ctx, 2, weightBuf);
+  if (mode == BLUR_MODE_DIRECT) {
+    cl_float * weights2d = make_weights_2d(radius, weights);
+    if (!weights2d) {
+      context_unmap(ctx, WEIGHTS_BUFF, weightBuf);
+      context_free(ctx);
+      return NULL;
+    }
+    memcpy(weightBuf, weights2d, bufferSizes[WEIGHTS_BUFF]);
+    free(weights2d);
+  } else {
+    memcpy(weightBuf, weights, bufferSizes[WEIGHTS_BUFF]);
+  }
+  context_unmap(ctx, WEIGHTS_BUFF, weightBuf);
+
+  cl_int width = input->width;
+  cl_int height = input->height;
+  cl_int borderMode = border;
+  size_t sizes[9] = {sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_mem),
+    sizeof(cl_int), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int), 0, 0};
+  if (mode == BLUR_MODE_DIRECT) {
+    void * args[7] = {&ctx->buffers[INPUT_BUFF], &ctx->buffers[OUTPUT_BUFF],
+      &ctx->buffers[WEIGHTS_BUFF], &radius, &width, &height, &borderMode};
+    if (context_set_params(ctx, DIRECT_KERNEL, 7, args, sizes)) {
+      context_free(ctx);
+      return NULL;
+    }
+  } else if (mode == BLUR_MODE_TILED) {
+    void * args[9] = {&ctx->buffers[INPUT_BUFF], &ctx->buffers[OUTPUT_BUFF],
+      &ctx->buffers[WEIGHTS_BUFF], &radius, &width, &height, &borderMode, NULL, NULL};
+    sizes[7] = (tile[0] + radius*2) * (tile[1] + radius*2) * sizeof(cl_uchar4);
+    sizes[8] = tile[0] * (tile[1] + radius*2) * sizeof(cl_float4);
+    if (context_set_params(ctx, TILED_KERNEL, 9, args, sizes)) {
+      context_free(ctx);
+      return NULL;
+    }
+  } else if (mode == BLUR_MODE_SEPARABLE) {
+    void * rowArgs[7] = {&ctx->buffers[INPUT_BUFF], &ctx->buffers[TEMP_BUFF],
+      &ctx->buffers[WEIGHTS_BUFF], &radius, &width, &height, &borderMode};
+    void * colArgs[7] = {&ctx->buffers[TEMP_BUFF], &ctx->buffers[OUTPUT_BUFF],
+      &ctx->buffers[WEIGHTS_BUFF], &radius, &width, &height, &borderMode};
+    if (context_set_params(ctx, ROWS_KERNEL, 7, rowArgs, sizes) ||
+        context_set_params(ctx, COLS_KERNEL, 7, colArgs, sizes)) {
+      context_free(ctx);
+      return NULL;
+    }
+  }
+
+  return ctx;
+}
+
+static int run_blur_context(context_t * ctx, bmp_t * input, int radius, cl_float sigma,
+                            blur_mode_t mode, blur_border_t border, size_t * tile) {
+  size_t workSizes[2] = {input->width, input->height};
+  if (mode == BLUR_MODE_DIRECT) {
+    return context_run_nd_async(ctx, DIRECT_KERNEL, 2, NULL, workSizes, NULL, 0, NULL, NULL);
+  } else if (mode == BLUR_MODE_BOX) {
+    cl_int radii[BOX_COUNT];
+    make_box_radii(sigma, radii);
+    return run_box_passes(ctx, input, radii, border);
+  } else if (mode == BLUR_MODE_TILED) {
+    // The global size must be a multiple of the tile;
+    // the extra work-items only help load the apron.
+    for (int i = 0; i < 2; ++i) {
+      workSizes[i] = (workSizes[i] + tile[i] - 1) / tile[i] * tile[i];
+    }
+    return context_run_nd_async(ctx, TILED_KERNEL, 2, NULL, workSizes, tile, 0, NULL, NULL);
+  }
+
+  if (context_run_nd_async(ctx, ROWS_KERNEL, 2, NULL, workSizes, NULL, 0, NULL, NULL)) {
+    return -1;
+  }
+  return context_run_nd_async(ctx, COLS_KERNEL, 2, NULL, workSizes, NULL, 0, NULL, NULL);
+}
 
+// run_box_passes queues BOX_COUNT row passes followed by
+// BOX_COUNT column passes. The passes alternate between
+// the temporary and output buffers, ending in the output.
+static int run_box_passes(context_t * ctx, bmp_t * input, cl_int * radii,
+                          blur_border_t border) {
   cl_int width = input->width;
-  void * args[5] = {&ctx->buffers[0], &ctx->buffers[1], &ctx->buffers[2],
-    &radius, &width};
-  size_t sizes[5] = {sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_mem),
+  cl_int height = input->height;
+  cl_int borderMode = border;
+  size_t sizes[6] = {sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int),
     sizeof(cl_int), sizeof(cl_int)};
-  if (context_set_params(ctx, 0, 5, args, sizes)) {
+  cl_mem * source = &ctx->buffers[INPUT_BUFF];
+  for (int i = 0; i < BOX_COUNT*2; ++i) {
+    int kernelIdx = (i < BOX_COUNT ? BOX_ROWS_KERNEL : BOX_COLS_KERNEL);
+    cl_mem * dest = &ctx->buffers[(i % 2) ? OUTPUT_BUFF : TEMP_BUFF];
+    void * args[6] = {source, dest, &radii[i % BOX_COUNT], &width, &height, &borderMode};
+    size_t workSize = (i < BOX_COUNT ? input->height : input->width);
+    if (context_set_params(ctx, kernelIdx, 6, args, sizes) ||
+        context_run_nd_async(ctx, kernelIdx, 1, NULL, &workSize, NULL, 0, NULL, NULL)) {
+      return -1;
+    }
+    source = dest;
+  }
+  return 0;
+}
+
+// plan_batches splits the images into consecutive runs
+// of about BATCH_PIXELS pixels and returns the number of
+// runs.
+static size_t plan_batches(bmp_t ** images, size_t count, blur_batch_t * batches) {
+  size_t batchCount = 0;
+  blur_batch_t * batch = NULL;
+  for (size_t i = 0; i < count; ++i) {
+    size_t width = images[i]->width;
+    size_t height = images[i]->height;
+    if (!batch || batch->pixels + width*height > BATCH_PIXELS) {
+      batch = &batches[batchCount++];
+      bzero(batch, sizeof(blur_batch_t));
+      batch->first = i;
+    }
+    ++batch->count;
+    batch->pixels += width * height;
+    batch->rows += height;
+    if (width > batch->maxWidth) {
+      batch->maxWidth = width;
+    }
+  }
+  return batchCount;
+}
+
+static context_t * create_batch_context(session_t * session, blur_batch_t * batches,
+                                        size_t batchCount, int radius, cl_float * weights) {
+  size_t maxPixels = 0;
+  size_t maxImages = 0;
+  size_t maxRows = 0;
+  for (size_t i = 0; i < batchCount; ++i) {
+    if (batches[i].pixels > maxPixels) {
+      maxPixels = batches[i].pixels;
+    }
+    if (batches[i].count > maxImages) {
+      maxImages = batches[i].count;
+    }
+    if (batches[i].rows > maxRows) {
+      maxRows = batches[i].rows;
+    }
+  }
+
+  size_t bufferSizes[1 + BATCH_SLOTS*4];
+  bufferSizes[BATCH_WEIGHTS_BUFF] = (radius*2 + 1) * sizeof(cl_float);
+  for (int i = 0; i < BATCH_SLOTS; ++i) {
+    bufferSizes[BATCH_PIXELS_BUFF(i)] = maxPixels * sizeof(cl_uchar4);
+    bufferSizes[BATCH_TEMP_BUFF(i)] = maxPixels * sizeof(cl_float4);
+    bufferSizes[BATCH_IMAGES_BUFF(i)] = maxImages * sizeof(cl_int4);
+    bufferSizes[BATCH_ROWS_BUFF(i)] = maxRows * sizeof(cl_int);
+  }
+  context_params_t params;
+  params.kernelCount = 2;
+  params.kernelNames = batchKernelNames;
+  params.bufferCount = 1 + BATCH_SLOTS*4;
+  params.bufferSizes = bufferSizes;
+  params.hostPointers = NULL;
+
+  context_t * ctx = create_context(session, &params);
+  if (!ctx) {
+    return NULL;
+  }
+
+  cl_event event;
+  if (context_write_async(ctx, BATCH_WEIGHTS_BUFF, 0, bufferSizes[BATCH_WEIGHTS_BUFF],
+      weights, 0, NULL, &event)) {
     context_free(ctx);
     return NULL;
   }
+  cl_int status = clWaitForEvents(1, &event);
+  clReleaseEvent(event);
+  if (status) {
+    context_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+// queue_batch packs the slot's batch into its staging
+// memory and queues the upload, both passes and the
+// download back into the staging memory. It releases the
+// slot's previous download, if any, and replaces it.
+static int queue_batch(context_t * ctx, int slotIdx, blur_slot_t * slot, bmp_t ** images,
+                       cl_int radius, cl_int border) {
+  blur_batch_t * batch = slot->batch;
+  size_t offset = 0;
+  size_t row = 0;
+  for (size_t i = 0; i < batch->count; ++i) {
+    bmp_t * image = images[batch->first + i];
+    size_t pixelCount = image->width * image->height;
+    cl_int4 entry = {{(cl_int)offset, image->width, image->height, (cl_int)row}};
+    slot->images[i] = entry;
+    memcpy(slot->pixels + offset, image->pixels, pixelCount * sizeof(cl_uchar4));
+    for (int y = 0; y < image->height; ++y) {
+      slot->rows[row++] = (cl_int)i;
+    }
+    offset += pixelCount;
+  }
+
+  // Uploads and downloads run on separate queues, so the
+  // upload of this batch can overlap both the blur of the
+  // batch in the other slot and its download. Only the
+  // slot's own download has to come first. The upload
+  // queue is in-order, so the last upload completing means
+  // the whole batch is on the device.
+  cl_event previous = slot->download;
+  cl_uint previousCount = (previous ? 1 : 0);
+  slot->download = NULL;
+  cl_event uploaded;
+  int failed = context_upload_async(ctx, BATCH_IMAGES_BUFF(slotIdx), 0,
+      batch->count * sizeof(cl_int4), slot->images, previousCount, &previous, NULL) ||
+    context_upload_async(ctx, BATCH_ROWS_BUFF(slotIdx), 0, batch->rows * sizeof(cl_int),
+      slot->rows, 0, NULL, NULL) ||
+    context_upload_async(ctx, BATCH_PIXELS_BUFF(slotIdx), 0,
+      batch->pixels * sizeof(cl_uchar4), slot->pixels, 0, NULL, &uploaded);
+  if (previous) {
+    clReleaseEvent(previous);
+  }
+  if (failed) {
+    return -1;
+  }
+
+  size_t sizes[8] = {sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_mem),
+    sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int)};
+  void * rowArgs[7] = {&ctx->buffers[BATCH_PIXELS_BUFF(slotIdx)],
+    &ctx->buffers[BATCH_TEMP_BUFF(slotIdx)], &ctx->buffers[BATCH_WEIGHTS_BUFF],
+    &ctx->buffers[BATCH_IMAGES_BUFF(slotIdx)], &ctx->buffers[BATCH_ROWS_BUFF(slotIdx)],
+    &radius, &border};
+  void * colArgs[7] = {&ctx->buffers[BATCH_TEMP_BUFF(slotIdx)],
+    &ctx->buffers[BATCH_PIXELS_BUFF(slotIdx)], &ctx->buffers[BATCH_WEIGHTS_BUFF],
+    &ctx->buffers[BATCH_IMAGES_BUFF(slotIdx)], &ctx->buffers[BATCH_ROWS_BUFF(slotIdx)],
+    &radius, &border};
+  size_t workSizes[2] = {batch->maxWidth, batch->rows};
+  cl_event blurred;
+  int res = -1;
+  if (!context_set_params(ctx, BATCH_ROWS_KERNEL, 7, rowArgs, sizes) &&
+      !context_run_nd_async(ctx, BATCH_ROWS_KERNEL, 2, NULL, workSizes, NULL, 1, &uploaded,
+        NULL) &&
+      !context_set_params(ctx, BATCH_COLS_KERNEL, 7, colArgs, sizes) &&
+      !context_run_nd_async(ctx, BATCH_COLS_KERNEL, 2, NULL, workSizes, NULL, 0, NULL,
+        &blurred)) {
+    res = context_download_async(ctx, BATCH_PIXELS_BUFF(slotIdx), 0,
+      batch->pixels * sizeof(cl_uchar4), slot->pixels, 1, &blurred, &slot->download);
+    clReleaseEvent(blurred);
+  }
+  clReleaseEvent(uploaded);
+  return res;
+}
+
+static void unpack_batch(blur_slot_t * slot, bmp_t ** images) {
+  blur_batch_t * batch = slot->batch;
+  for (size_t i = 0; i < batch->count; ++i) {
+    bmp_t * image = images[batch->first + i];
+    memcpy(image->pixels, slot->pixels + slot->images[i].s[0],
+      image->width * image->height * sizeof(cl_uchar4));
+  }
+}
+
+// plan_strips picks the number of rows per strip. Strips
+// are at least radius rows tall so that reads and writes
+// of the stream never overlap (see blur_stream).
+static int plan_strips(session_t * session, int width, int height, int radius,
+                       int * stripRowsOut) {
+  device_attributes_t attrs;
+  if (device_get_attributes(session->device, &attrs)) {
+    return -1;
+  }
+
+  size_t rowBytes = width * sizeof(cl_float4);
+  long long stripRows = STRIP_PIXELS / width;
+  long long maxRows = (long long)(attrs.maxAllocSize / rowBytes) - radius*2;
+  if (stripRows > maxRows) {
+    stripRows = maxRows;
+  }
+  if (stripRows < radius) {
+    stripRows = radius;
+  }
+  if (stripRows < 1) {
+    stripRows = 1;
+  }
+  if (stripRows > height) {
+    stripRows = height;
+  }
+  if (stripRows > maxRows) {
+    return -1;
+  }
+  (*stripRowsOut) = (int)stripRows;
+  return 0;
+}
+
+static context_t * create_strip_context(session_t * session, blur_strips_t * strips,
+                                        cl_float * weights) {
+  size_t width = strips->stream->width;
+  size_t apronRows = strips->stripRows + strips->radius*2;
+  size_t bufferSizes[1 + STRIP_SLOTS*3];
+  bufferSizes[STRIP_WEIGHTS_BUFF] = (strips->radius*2 + 1) * sizeof(cl_float);
+  for (int i = 0; i < STRIP_SLOTS; ++i) {
+    bufferSizes[STRIP_INPUT_BUFF(i)] = width * apronRows * sizeof(cl_uchar4);
+    bufferSizes[STRIP_TEMP_BUFF(i)] = width * apronRows * sizeof(cl_float4);
+    bufferSizes[STRIP_OUTPUT_BUFF(i)] = width * strips->stripRows * sizeof(cl_uchar4);
+  }
+  context_params_t params;
+  params.kernelCount = 2;
+  params.kernelNames = stripKernelNames;
+  params.bufferCount = 1 + STRIP_SLOTS*3;
+  params.bufferSizes = bufferSizes;
+  params.hostPointers = NULL;
+
+  context_t * ctx = create_context(session, &params);
+  if (!ctx) {
+    return NULL;
+  }
 
+  cl_event event;
+  if (context_write_async(ctx, STRIP_WEIGHTS_BUFF, 0, bufferSizes[STRIP_WEIGHTS_BUFF],
+      weights, 0, NULL, &event)) {
+    context_free(ctx);
+    return NULL;
+  }
+  cl_int status = clWaitForEvents(1, &event);
+  clReleaseEvent(event);
+  if (status) {
+    context_free(ctx);
+    return NULL;
+  }
   return ctx;
 }
 
-static int run_blur_context(context_t * ctx, bmp_t * input, int radius) {
-  size_t workSizes[2] = {input->width - radius*2, input->height - radius*2};
-  size_t workOffsets[2] = {radius, radius};
-  return context_run_nd(ctx, 0, 2, workOffsets, workSizes);
+// read_strip reads the strip's rows plus radius apron
+// rows on each side into its input. Apron rows outside
+// the image are resolved with the border mode, and runs
+// of consecutive source rows are read with one call.
+static int read_strip(blur_strips_t * strips, blur_strip_t * strip) {
+  blur_stream_t * stream = strips->stream;
+  int firstRow = strip->firstRow - strips->radius;
+  int rowCount = strip->rowCount + strips->radius*2;
+  char * dest = (char *)strip->input;
+  int i = 0;
+  while (i < rowCount) {
+    int logicalRow = firstRow + i;
+    int sourceRow = border_row(logicalRow, stream->height, strips->border);
+    if (strips->wrapRows && logicalRow >= stream->height) {
+      memcpy(dest + i*strips->pitch, (char *)strips->wrapRows + sourceRow*strips->pitch,
+        strips->pitch);
+      ++i;
+      continue;
+    }
+    int runLength = 1;
+    while (i + runLength < rowCount &&
+           firstRow + i + runLength < stream->height &&
+           border_row(logicalRow + runLength, stream->height, strips->border) ==
+             sourceRow + runLength) {
+      ++runLength;
+    }
+    if (stream->read_rows(stream, sourceRow, runLength,
+        (cl_uchar4 *)(dest + i*strips->pitch), strips->pitch)) {
+      return -1;
+    }
+    i += runLength;
+  }
+  return 0;
+}
+
+// queue_strip uploads the strip, runs the row pass over
+// it and its apron and the column pass over its rows, and
+// downloads the blurred rows into the strip's output. It
+// releases the strip's previous download, if any, and
+// replaces it.
+static int queue_strip(context_t * ctx, int slotIdx, blur_strips_t * strips,
+                       blur_strip_t * strip) {
+  cl_int radius = strips->radius;
+  cl_int width = strips->stream->width;
+  cl_int apronRows = strip->rowCount + radius*2;
+  cl_int borderMode = strips->border;
+  size_t rowSize = width * sizeof(cl_uchar4);
+
+  // As in queue_batch, the upload only waits for the
+  // slot's previous download, so it overlaps the blur and
+  // download of the strip in the other slot.
+  cl_event previous = strip->download;
+  cl_uint previousCount = (previous ? 1 : 0);
+  strip->download = NULL;
+  cl_event uploaded;
+  int failed = context_upload_rows_async(ctx, STRIP_INPUT_BUFF(slotIdx), 0, rowSize,
+    strip->input, strips->pitch, rowSize, apronRows, previousCount, &previous, &uploaded);
+  if (previous) {
+    clReleaseEvent(previous);
+  }
+  if (failed) {
+    return -1;
+  }
+
+  size_t sizes[7] = {sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_int),
+    sizeof(cl_int), sizeof(cl_int), sizeof(cl_int)};
+  void * rowArgs[7] = {&ctx->buffers[STRIP_INPUT_BUFF(slotIdx)],
+    &ctx->buffers[STRIP_TEMP_BUFF(slotIdx)], &ctx->buffers[STRIP_WEIGHTS_BUFF], &radius,
+    &width, &apronRows, &borderMode};
+  void * colArgs[5] = {&ctx->buffers[STRIP_TEMP_BUFF(slotIdx)],
+    &ctx->buffers[STRIP_OUTPUT_BUFF(slotIdx)], &ctx->buffers[STRIP_WEIGHTS_BUFF], &radius,
+    &width};
+  size_t rowSizes[2] = {width, apronRows};
+  size_t colSizes[2] = {width, strip->rowCount};
+  cl_event blurred;
+  int res = -1;
+  if (!context_set_params(ctx, STRIP_ROWS_KERNEL, 7, rowArgs, sizes) &&
+      !context_run_nd_async(ctx, STRIP_ROWS_KERNEL, 2, NULL, rowSizes, NULL, 1, &uploaded,
+        NULL) &&
+      !context_set_params(ctx, STRIP_COLS_KERNEL, 5, colArgs, sizes) &&
+      !context_run_nd_async(ctx, STRIP_COLS_KERNEL, 2, NULL, colSizes, NULL, 0, NULL,
+        &blurred)) {
+    res = context_download_rows_async(ctx, STRIP_OUTPUT_BUFF(slotIdx), 0, rowSize,
+      strip->output, strips->pitch, rowSize, strip->rowCount, 1, &blurred, &strip->download);
+    clReleaseEvent(blurred);
+  }
+  clReleaseEvent(uploaded);
+  return res;
+}
+
+// border_row matches border_index in the kernels.
+static int border_row(int y, int height, blur_border_t border) {
+  if (y >= 0 && y < height) {
+    return y;
+  } else if (border == BLUR_BORDER_MIRROR) {
+    if (height == 1) {
+      return 0;
+    }
+    int period = (height - 1) * 2;
+    y = abs(y) % period;
+    return (y < height ? y : period - y);
+  } else if (border == BLUR_BORDER_WRAP) {
+    y %= height;
+    return (y < 0 ? y + height : y);
+  }
+  return (y < 0 ? 0 : height - 1);
+}
+
+static int read_image_rows(blur_stream_t * stream, int y, int count, cl_uchar4 * rows,
+                           size_t pitch) {
+  image_source_t * source = (image_source_t *)stream->data;
+  bmp_t * image = source->image;
+  for (int i = 0; i < count; ++i) {
+    cl_uchar4 * row = (cl_uchar4 *)((char *)rows + i*pitch);
+    if (source->map) {
+      bmp_mapping_decode_row(source->map, y + i, row);
+    } else {
+      memcpy(row, image->pixels + (size_t)(y + i)*image->width,
+        image->width * sizeof(cl_uchar4));
+    }
+  }
+  return 0;
+}
+
+static int write_image_rows(blur_stream_t * stream, int y, int count, const cl_uchar4 * rows,
+                            size_t pitch) {
+  bmp_t * image = ((image_source_t *)stream->data)->image;
+  for (int i = 0; i < count; ++i) {
+    memcpy(image->pixels + (size_t)(y + i)*image->width, (const char *)rows + i*pitch,
+      image->width * sizeof(cl_uchar4));
+  }
+  return 0;
+}
+
+static int stream_files(session_t * session, bmp_reader_t * reader, const char * outputPath,
+                        int radius, cl_float sigma, blur_border_t border) {
+  bmp_writer_t * writer = bmp_writer_open(outputPath, reader->width, reader->height);
+  if (!writer) {
+    return -1;
+  }
+  file_streams_t files = {reader, writer};
+  blur_stream_t stream = {reader->width, reader->height, &files, read_file_rows,
+    write_file_rows};
+  blur_options_t opts = {session, BLUR_MODE_STRIPS, border};
+  int res = blur_stream(&stream, radius, sigma, &opts);
+  if (bmp_writer_close(writer)) {
+    res = -1;
+  }
+  return res;
+}
+
+static int read_file_rows(blur_stream_t * stream, int y, int count, cl_uchar4 * rows,
+                          size_t pitch) {
+  return bmp_reader_read(((file_streams_t *)stream->data)->reader, y, count, rows, pitch);
+}
+
+static int write_file_rows(blur_stream_t * stream, int y, int count, const cl_uchar4 * rows,
+                           size_t pitch) {
+  return bmp_writer_write(((file_streams_t *)stream->data)->writer, y, count, rows, pitch);
 }
@@ -2,8 +2,113 @@
 #define __BLUR_H__
 
 #include "bmp.h"
+#include "session.h"
 #include <OpenCL/opencl.h>
 
+typedef enum {
+  // BLUR_MODE_AUTO picks the fastest exact mode.
+  BLUR_MODE_AUTO = 0,
+  // BLUR_MODE_DIRECT convolves the full 2-D weight matrix.
+  BLUR_MODE_DIRECT,
+  // BLUR_MODE_SEPARABLE runs a horizontal and then a
+  // vertical pass with a 1-D weight vector.
+  BLUR_MODE_SEPARABLE,
+  // BLUR_MODE_TILED runs both separable passes in one
+  // kernel over tiles cached in local memory. It fails if
+  // the tile for the radius does not fit on the device.
+  BLUR_MODE_TILED,
+  // BLUR_MODE_BOX approximates the Gaussian with three
+  // running-sum box blurs along rows and then columns.
+  // The box widths come from sigma alone, and the cost
+  // per pixel does not depend on the radius.
+  BLUR_MODE_BOX,
+  // BLUR_MODE_STRIPS streams the image through the device
+  // in horizontal strips, for images whose buffers do not
+  // fit in one device allocation. AUTO picks it for them.
+  BLUR_MODE_STRIPS
+} blur_mode_t;
+
+// blur_border_t decides how pixels outside the image
+// are sampled. Every mode blurs the whole image.
+typedef enum {
+  // BLUR_BORDER_CLAMP repeats the edge pixels.
+  BLUR_BORDER_CLAMP = 0,
+  // BLUR_BORDER_MIRROR reflects about the edge pixels.
+  BLUR_BORDER_MIRROR,
+  // BLUR_BORDER_WRAP tiles the image.
+  BLUR_BORDER_WRAP
+} blur_border_t;
+
+// blur_stream_t supplies and receives the rows of an
+// image for blur_stream. Rows are numbered as in bmp_t
+// and consecutive rows in a block are pitch bytes apart.
+typedef struct blur_stream {
+  int width;
+  int height;
+  void * data;
+
+  // read_rows fills count rows starting at row y.
+  int (*read_rows)(struct blur_stream * stream, int y, int count, cl_uchar4 * rows,
+                   size_t pitch);
+  // write_rows receives count blurred rows starting at
+  // row y. Blocks are written from top to bottom.
+  int (*write_rows)(struct blur_stream * stream, int y, int count, const cl_uchar4 * rows,
+                    size_t pitch);
+} blur_stream_t;
+
+typedef struct {
+  // session, if non-NULL, is used instead of creating
+  // a new session for the blur.
+  session_t * session;
+
+  blur_mode_t mode;
+  blur_border_t border;
+} blur_options_t;
+
+// blur_image blurs an image. The blurred pixels are
+// usually written to a new array, and image->pixels is
+// then freed and replaced by it. The pixels must be heap
+// memory owned by the bmp_t, as from bmp_read or
+// bmp_alloc_pixels, and earlier pointers to them are no
+// longer valid afterwards.
 int blur_image(bmp_t * image, int radius, cl_float sigma);
 
+// blur_image_with is like blur_image, but takes options.
+// A zeroed blur_options_t gives the default behavior. It
+// replaces image->pixels in the same way.
+int blur_image_with(bmp_t * image, int radius, cl_float sigma, blur_options_t * opts);
+
+// blur_file reads and blurs a BMP file. The file is mapped
+// and decoded on the device, so its pixels are not copied
+// on the host before the blur.
+bmp_t * blur_file(const char * path, int radius, cl_float sigma, blur_options_t * opts);
+
+// blur_file_to blurs a BMP file into a new BMP file. If
+// the image needs BLUR_MODE_STRIPS, the files are streamed
+// through the blur a strip at a time, so memory use does
+// not depend on the image size. Otherwise it is blurred
+// with blur_file.
+int blur_file_to(const char * inputPath, const char * outputPath, int radius, cl_float sigma,
+                 blur_options_t * opts);
+
+// blur_stream blurs an image in strips, keeping only a
+// few strips in host and device memory at once. Strips
+// are read with radius rows of overlap and uploaded while
+// the previous strip is blurred.
+//
+// Every source row is read before its blurred row is
+// written, so the stream may write back in place.
+int blur_stream(blur_stream_t * stream, int radius, cl_float sigma, blur_options_t * opts);
+
+// blur_images blurs many images of any sizes in place.
+// Images are packed into large device buffers and each
+// batch is blurred with one launch per pass, while the
+// next batch is uploaded and the last one downloaded on
+// queues of their own.
+//
+// Batches always use the separable Gaussian, so the
+// mode in opts is ignored; the border is honored.
+int blur_images(bmp_t ** images, size_t count, int radius, cl_float sigma,
+                blur_options_t * opts);
+
 #endif
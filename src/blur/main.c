@@ -1,31 +1,83 @@
 #include <OpenCL/opencl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "bmp.h"
 #include "blur.h"
+#include "session.h"
+
+static int blur_single(const char * inputPath, const char * outputPath);
+static void free_images(bmp_t ** images, size_t count);
 
 int main(int argc, const char ** argv) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <input.bmp> <output.bmp>\n", argv[0]);
+  if (argc < 3 || argc % 2 != 1) {
+    fprintf(stderr, "Usage: %s <input.bmp> <output.bmp> [<input.bmp> <output.bmp> ...]\n",
+      argv[0]);
     return 1;
   }
 
-  bmp_t * inputImage = bmp_read(argv[1]);
-  if (inputImage == NULL) {
-    fprintf(stderr, "Could not read input image: %s\n", argv[1]);
+  if (argc == 3) {
+    return blur_single(argv[1], argv[2]);
+  }
+
+  size_t imageCount = (argc - 1) / 2;
+  bmp_t ** images = (bmp_t **)calloc(imageCount, sizeof(bmp_t *));
+  if (!images) {
+    fprintf(stderr, "Could not allocate images.\n");
     return 1;
   }
 
-  if (blur_image(inputImage, 10, 3)) {
-    fprintf(stderr, "Blur operation failed.\n");
+  for (size_t i = 0; i < imageCount; ++i) {
+    images[i] = bmp_read(argv[1 + i*2]);
+    if (images[i] == NULL) {
+      fprintf(stderr, "Could not read input image: %s\n", argv[1 + i*2]);
+      free_images(images, imageCount);
+      return 1;
+    }
+  }
+
+  session_t * session = session_create(NULL);
+  if (!session) {
+    fprintf(stderr, "Could not create OpenCL session.\n");
+    free_images(images, imageCount);
     return 1;
   }
 
-  if (bmp_write(inputImage, argv[2])) {
-    fprintf(stderr, "Could not create output image: %s\n", argv[2]);
-    bmp_free(inputImage);
+  blur_options_t opts = {session};
+  int res = blur_images(images, imageCount, 10, 3, &opts);
+  session_free(session);
+  if (res) {
+    fprintf(stderr, "Blur operation failed.\n");
+    free_images(images, imageCount);
     return 1;
   }
 
-  bmp_free(inputImage);
+  for (size_t i = 0; i < imageCount; ++i) {
+    if (bmp_write(images[i], argv[2 + i*2])) {
+      fprintf(stderr, "Could not create output image: %s\n", argv[2 + i*2]);
+      free_images(images, imageCount);
+      return 1;
+    }
+  }
+
+  free_images(images, imageCount);
   return 0;
 }
+
+// blur_single blurs one image from file to file, which
+// suits large images better than batching.
+static int blur_single(const char * inputPath, const char * outputPath) {
+  if (blur_file_to(inputPath, outputPath, 10, 3, NULL)) {
+    fprintf(stderr, "Could not blur %s into %s\n", inputPath, outputPath);
+    return 1;
+  }
+  return 0;
+}
+
+static void free_images(bmp_t ** images, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (images[i]) {
+      bmp_free(images[i]);
+    }
+  }
+  free(images);
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "pixel_convert.h"
+
+#define PIXEL_COUNT (16 << 20)
+#define REPEAT_COUNT 10
+#define MAX_CONVERTERS 4
+
+long long microtime();
+double gigabytes_per_second(size_t bytes, long long micros);
+
+int main() {
+  // Each direction has its own source, output and scalar
+  // result, so neither overwrites the other's input. The
+  // RGBA source has non-zero alpha, which packing drops.
+  uint8_t * rgb = (uint8_t *)malloc(PIXEL_COUNT * 3);
+  uint8_t * rgba = (uint8_t *)malloc(PIXEL_COUNT * 4);
+  uint8_t * expected = (uint8_t *)malloc(PIXEL_COUNT * 4);
+  uint8_t * rgbaSource = (uint8_t *)malloc(PIXEL_COUNT * 4);
+  uint8_t * packed = (uint8_t *)malloc(PIXEL_COUNT * 3);
+  uint8_t * expectedPacked = (uint8_t *)malloc(PIXEL_COUNT * 3);
+  if (!rgb || !rgba || !expected || !rgbaSource || !packed || !expectedPacked) {
+    fprintf(stderr, "Could not allocate pixels.\n");
+    return 1;
+  }
+  for (size_t i = 0; i < PIXEL_COUNT * 3; ++i) {
+    rgb[i] = (uint8_t)(i * 7 + (i >> 8));
+  }
+  for (size_t i = 0; i < PIXEL_COUNT * 4; ++i) {
+    rgbaSource[i] = (uint8_t)(i * 5 + (i >> 9) + 1);
+  }
+
+  const pixel_converter_t * converters[MAX_CONVERTERS];
+  size_t converterCount = pixel_converters(converters, MAX_CONVERTERS);
+  converters[0]->rgb_to_rgba(rgb, expected, PIXEL_COUNT);
+  converters[0]->rgba_to_rgb(rgbaSource, expectedPacked, PIXEL_COUNT);
+
+  printf("Converting %d pixels %d times (best: %s).\n", PIXEL_COUNT, REPEAT_COUNT,
+    pixel_converter()->name);
+  printf("%-8s %16s %16s\n", "", "RGB->RGBA GB/s", "RGBA->RGB GB/s");
+  for (size_t i = 0; i < converterCount; ++i) {
+    const pixel_converter_t * converter = converters[i];
+
+    // Throughput counts the bytes read plus the bytes written.
+    long long startTime = microtime();
+    for (int j = 0; j < REPEAT_COUNT; ++j) {
+      converter->rgb_to_rgba(rgb, rgba, PIXEL_COUNT);
+    }
+    long long expandTime = microtime() - startTime;
+    if (memcmp(rgba, expected, PIXEL_COUNT * 4)) {
+      fprintf(stderr, "%s: RGB->RGBA output differs from scalar.\n", converter->name);
+      return 1;
+    }
+
+    startTime = microtime();
+    for (int j = 0; j < REPEAT_COUNT; ++j) {
+      converter->rgba_to_rgb(rgbaSource, packed, PIXEL_COUNT);
+    }
+    long long packTime = microtime() - startTime;
+    if (memcmp(packed, expectedPacked, PIXEL_COUNT * 3)) {
+      fprintf(stderr, "%s: RGBA->RGB output differs from scalar.\n", converter->name);
+      return 1;
+    }
+
+    size_t bytes = (size_t)PIXEL_COUNT * 7 * REPEAT_COUNT;
+    printf("%-8s %16.2f %16.2f\n", converter->name, gigabytes_per_second(bytes, expandTime),
+      gigabytes_per_second(bytes, packTime));
+  }
+
+  free(rgb);
+  free(rgba);
+  free(expected);
+  free(rgbaSource);
+  free(packed);
+  free(expectedPacked);
+  return 0;
+}
+
+long long microtime() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return ((long long)t.tv_sec)*1000000 + (long long)t.tv_usec;
+}
+
+double gigabytes_per_second(size_t bytes, long long micros) {
+  if (micros <= 0) {
+    micros = 1;
+  }
+  return (double)bytes / (double)micros / 1000.0;
+}
@@ -0,0 +1,280 @@
+#include "image_loader.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define MAX_LOAD_THREADS 64
+
+typedef struct {
+  char ** paths;
+  size_t pathCount;
+  int width;
+  int height;
+  matrix_t * matrix;
+
+  // loaded is set for each path which filled its row.
+  char * loaded;
+
+  pthread_mutex_t lock;
+  size_t nextPath;
+
+  // failed is set when a file could not be loaded for a
+  // reason other than not being a usable image, which
+  // fails the whole load.
+  int failed;
+} image_loader_t;
+
+static char ** list_directory(const char * dir, size_t * countOut);
+static void free_paths(char ** paths, size_t count);
+static int compare_paths(const void * a, const void * b);
+static int find_shape(char ** paths, size_t count, int * widthOut, int * heightOut);
+static int not_image(int error);
+static int thread_count(int requested, size_t pathCount);
+static void * load_worker(void * arg);
+static int load_row(image_loader_t * loader, size_t row);
+static void compact_rows(image_loader_t * loader);
+
+matrix_t * load_image_matrix(const char * dir, int threadCount, int * widthOut,
+                             int * heightOut) {
+  image_loader_t loader;
+  bzero(&loader, sizeof(loader));
+  loader.paths = list_directory(dir, &loader.pathCount);
+  if (!loader.paths) {
+    return NULL;
+  }
+
+  // A directory without images gives an empty matrix.
+  int shape = find_shape(loader.paths, loader.pathCount, &loader.width, &loader.height);
+  if (shape < 0) {
+    free_paths(loader.paths, loader.pathCount);
+    return NULL;
+  } else if (shape) {
+    loader.width = loader.height = 0;
+  }
+
+  matrix_t * mat = (matrix_t *)malloc(sizeof(matrix_t));
+  if (!mat) {
+    free_paths(loader.paths, loader.pathCount);
+    return NULL;
+  }
+  mat->rows = loader.pathCount;
+  mat->cols = loader.width * loader.height;
+  mat->entries = (cl_uchar4 *)malloc(sizeof(cl_uchar4) * mat->rows * mat->cols + 1);
+  loader.loaded = (char *)calloc(loader.pathCount + 1, 1);
+  if (!mat->entries || !loader.loaded) {
+    free(loader.loaded);
+    free(mat->entries);
+    free(mat);
+    free_paths(loader.paths, loader.pathCount);
+    return NULL;
+  }
+  loader.matrix = mat;
+  pthread_mutex_init(&loader.lock, NULL);
+
+  int count = loader.width ? thread_count(threadCount, loader.pathCount) : 0;
+  pthread_t threads[MAX_LOAD_THREADS];
+  int started = 0;
+  for (; started < count; ++started) {
+    if (pthread_create(&threads[started], NULL, load_worker, &loader)) {
+      break;
+    }
+  }
+  if (count && !started) {
+    load_worker(&loader);
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&loader.lock);
+
+  if (!loader.failed) {
+    compact_rows(&loader);
+  }
+  free(loader.loaded);
+  free_paths(loader.paths, loader.pathCount);
+  if (loader.failed) {
+    matrix_free(mat);
+    return NULL;
+  }
+
+  (*widthOut) = loader.width;
+  (*heightOut) = loader.height;
+  return mat;
+}
+
+static char ** list_directory(const char * dir, size_t * countOut) {
+  DIR * dh = opendir(dir);
+  if (!dh) {
+    return NULL;
+  }
+
+  size_t count = 0;
+  size_t capacity = 64;
+  char ** paths = (char **)malloc(sizeof(char *) * capacity);
+  if (!paths) {
+    closedir(dh);
+    return NULL;
+  }
+
+  struct dirent * ent;
+  while ((ent = readdir(dh))) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+    if (count == capacity) {
+      char ** grown = (char **)realloc(paths, sizeof(char *) * capacity * 2);
+      if (!grown) {
+        break;
+      }
+      paths = grown;
+      capacity *= 2;
+    }
+    char * path = (char *)malloc(strlen(ent->d_name) + strlen(dir) + 2);
+    if (!path) {
+      break;
+    }
+    sprintf(path, "%s/%s", dir, ent->d_name);
+    paths[count++] = path;
+  }
+  int failed = ent != NULL;
+  closedir(dh);
+
+  if (failed) {
+    free_paths(paths, count);
+    return NULL;
+  }
+
+  qsort(paths, count, sizeof(char *), compare_paths);
+  (*countOut) = count;
+  return paths;
+}
+
+static void free_paths(char ** paths, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+static int compare_paths(const void * a, const void * b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// find_shape takes the size of the first image. It returns
+// 1 if there are no images and -1 if a file can't be read.
+static int find_shape(char ** paths, size_t count, int * widthOut, int * heightOut) {
+  for (size_t i = 0; i < count; ++i) {
+    errno = 0;
+    bmp_reader_t * reader = bmp_reader_open(paths[i]);
+    if (reader) {
+      (*widthOut) = reader->width;
+      (*heightOut) = reader->height;
+      bmp_reader_close(reader);
+      return 0;
+    } else if (!not_image(errno)) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+// not_image tells whether bmp_reader_open failed because
+// the file is not a BMP image, or is a directory, rather
+// than because it could not be read.
+static int not_image(int error) {
+  return error == EINVAL || error == EISDIR;
+}
+
+static int thread_count(int requested, size_t pathCount) {
+  long count = requested;
+  if (count <= 0) {
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (count > MAX_LOAD_THREADS) {
+    count = MAX_LOAD_THREADS;
+  }
+  if ((size_t)count > pathCount) {
+    count = pathCount;
+  }
+  return count < 1 ? 1 : (int)count;
+}
+
+// load_worker claims files one at a time until none are
+// left or a load fails. Since each file has its own row,
+// only the claim and the failure need the lock.
+static void * load_worker(void * arg) {
+  image_loader_t * loader = (image_loader_t *)arg;
+  while (1) {
+    pthread_mutex_lock(&loader->lock);
+    size_t row = loader->nextPath++;
+    int failed = loader->failed;
+    pthread_mutex_unlock(&loader->lock);
+    if (failed || row >= loader->pathCount) {
+      break;
+    }
+    int res = load_row(loader, row);
+    if (res < 0) {
+      pthread_mutex_lock(&loader->lock);
+      loader->failed = 1;
+      pthread_mutex_unlock(&loader->lock);
+      break;
+    }
+    loader->loaded[row] = !res;
+  }
+  return NULL;
+}
+
+// load_row decodes a file into its row. The reader only
+// buffers a block of rows at a time. It returns 0 when the
+// row was filled, 1 when the file is not an image of the
+// right size and is skipped, and -1 when the file could
+// not be read or memory ran out.
+static int load_row(image_loader_t * loader, size_t row) {
+  errno = 0;
+  bmp_reader_t * reader = bmp_reader_open(loader->paths[row]);
+  if (!reader) {
+    return not_image(errno) ? 1 : -1;
+  }
+  if (reader->width != loader->width || reader->height != loader->height) {
+    bmp_reader_close(reader);
+    return 1;
+  }
+
+  cl_uchar4 * entries = &loader->matrix->entries[row * loader->matrix->cols];
+  int res = bmp_reader_read(reader, 0, loader->height, entries,
+    sizeof(cl_uchar4) * loader->width);
+  bmp_reader_close(reader);
+
+  // The header was checked against the file's size, so a
+  // failed read is an I/O error.
+  return res ? -1 : 0;
+}
+
+// compact_rows drops the rows of files which could not be
+// loaded, keeping the rest in order, and gives back the
+// memory of the dropped rows.
+static void compact_rows(image_loader_t * loader) {
+  matrix_t * mat = loader->matrix;
+  size_t rowSize = sizeof(cl_uchar4) * mat->cols;
+  size_t dest = 0;
+  for (size_t row = 0; row < loader->pathCount; ++row) {
+    if (!loader->loaded[row]) {
+      continue;
+    }
+    if (dest != row) {
+      memmove(&mat->entries[dest * mat->cols], &mat->entries[row * mat->cols], rowSize);
+    }
+    ++dest;
+  }
+  mat->rows = dest;
+
+  cl_uchar4 * entries = (cl_uchar4 *)realloc(mat->entries,
+    sizeof(cl_uchar4) * mat->rows * mat->cols + 1);
+  if (entries) {
+    mat->entries = entries;
+  }
+}
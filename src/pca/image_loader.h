@@ -0,0 +1,17 @@
+#ifndef __IMAGE_LOADER_H__
+#define __IMAGE_LOADER_H__
+
+#include "matrix.h"
+
+// load_image_matrix reads every BMP image in dir into a row
+// of a new matrix, in order of file name. Images are
+// decoded on threadCount threads (one per CPU if it is 0)
+// straight into their rows, so memory use beyond the
+// matrix is a block of rows per thread. Files which are not
+// BMP images, or whose size differs from the first image,
+// are skipped. If a file can't be read, or memory runs
+// out, NULL is returned.
+matrix_t * load_image_matrix(const char * dir, int threadCount, int * widthOut,
+                             int * heightOut);
+
+#endif
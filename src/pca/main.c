@@ -1,49 +1,124 @@
-#include <dirent.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include "bmp.h"
+#include "image_loader.h"
 #include "matrix.h"
 #include "power_iter.h"
+#include "program_cache.h"
+#include "randomized_svd.h"
 
 #define MIN(x,y) (x < y ? x : y)
 #define MAX(x,y) (-(MIN(-x,-y)))
 
-bmp_t ** read_bitmaps(const char * dir, size_t * countOut);
-void free_bitmaps(bmp_t ** bmps, size_t count);
+#define MAX_ITERATIONS 1000
+#define TOLERANCE 1e-4f
+
+// The randomized method samples OVERSAMPLING more
+// directions than it is asked for and makes POWER_PASSES
+// power passes.
+#define OVERSAMPLING 10
+#define POWER_PASSES 2
+
+int parse_method(const char * name, power_iter_method_t * methodOut, int * randomizedOut);
+int parse_centering(const char * name, pca_centering_t * centeringOut);
+int run_power_iter(matrix_t * rowMatrix, int componentCount, power_iter_method_t method,
+                   pca_centering_t centering, const char * path, int width, int height);
+int run_randomized(matrix_t * rowMatrix, int componentCount, pca_centering_t centering,
+                   const char * path, int width, int height);
+void print_convergence(power_iter_t * iter);
+int write_components(cl_float3 * vectors, int count, size_t vectorSize, const char * path,
+                     int width, int height);
+char * component_path(const char * path, int idx);
 bmp_t * vec_to_image(cl_float3 * vec, size_t width, size_t height);
 void vec_to_image_chan(size_t chan, cl_float3 * vec, cl_uchar4 * out, size_t count);
 
 int main(int argc, const char ** argv) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <face-db> <output.bmp>\n", argv[0]);
+  if (argc < 3 || argc > 6) {
+    fprintf(stderr, "Usage: %s <face-db> <output.bmp> [components] "
+      "[auto|direct|snapshot|randomized] [none|mean|standardize]\n", argv[0]);
     return 1;
   }
 
-  size_t bmpCount;
-  bmp_t ** bitmaps = read_bitmaps(argv[1], &bmpCount);
-  if (!bitmaps) {
-    fprintf(stderr, "Failed to read bitmaps.\n");
+  int componentCount = argc >= 4 ? atoi(argv[3]) : 1;
+  if (componentCount < 1) {
+    fprintf(stderr, "Invalid component count: %s\n", argv[3]);
     return 1;
   }
 
-  if (bmpCount == 0) {
-    fprintf(stderr, "No images.\n");
+  power_iter_method_t method;
+  int randomized;
+  if (parse_method(argc >= 5 ? argv[4] : "auto", &method, &randomized)) {
+    fprintf(stderr, "Unknown method: %s\n", argv[4]);
     return 1;
   }
 
-  size_t width = bitmaps[0]->width;
-  size_t height = bitmaps[0]->height;
+  pca_centering_t centering;
+  if (parse_centering(argc == 6 ? argv[5] : "mean", &centering)) {
+    fprintf(stderr, "Unknown centering: %s\n", argv[5]);
+    return 1;
+  }
 
-  matrix_t * rowMatrix = matrix_for_image_rows(bitmaps, bmpCount);
-  free_bitmaps(bitmaps, bmpCount);
+  int width, height;
+  matrix_t * rowMatrix = load_image_matrix(argv[1], 0, &width, &height);
   if (!rowMatrix) {
-    fprintf(stderr, "Failed to allocate row matrix.\n");
+    fprintf(stderr, "Failed to read bitmaps.\n");
     return 1;
   }
 
-  power_iter_t * iter = power_iter_new(rowMatrix);
+  if (rowMatrix->rows == 0) {
+    fprintf(stderr, "No images.\n");
+    matrix_free(rowMatrix);
+    return 1;
+  }
+
+  // Centering the images leaves one dimension fewer.
+  int maxComponents = rowMatrix->rows - (centering != PCA_CENTER_NONE);
+  if (componentCount > maxComponents) {
+    componentCount = maxComponents > 0 ? maxComponents : 1;
+  }
+  if (randomized) {
+    return run_randomized(rowMatrix, componentCount, centering, argv[2], width, height);
+  }
+  return run_power_iter(rowMatrix, componentCount, method, centering, argv[2], width, height);
+}
+
+int parse_method(const char * name, power_iter_method_t * methodOut, int * randomizedOut) {
+  const char * names[4] = {"auto", "direct", "snapshot", "randomized"};
+  const power_iter_method_t methods[4] = {POWER_ITER_AUTO, POWER_ITER_DIRECT,
+    POWER_ITER_SNAPSHOT, POWER_ITER_AUTO};
+  for (int i = 0; i < 4; ++i) {
+    if (!strcmp(name, names[i])) {
+      (*methodOut) = methods[i];
+      (*randomizedOut) = i == 3;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int parse_centering(const char * name, pca_centering_t * centeringOut) {
+  const char * names[3] = {"none", "mean", "standardize"};
+  const pca_centering_t centerings[3] = {PCA_CENTER_NONE, PCA_CENTER_MEAN,
+    PCA_CENTER_STANDARDIZE};
+  for (int i = 0; i < 3; ++i) {
+    if (!strcmp(name, names[i])) {
+      (*centeringOut) = centerings[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// run_power_iter and run_randomized find the components,
+// write them out and return the exit status. They free
+// rowMatrix once it is on the device.
+int run_power_iter(matrix_t * rowMatrix, int componentCount, power_iter_method_t method,
+                   pca_centering_t centering, const char * path, int width, int height) {
+  power_iter_t * iter = power_iter_new_in(NULL, rowMatrix, componentCount, method,
+    centering);
   matrix_free(rowMatrix);
 
   if (!iter) {
@@ -51,21 +126,62 @@ int main(int argc, const char ** argv) {
     return 1;
   }
 
-  printf("Running power iteration...\n");
+  program_cache_print_stats(stdout);
 
-  for (int i = 0; i < 100; ++i) {
-    power_iter_run(iter, 1);
+  printf("Running power iteration on the %s matrix...\n",
+    iter->snapshot ? "snapshot" : "image");
+
+  if (power_iter_run(iter, MAX_ITERATIONS, TOLERANCE) < 0) {
+    fprintf(stderr, "Power iteration failed.\n");
+    power_iter_free(iter);
+    return 1;
   }
+  print_convergence(iter);
 
-  printf("Generating output file...\n");
+  printf("Generating output files...\n");
 
-  bmp_t * outImage = vec_to_image(iter->vector, width, height);
+  int res = write_components(iter->vector, iter->componentCount, iter->vectorSize, path,
+    width, height);
   power_iter_free(iter);
 
-  int res = outImage ? bmp_write(outImage, argv[2]) : -1;
-  if (outImage) {
-    bmp_free(outImage);
+  if (res) {
+    fprintf(stderr, "Failed to write output image.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int run_randomized(matrix_t * rowMatrix, int componentCount, pca_centering_t centering,
+                   const char * path, int width, int height) {
+  randomized_svd_t * svd = randomized_svd_new_in(NULL, rowMatrix, componentCount,
+    OVERSAMPLING, centering);
+  matrix_free(rowMatrix);
+
+  if (!svd) {
+    fprintf(stderr, "Could not initialize randomized SVD.\n");
+    return 1;
+  }
+
+  program_cache_print_stats(stdout);
+
+  printf("Running randomized SVD with %d samples...\n", svd->sampleCount);
+
+  if (randomized_svd_run(svd, POWER_PASSES)) {
+    fprintf(stderr, "Randomized SVD failed.\n");
+    randomized_svd_free(svd);
+    return 1;
   }
+  for (int i = 0; i < svd->componentCount; ++i) {
+    cl_float3 value = svd->eigenvalues[i];
+    printf("Component %d: eigenvalues %g %g %g\n", i, value.s[0], value.s[1], value.s[2]);
+  }
+
+  printf("Generating output files...\n");
+
+  int res = write_components(svd->vector, svd->componentCount, svd->vectorSize, path,
+    width, height);
+  randomized_svd_free(svd);
 
   if (res) {
     fprintf(stderr, "Failed to write output image.\n");
@@ -75,39 +191,54 @@ int main(int argc, const char ** argv) {
   return 0;
 }
 
-bmp_t ** read_bitmaps(const char * dir, size_t * countOut) {
-  DIR * dh = opendir(dir);
-  if (!dh) {
-    return NULL;
+void print_convergence(power_iter_t * iter) {
+  printf("%s after %d iterations.\n", iter->converged ? "Converged" : "Stopped",
+    iter->iterations);
+  for (int i = 0; i < iter->componentCount; ++i) {
+    cl_float3 value = iter->eigenvalues[i];
+    cl_float3 residual = iter->residuals[i];
+    printf("Component %d: eigenvalues %g %g %g, residuals %g %g %g\n", i,
+      value.s[0], value.s[1], value.s[2], residual.s[0], residual.s[1], residual.s[2]);
   }
+}
 
-  (*countOut) = 0;
-  bmp_t ** results = (bmp_t **)malloc(1);
-
-  while (1) {
-    struct dirent * ent = readdir(dh);
-    if (!ent) {
-      closedir(dh);
-      return results;
+// write_components writes each component as an image. With
+// more than one, the component's index is added to the
+// file name, so out.bmp becomes out-0.bmp, out-1.bmp...
+int write_components(cl_float3 * vectors, int count, size_t vectorSize, const char * path,
+                     int width, int height) {
+  for (int i = 0; i < count; ++i) {
+    char * outPath = NULL;
+    if (count > 1) {
+      outPath = component_path(path, i);
+      if (!outPath) {
+        return -1;
+      }
+    }
+    bmp_t * outImage = vec_to_image(&vectors[i * vectorSize], width, height);
+    int res = outImage ? bmp_write(outImage, outPath ? outPath : path) : -1;
+    if (outImage) {
+      bmp_free(outImage);
     }
-    char * path = (char *)malloc(strlen(ent->d_name) + strlen(dir) + 2);
-    sprintf(path, "%s/%s", dir, ent->d_name);
-    bmp_t * img = bmp_read(path);
-    free(path);
-    if (img == NULL) {
-      continue;
+    free(outPath);
+    if (res) {
+      return -1;
     }
-    ++(*countOut);
-    results = realloc(results, sizeof(bmp_t *) * (*countOut));
-    results[(*countOut)-1] = img;
   }
+  return 0;
 }
 
-void free_bitmaps(bmp_t ** bmps, size_t count) {
-  for (size_t i = 0; i < count; ++i) {
-    bmp_free(bmps[i]);
+char * component_path(const char * path, int idx) {
+  const char * ext = strrchr(path, '.');
+  if (!ext || strchr(ext, '/')) {
+    ext = path + strlen(path);
+  }
+  char * res = (char *)malloc(strlen(path) + 16);
+  if (!res) {
+    return NULL;
   }
-  free(bmps);
+  sprintf(res, "%.*s-%d%s", (int)(ext - path), path, idx, ext);
+  return res;
 }
 
 bmp_t * vec_to_image(cl_float3 * vec, size_t width, size_t height) {
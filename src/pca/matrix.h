@@ -4,14 +4,18 @@
 #include <OpenCL/opencl.h>
 #include "bmp.h"
 
+// matrix_t holds one image per row, keeping the pixels as
+// they come from the image (BGRA, one byte per channel).
+// Kernels convert entries to floats as they read them,
+// which keeps the matrix a quarter of the size of float3
+// entries. Alpha is ignored.
 typedef struct {
-  cl_float3 * entries;
+  cl_uchar4 * entries;
   int rows;
   int cols;
 } matrix_t;
 
 matrix_t * matrix_for_image_rows(bmp_t ** images, size_t count);
-matrix_t * matrix_transpose(matrix_t * mat);
 void matrix_free(matrix_t * mat);
 
 #endif
@@ -0,0 +1,549 @@
+#include "pca_kernels.h"
+#include <float.h>
+
+#define MIN_GRAM_GROUPS 256
+
+const char * pcaProgram = "\
+__kernel void apply(__global uchar4 * mat, int cols, \
+                    __global float3 * input, __global float3 * output, \
+                    int centered, __global float3 * mean, __global float3 * scale, \
+                    __global float3 * center, __local float3 * partial) { \
+  int row = get_group_id(0); \
+  int lane = get_local_id(0); \
+  int laneCount = get_local_size(0); \
+  __global uchar4 * matRow = &mat[(size_t)cols * row]; \
+  float3 result = 0; \
+  for (int i = lane; i < cols; i += laneCount) { \
+    float3 value = centered ? input[i] * scale[i] : input[i]; \
+    result += convert_float4(matRow[i]).xyz * value; \
+  } \
+  partial[lane] = result; \
+  barrier(CLK_LOCAL_MEM_FENCE); \
+  for (int step = laneCount / 2; step > 0; step /= 2) { \
+    if (lane < step) { \
+      partial[lane] += partial[lane + step]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  if (lane == 0) { \
+    output[row] = centered ? partial[0] - center[0] : partial[0]; \
+  } \
+} \
+\
+__kernel void apply_transpose(__global uchar4 * mat, int rows, int cols, \
+                              __global float3 * input, __global float3 * output, \
+                              int centered, __global float3 * mean, \
+                              __global float3 * scale, __global float3 * center, \
+                              __global float3 * stats, __global float3 * residuals, \
+                              __local float3 * partial) { \
+  int col = get_global_id(0); \
+  int lane = get_local_id(1); \
+  int laneCount = get_local_size(1); \
+  int width = get_local_size(0); \
+  float3 result = 0; \
+  if (col < cols) { \
+    for (int row = lane; row < rows; row += laneCount) { \
+      result += convert_float4(mat[(size_t)cols * row + col]).xyz * input[row]; \
+    } \
+  } \
+  int idx = lane * width + get_local_id(0); \
+  partial[idx] = result; \
+  barrier(CLK_LOCAL_MEM_FENCE); \
+  for (int step = laneCount / 2; step > 0; step /= 2) { \
+    if (lane < step) { \
+      partial[idx] += partial[idx + step * width]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  if (lane == 0) { \
+    float3 term = 0; \
+    if (col < cols) { \
+      float3 value = partial[idx]; \
+      if (centered) { \
+        value = scale[col] * (value - mean[col] * center[0]); \
+      } \
+      float3 diff = value - stats[0] * output[col]; \
+      output[col] = value; \
+      term = diff * diff; \
+    } \
+    partial[idx] = term; \
+  } \
+  barrier(CLK_LOCAL_MEM_FENCE); \
+  if (lane == 0 && get_local_id(0) == 0) { \
+    float3 sum = 0; \
+    for (int i = 0; i < width; ++i) { \
+      sum += partial[i]; \
+    } \
+    residuals[get_group_id(0)] = sum; \
+  } \
+} \
+\
+__kernel void block_apply(__global uchar4 * mat, int rows, int cols, int k, \
+                          __global float3 * input, __global float3 * output, \
+                          int centered, __global float3 * mean, __global float3 * scale, \
+                          __global float3 * center, \
+                          __local float3 * matTile, __local float3 * inputTile) { \
+  int lx = get_local_id(0); \
+  int ly = get_local_id(1); \
+  int size = get_local_size(0); \
+  int pitch = size + 1; \
+  int row0 = get_group_id(0) * size; \
+  int comp0 = get_group_id(1) * size; \
+  float3 result = 0; \
+  for (int col0 = 0; col0 < cols; col0 += size) { \
+    int col = col0 + lx; \
+    int row = row0 + ly; \
+    int comp = comp0 + ly; \
+    matTile[ly * pitch + lx] = (row < rows && col < cols) ? \
+      convert_float4(mat[(size_t)cols * row + col]).xyz : (float3)0; \
+    float3 value = (comp < k && col < cols) ? input[(size_t)cols * comp + col] : (float3)0; \
+    inputTile[ly * pitch + lx] = centered && col < cols ? value * scale[col] : value; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for (int t = 0; t < size; ++t) { \
+      result += matTile[lx * pitch + t] * inputTile[ly * pitch + t]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  int row = row0 + lx; \
+  int comp = comp0 + ly; \
+  if (row < rows && comp < k) { \
+    output[(size_t)rows * comp + row] = centered ? result - center[comp] : result; \
+  } \
+} \
+\
+__kernel void block_apply_transpose(__global uchar4 * mat, int rows, int cols, int k, \
+                                    __global float3 * input, __global float3 * output, \
+                                    int centered, __global float3 * mean, \
+                                    __global float3 * scale, __global float3 * center, \
+                                    int withResiduals, __global float3 * stats, \
+                                    __global float3 * residuals, \
+                                    __local float3 * matTile, __local float3 * inputTile) { \
+  int lx = get_local_id(0); \
+  int ly = get_local_id(1); \
+  int size = get_local_size(0); \
+  int pitch = size + 1; \
+  int col0 = get_group_id(0) * size; \
+  int comp0 = get_group_id(1) * size; \
+  float3 result = 0; \
+  for (int row0 = 0; row0 < rows; row0 += size) { \
+    int row = row0 + ly; \
+    int col = col0 + lx; \
+    matTile[ly * pitch + lx] = (row < rows && col < cols) ? \
+      convert_float4(mat[(size_t)cols * row + col]).xyz : (float3)0; \
+    int comp = comp0 + ly; \
+    int inputRow = row0 + lx; \
+    inputTile[ly * pitch + lx] = (comp < k && inputRow < rows) ? \
+      input[(size_t)rows * comp + inputRow] : (float3)0; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for (int t = 0; t < size; ++t) { \
+      result += matTile[t * pitch + lx] * inputTile[ly * pitch + t]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  int col = col0 + lx; \
+  int comp = comp0 + ly; \
+  float3 term = 0; \
+  if (col < cols && comp < k) { \
+    size_t idx = (size_t)cols * comp + col; \
+    if (centered) { \
+      result = scale[col] * (result - mean[col] * center[comp]); \
+    } \
+    if (withResiduals) { \
+      float3 diff = result - stats[comp] * output[idx]; \
+      term = diff * diff; \
+    } \
+    output[idx] = result; \
+  } \
+  if (withResiduals) { \
+    matTile[ly * pitch + lx] = term; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    if (lx == 0 && comp < k) { \
+      float3 sum = 0; \
+      for (int t = 0; t < size; ++t) { \
+        sum += matTile[ly * pitch + t]; \
+      } \
+      residuals[(size_t)get_num_groups(0) * comp + get_group_id(0)] = sum; \
+    } \
+  } \
+} \
+\
+__kernel void snapshot(__global uchar4 * mat, int rows, int cols, \
+                       __global float3 * output, int centered, __global float3 * mean, \
+                       __global float3 * scale, __local float3 * tileA, \
+                       __local float3 * tileB) { \
+  int lx = get_local_id(0); \
+  int ly = get_local_id(1); \
+  int size = get_local_size(0); \
+  int pitch = size + 1; \
+  int a0 = get_group_id(1) * size; \
+  int b0 = get_group_id(0) * size; \
+  if (b0 < a0) { \
+    return; \
+  } \
+  float3 result = 0; \
+  for (int i0 = 0; i0 < cols; i0 += size) { \
+    int i = i0 + lx; \
+    int a = a0 + ly; \
+    int b = b0 + ly; \
+    float3 shift = centered && i < cols ? mean[i] : (float3)0; \
+    float3 weight = centered && i < cols ? scale[i] : (float3)1; \
+    tileA[ly * pitch + lx] = (a < rows && i < cols) ? \
+      (convert_float4(mat[(size_t)cols * a + i]).xyz - shift) * weight : (float3)0; \
+    tileB[ly * pitch + lx] = (b < rows && i < cols) ? \
+      (convert_float4(mat[(size_t)cols * b + i]).xyz - shift) * weight : (float3)0; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for (int t = 0; t < size; ++t) { \
+      result += tileA[ly * pitch + t] * tileB[lx * pitch + t]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  int a = a0 + ly; \
+  int b = b0 + lx; \
+  if (a < rows && b < rows) { \
+    output[(size_t)rows * a + b] = result; \
+    output[(size_t)rows * b + a] = result; \
+  } \
+} \
+\
+__kernel void snapshot_apply(__global float3 * mat, int rows, int cols, int k, \
+                             __global float3 * input, __global float3 * output, \
+                             int centered, __global float3 * mean, \
+                             __global float3 * scale, __global float3 * center, \
+                             int withResiduals, __global float3 * stats, \
+                             __global float3 * residuals, \
+                             __local float3 * matTile, __local float3 * inputTile) { \
+  int lx = get_local_id(0); \
+  int ly = get_local_id(1); \
+  int size = get_local_size(0); \
+  int pitch = size + 1; \
+  int col0 = get_group_id(0) * size; \
+  int comp0 = get_group_id(1) * size; \
+  float3 result = 0; \
+  for (int row0 = 0; row0 < rows; row0 += size) { \
+    int row = row0 + ly; \
+    int col = col0 + lx; \
+    matTile[ly * pitch + lx] = (row < rows && col < cols) ? \
+      mat[(size_t)cols * row + col] : (float3)0; \
+    int comp = comp0 + ly; \
+    int inputRow = row0 + lx; \
+    inputTile[ly * pitch + lx] = (comp < k && inputRow < rows) ? \
+      input[(size_t)rows * comp + inputRow] : (float3)0; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for (int t = 0; t < size; ++t) { \
+      result += matTile[t * pitch + lx] * inputTile[ly * pitch + t]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  int col = col0 + lx; \
+  int comp = comp0 + ly; \
+  float3 term = 0; \
+  if (col < cols && comp < k) { \
+    size_t idx = (size_t)cols * comp + col; \
+    if (centered) { \
+      result = scale[col] * (result - mean[col] * center[comp]); \
+    } \
+    if (withResiduals) { \
+      float3 diff = result - stats[comp] * output[idx]; \
+      term = diff * diff; \
+    } \
+    output[idx] = result; \
+  } \
+  if (withResiduals) { \
+    matTile[ly * pitch + lx] = term; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    if (lx == 0 && comp < k) { \
+      float3 sum = 0; \
+      for (int t = 0; t < size; ++t) { \
+        sum += matTile[ly * pitch + t]; \
+      } \
+      residuals[(size_t)get_num_groups(0) * comp + get_group_id(0)] = sum; \
+    } \
+  } \
+} \
+\
+__kernel void gram(__global float3 * vectors, int length, int k, int chunkLength, \
+                   __global float3 * partial, __local float3 * tileA, \
+                   __local float3 * tileB) { \
+  int lx = get_local_id(0); \
+  int ly = get_local_id(1); \
+  int size = get_local_size(0); \
+  int pitch = size + 1; \
+  int a0 = get_group_id(1) * size; \
+  int b0 = get_group_id(0) * size; \
+  int chunk = get_group_id(2); \
+  int start = chunk * chunkLength; \
+  int end = min(length, start + chunkLength); \
+  float3 result = 0; \
+  for (int i0 = start; i0 < end; i0 += size) { \
+    int i = i0 + lx; \
+    int a = a0 + ly; \
+    int b = b0 + ly; \
+    tileA[ly * pitch + lx] = (a < k && i < end) ? vectors[(size_t)length * a + i] : (float3)0; \
+    tileB[ly * pitch + lx] = (b < k && i < end) ? vectors[(size_t)length * b + i] : (float3)0; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for (int t = 0; t < size; ++t) { \
+      result += tileA[ly * pitch + t] * tileB[lx * pitch + t]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  int a = a0 + ly; \
+  int b = b0 + lx; \
+  if (a < k && b < k) { \
+    partial[(size_t)k * k * chunk + a * k + b] = result; \
+  } \
+} \
+\
+__kernel void factor(__global float3 * partial, int chunks, int k, __global float3 * gram, \
+                     __global float3 * factor, __global float3 * scale, float shift, \
+                     __global float3 * status, int statusOffset) { \
+  int lid = get_local_id(0); \
+  int lsize = get_local_size(0); \
+  int kk = k * k; \
+  for (int idx = lid; idx < kk; idx += lsize) { \
+    float3 sum = 0; \
+    for (int c = 0; c < chunks; ++c) { \
+      sum += partial[c * kk + idx]; \
+    } \
+    gram[idx] = sum; \
+  } \
+  barrier(CLK_GLOBAL_MEM_FENCE); \
+  for (int i = lid; i < k; i += lsize) { \
+    scale[i] = rsqrt(max(gram[i * k + i], (float3)FLT_MIN)); \
+  } \
+  barrier(CLK_GLOBAL_MEM_FENCE); \
+  for (int idx = lid; idx < kk; idx += lsize) { \
+    gram[idx] *= scale[idx / k] * scale[idx % k]; \
+    if (idx / k == idx % k) { \
+      gram[idx] += shift; \
+    } \
+  } \
+  barrier(CLK_GLOBAL_MEM_FENCE); \
+  float3 breakdowns = 0; \
+  for (int j = 0; j < k; ++j) { \
+    float3 square = gram[j * k + j]; \
+    int3 positive = isgreater(square, (float3)FLT_EPSILON); \
+    breakdowns += select((float3)1, (float3)0, positive); \
+    float3 pivot = sqrt(select((float3)FLT_EPSILON, square, positive)); \
+    for (int i = j + 1 + lid; i < k; i += lsize) { \
+      gram[j * k + i] /= pivot; \
+    } \
+    barrier(CLK_GLOBAL_MEM_FENCE); \
+    if (lid == 0) { \
+      gram[j * k + j] = pivot; \
+    } \
+    int rest = k - j - 1; \
+    for (int idx = lid; idx < rest * rest; idx += lsize) { \
+      int a = j + 1 + idx / rest; \
+      int b = j + 1 + idx % rest; \
+      if (b >= a) { \
+        gram[a * k + b] -= gram[j * k + a] * gram[j * k + b]; \
+      } \
+    } \
+    barrier(CLK_GLOBAL_MEM_FENCE); \
+  } \
+  for (int c = lid; c < k; c += lsize) { \
+    factor[c * k + c] = 1 / gram[c * k + c]; \
+    for (int i = c - 1; i >= 0; --i) { \
+      float3 sum = 0; \
+      for (int m = i + 1; m <= c; ++m) { \
+        sum += gram[i * k + m] * factor[m * k + c]; \
+      } \
+      factor[i * k + c] = -sum / gram[i * k + i]; \
+    } \
+    for (int i = c + 1; i < k; ++i) { \
+      factor[i * k + c] = 0; \
+    } \
+  } \
+  barrier(CLK_GLOBAL_MEM_FENCE); \
+  for (int idx = lid; idx < kk; idx += lsize) { \
+    factor[idx] *= scale[idx / k]; \
+  } \
+  if (lid == 0) { \
+    status[statusOffset] += breakdowns; \
+  } \
+} \
+\
+__kernel void orthonormalize(__global float3 * vectors, int length, int k, \
+                             __global float3 * factor, __local float3 * vecTile, \
+                             __local float3 * factorTile) { \
+  int lx = get_local_id(0); \
+  int ly = get_local_id(1); \
+  int size = get_local_size(0); \
+  int pitch = size + 1; \
+  int i = get_group_id(0) * size + lx; \
+  for (int comp0 = (k - 1) / size * size; comp0 >= 0; comp0 -= size) { \
+    float3 result = 0; \
+    for (int j0 = 0; j0 <= comp0; j0 += size) { \
+      int j = j0 + ly; \
+      int factorComp = comp0 + lx; \
+      vecTile[ly * pitch + lx] = (j < k && i < length) ? \
+        vectors[(size_t)length * j + i] : (float3)0; \
+      factorTile[ly * pitch + lx] = (j < k && factorComp < k) ? \
+        factor[j * k + factorComp] : (float3)0; \
+      barrier(CLK_LOCAL_MEM_FENCE); \
+      for (int t = 0; t < size; ++t) { \
+        result += vecTile[t * pitch + lx] * factorTile[t * pitch + ly]; \
+      } \
+      barrier(CLK_LOCAL_MEM_FENCE); \
+    } \
+    int comp = comp0 + ly; \
+    if (comp < k && i < length) { \
+      vectors[(size_t)length * comp + i] = result; \
+    } \
+  } \
+} \
+\
+__kernel void sum_rows(__global float3 * input, int length, int square, \
+                       __global float3 * output, int outputOffset, \
+                       __local float3 * partial) { \
+  int row = get_group_id(0); \
+  int lane = get_local_id(0); \
+  int laneCount = get_local_size(0); \
+  __global float3 * inputRow = &input[(size_t)length * row]; \
+  float3 result = 0; \
+  for (int i = lane; i < length; i += laneCount) { \
+    float3 value = inputRow[i]; \
+    result += square ? value * value : value; \
+  } \
+  partial[lane] = result; \
+  barrier(CLK_LOCAL_MEM_FENCE); \
+  for (int step = laneCount / 2; step > 0; step /= 2) { \
+    if (lane < step) { \
+      partial[lane] += partial[lane + step]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  if (lane == 0) { \
+    output[outputOffset + row] = partial[0]; \
+  } \
+} \
+\
+__kernel void combine(__global float3 * input, int length, int count, \
+                      __global float3 * factor, int k, __global float3 * output, \
+                      __local float3 * inputTile, __local float3 * factorTile) { \
+  int lx = get_local_id(0); \
+  int ly = get_local_id(1); \
+  int size = get_local_size(0); \
+  int pitch = size + 1; \
+  int i = get_group_id(0) * size + lx; \
+  int comp0 = get_group_id(1) * size; \
+  float3 result = 0; \
+  for (int j0 = 0; j0 < count; j0 += size) { \
+    int j = j0 + ly; \
+    int factorComp = comp0 + lx; \
+    inputTile[ly * pitch + lx] = (j < count && i < length) ? \
+      input[(size_t)length * j + i] : (float3)0; \
+    factorTile[ly * pitch + lx] = (j < count && factorComp < k) ? \
+      factor[j * k + factorComp] : (float3)0; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for (int t = 0; t < size; ++t) { \
+      result += inputTile[t * pitch + lx] * factorTile[t * pitch + ly]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  int comp = comp0 + ly; \
+  if (comp < k && i < length) { \
+    output[(size_t)length * comp + i] = result; \
+  } \
+} \
+\
+__kernel void column_stats(__global uchar4 * mat, int rows, int cols, int standardize, \
+                           __global float3 * mean, __global float3 * scale) { \
+  int col = get_global_id(0); \
+  if (col >= cols) { \
+    return; \
+  } \
+  float3 shift = convert_float4(mat[col]).xyz; \
+  float3 sum = 0; \
+  float3 squares = 0; \
+  for (int row = 1; row < rows; ++row) { \
+    float3 value = convert_float4(mat[(size_t)cols * row + col]).xyz - shift; \
+    sum += value; \
+    squares += value * value; \
+  } \
+  float3 average = sum / (float)rows; \
+  float3 center = shift + average; \
+  mean[col] = center; \
+  float3 variance = max(squares / (float)rows - average * average, (float3)0); \
+  float3 limit = FLT_EPSILON * center * center; \
+  scale[col] = standardize ? select((float3)0, rsqrt(variance), variance > limit) : (float3)1; \
+} \
+\
+__kernel void center_dot(__global float3 * input, int length, __global float3 * mean, \
+                         __global float3 * scale, __global float3 * output, \
+                         __local float3 * partial) { \
+  int comp = get_group_id(0); \
+  int lane = get_local_id(0); \
+  int laneCount = get_local_size(0); \
+  __global float3 * inputRow = &input[(size_t)length * comp]; \
+  float3 result = 0; \
+  for (int i = lane; i < length; i += laneCount) { \
+    result += inputRow[i] * mean[i] * scale[i]; \
+  } \
+  partial[lane] = result; \
+  barrier(CLK_LOCAL_MEM_FENCE); \
+  for (int step = laneCount / 2; step > 0; step /= 2) { \
+    if (lane < step) { \
+      partial[lane] += partial[lane + step]; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+  } \
+  if (lane == 0) { \
+    output[comp] = partial[0]; \
+  } \
+} \
+";
+
+size_t pca_group_size(size_t maxWorkGroup, size_t max) {
+  size_t size = max;
+  while (size && size > maxWorkGroup) {
+    size /= 2;
+  }
+  return size;
+}
+
+size_t pca_group_limit(context_t * ctx, int kernelIdx) {
+  size_t limit = context_work_group_size(ctx, kernelIdx);
+  size_t items = context_work_item_size(ctx, 0);
+  return items < limit ? items : limit;
+}
+
+size_t pca_tile_size(context_t * ctx, const int * kernels, size_t count) {
+  size_t maxWorkGroup = PCA_MAX_TILE * PCA_MAX_TILE;
+  for (size_t i = 0; i < count; ++i) {
+    size_t size = context_work_group_size(ctx, kernels[i]);
+    maxWorkGroup = size < maxWorkGroup ? size : maxWorkGroup;
+  }
+  // Tiles are square, so both of the device's first two
+  // dimensions must hold a side.
+  size_t maxSide = PCA_MAX_TILE;
+  for (size_t dim = 0; dim < 2; ++dim) {
+    size_t items = context_work_item_size(ctx, dim);
+    maxSide = items < maxSide ? items : maxSide;
+  }
+  size_t tile = PCA_MAX_TILE;
+  while (tile && (tile * tile > maxWorkGroup || tile > maxSide)) {
+    tile /= 2;
+  }
+  return tile;
+}
+
+// The Gram matrix is split until there are about
+// MIN_GRAM_GROUPS work-groups. Chunks are whole numbers of
+// the largest tile, which makes them whole numbers of any
+// smaller one too.
+size_t pca_gram_chunk_length(size_t k, size_t length) {
+  size_t kTiles = (k + PCA_MAX_TILE - 1) / PCA_MAX_TILE;
+  size_t lengthTiles = (length + PCA_MAX_TILE - 1) / PCA_MAX_TILE;
+  size_t chunks = MIN_GRAM_GROUPS / (kTiles * kTiles);
+  chunks = chunks < 1 ? 1 : (chunks > lengthTiles ? lengthTiles : chunks);
+  return (lengthTiles + chunks - 1) / chunks * PCA_MAX_TILE;
+}
+
+cl_float pca_cholqr_shift(size_t k) {
+  return PCA_CHOLQR_SHIFT * k * FLT_EPSILON;
+}
+
+size_t pca_round_up(size_t value, size_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
@@ -0,0 +1,92 @@
+#ifndef __PCA_KERNELS_H__
+#define __PCA_KERNELS_H__
+
+#include "context.h"
+
+// The block kernels work on square tiles of up to
+// PCA_MAX_TILE entries a side. They take the side from
+// the work-group, so any power of two works, down to one
+// on the smallest devices. The factor kernel runs in a
+// single work-group of up to PCA_MAX_FACTOR_GROUP.
+// Whole vectors are summed by work-groups of up to
+// PCA_MAX_SUM_GROUP.
+#define PCA_MAX_TILE 16
+#define PCA_MAX_FACTOR_GROUP 256
+#define PCA_MAX_SUM_GROUP 256
+
+// A set of vectors is orthonormalized by PCA_CHOLQR_PASSES
+// Cholesky QRs in a row. A single pass in float loses
+// orthogonality once the vectors are even slightly
+// dependent, so the first pass shifts the diagonal of the
+// Gram matrix by pca_cholqr_shift, which keeps it positive
+// definite, and the later passes clean up what is left.
+#define PCA_CHOLQR_PASSES 3
+#define PCA_CHOLQR_SHIFT 10
+
+// pca_centering_t says how the columns of the image
+// matrix, one per pixel, are adjusted before the
+// components are found. The kernels apply it on the fly,
+// so the matrix on the device is never changed.
+typedef enum {
+  // PCA_CENTER_NONE uses the pixels as they are.
+  PCA_CENTER_NONE = 0,
+  // PCA_CENTER_MEAN subtracts the mean image from every
+  // image.
+  PCA_CENTER_MEAN,
+  // PCA_CENTER_STANDARDIZE also divides each pixel by its
+  // standard deviation over the images. Pixels whose
+  // variance is within rounding of zero relative to their
+  // mean are scaled by zero instead.
+  PCA_CENTER_STANDARDIZE
+} pca_centering_t;
+
+// pcaProgram holds the kernels shared by the PCA solvers.
+// The image matrix is always uchar4 pixels in row-major
+// order, and a set of k vectors is stored one vector after
+// another.
+//
+// The matrix products are apply, apply_transpose,
+// block_apply and block_apply_transpose, and snapshot and
+// snapshot_apply form and apply rowMat*rowMat'. The
+// Cholesky QR is gram, factor and orthonormalize. factor
+// adds the number of pivots which were not positive to a
+// status entry, as the vectors have then lost rank. combine
+// multiplies a set of vectors by a small dense matrix, and
+// sum_rows sums each of a set of vectors.
+//
+// column_stats finds the mean and scale of each column in
+// one pass over the matrix. With them, the products take
+// A*x as A*(s.x) - (m.s.x) and A'*y as s.(A'*y - m*sum(y)),
+// where m is the mean and s the scale. The dot products
+// (m.s.x), from center_dot, and sum(y), from sum_rows, are
+// passed in as center.
+extern const char * pcaProgram;
+
+// pca_group_size returns the largest power of two which is
+// at most max and fits the work-group limit, or 0 if the
+// limit is 0. The kernels' reductions need a power of two.
+size_t pca_group_size(size_t maxWorkGroup, size_t max);
+
+// pca_group_limit returns the most work-items a 1-D
+// work-group of the kernel may have, which is bounded by
+// both the kernel and the device's first dimension.
+size_t pca_group_limit(context_t * ctx, int kernelIdx);
+
+// pca_tile_size picks the side of the square work-groups
+// used by the given block kernels, which must fit all of
+// them and the device's first two dimensions, or returns
+// 0 if a limit is 0.
+size_t pca_tile_size(context_t * ctx, const int * kernels, size_t count);
+
+// pca_gram_chunk_length splits vectors of the given length
+// into chunks for the gram kernel, to keep the device busy
+// when k, and with it the Gram matrix, is small.
+size_t pca_gram_chunk_length(size_t k, size_t length);
+
+// pca_cholqr_shift returns the diagonal shift used by the
+// first Cholesky QR pass for k vectors.
+cl_float pca_cholqr_shift(size_t k);
+
+size_t pca_round_up(size_t value, size_t multiple);
+
+#endif
@@ -1,181 +1,713 @@
 #include "power_iter.h"
+#include "pca_kernels.h"
 #include <math.h>
 #include <string.h>
+#include <strings.h>
 
-#define ROW_MATRIX_BUFF 0
-#define COL_MATRIX_BUFF 1
-#define ROW_OUTPUT_BUFF 2
-#define COL_OUTPUT_BUFF 3
+#define MATRIX_BUFF 0
+#define ROW_OUTPUT_BUFF 1
+#define VECTOR_BUFF 2
+#define GRAM_PARTIAL_BUFF 3
+#define GRAM_BUFF 4
+#define FACTOR_BUFF 5
+#define SCALE_BUFF 6
+#define RESIDUAL_PARTIAL_BUFF 7
+#define STATS_BUFF 8
+#define MEAN_BUFF 9
+#define PIXEL_SCALE_BUFF 10
+#define CENTER_BUFF 11
+#define SNAPSHOT_BUFF 12
+#define SNAPSHOT_VECTOR_BUFF 13
 
 #define ROW_MULT_KERNEL 0
 #define COL_MULT_KERNEL 1
+#define BLOCK_ROW_MULT_KERNEL 2
+#define BLOCK_COL_MULT_KERNEL 3
+#define GRAM_KERNEL 4
+#define FACTOR_KERNEL 5
+#define ORTHONORMALIZE_KERNEL 6
+#define SQUARES_KERNEL 7
+#define RESIDUAL_KERNEL 8
+#define SNAPSHOT_KERNEL 9
+#define SNAPSHOT_ROW_KERNEL 10
+#define SNAPSHOT_COL_KERNEL 11
+#define COLUMN_STATS_KERNEL 12
+#define CENTER_DOT_KERNEL 13
+#define ROW_SUM_KERNEL 14
+#define SHIFTED_FACTOR_KERNEL 15
+
+// Each row of the product is summed by one work-group of
+// up to MAX_ROW_GROUP work-items. Work-groups of the
+// transposed product cover up to COL_GROUP_WIDTH columns,
+// and up to MAX_COL_LANES work-items share the rows of
+// each.
+#define MAX_ROW_GROUP 256
+#define COL_GROUP_WIDTH 16
+#define MAX_COL_LANES 16
+
+// POWER_ITER_AUTO only picks the snapshot method when the
+// rows by rows matrix is at most 1/SNAPSHOT_SAVING of the
+// image matrix, so that iterating on it reads much less.
+#define SNAPSHOT_SAVING 4
 
 static cl_float random_float();
-static int write_output_vector(power_iter_t * iter);
+static int prefer_snapshot(session_t * session, matrix_t * rowMat);
+static int set_kernel_params(power_iter_t * iter, matrix_t * rowMat);
+static int set_block_params(power_iter_t * iter, int kernelIdx, int matrixBuff, cl_int rows,
+                            cl_int cols, int inputBuff, int outputBuff, cl_int centered,
+                            cl_int withResiduals);
+static int set_orthonormalize_params(power_iter_t * iter, int vectorBuff, size_t length);
+static int find_column_stats(power_iter_t * iter);
+static int form_snapshot(power_iter_t * iter);
+static int randomize_vectors(power_iter_t * iter);
+static int run_iteration(power_iter_t * iter, cl_float3 * stats, cl_event * statsEvent);
+static int wait_for_stats(power_iter_t * iter, cl_event * event, cl_float3 * stats,
+                          cl_float tolerance);
+static int run_orthonormalize(power_iter_t * iter, size_t length);
+static int lift_vectors(power_iter_t * iter);
+static int run_center_sums(power_iter_t * iter, int kernelIdx);
 static int read_output_vector(power_iter_t * iter);
-static void normalize_output(power_iter_t * iter);
-
-static const char * multProgram = "\
-__kernel void apply(__global float3 * mat, int cols, \
-                    __global float3 * input, __global float3 * output) { \
-  int row = get_global_id(0); \
-  __global float3 * matRow = &mat[cols * row]; \
-  float3 result = 0; \
-  for (int i = 0; i < cols; ++i) { \
-    result += matRow[i] * input[i]; \
-  } \
-  output[row] = result; \
-} \
-";
-
-power_iter_t * power_iter_new(matrix_t * rowMat) {
-  const char * kernelNames[2] = {"apply", "apply"};
-  size_t matrixSize = rowMat->cols * rowMat->rows * sizeof(cl_float3);
-  size_t outputSize1 = rowMat->rows * sizeof(cl_float3);
-  size_t outputSize2 = rowMat->cols * sizeof(cl_float3);
-  size_t bufferSizes[4] = {matrixSize, matrixSize, outputSize1, outputSize2};
+static int lost_rank(cl_float3 breakdowns);
+
+power_iter_t * power_iter_new(matrix_t * rowMat, int componentCount) {
+  return power_iter_new_in(NULL, rowMat, componentCount, POWER_ITER_AUTO, PCA_CENTER_NONE);
+}
+
+power_iter_t * power_iter_new_in(session_t * session, matrix_t * rowMat, int componentCount,
+                                 power_iter_method_t method, pca_centering_t centering) {
+  power_iter_t * res = (power_iter_t *)malloc(sizeof(power_iter_t));
+  if (!res) {
+    return NULL;
+  }
+  bzero(res, sizeof(power_iter_t));
+  res->componentCount = componentCount;
+  res->centering = centering;
+  res->vectorSize = rowMat->cols;
+  res->intermediateSize = rowMat->rows;
+
+  // The method depends on the device, so a private session
+  // is made up front and handed to the context below.
+  session_t * ownSession = NULL;
+  if (!session) {
+    session = ownSession = session_create(NULL);
+    if (!session) {
+      power_iter_free(res);
+      return NULL;
+    }
+  }
+  if (method == POWER_ITER_AUTO) {
+    method = prefer_snapshot(session, rowMat) ? POWER_ITER_SNAPSHOT : POWER_ITER_DIRECT;
+  }
+  res->snapshot = method == POWER_ITER_SNAPSHOT;
+  res->iterateSize = res->snapshot ? res->intermediateSize : res->vectorSize;
+  res->vector = (cl_float3 *)malloc(sizeof(cl_float3) * res->vectorSize * componentCount);
+  res->eigenvalues = (cl_float3 *)calloc(componentCount, sizeof(cl_float3));
+  res->residuals = (cl_float3 *)calloc(componentCount, sizeof(cl_float3));
+  res->stats = (cl_float3 *)calloc((componentCount * 2 + 1) * 2, sizeof(cl_float3));
+  if (!res->vector || !res->eigenvalues || !res->residuals || !res->stats) {
+    if (ownSession) {
+      session_free(ownSession);
+    }
+    power_iter_free(res);
+    return NULL;
+  }
+
+  const char * kernelNames[16] = {"apply", "apply_transpose", "block_apply",
+    "block_apply_transpose", "gram", "factor", "orthonormalize", "sum_rows", "sum_rows",
+    "snapshot", "snapshot_apply", "snapshot_apply", "column_stats", "center_dot", "sum_rows",
+    "factor"};
+  size_t k = componentCount;
+  size_t matrixSize = (size_t)rowMat->cols * rowMat->rows * sizeof(cl_uchar4);
+  size_t columnStatSize = (centering ? rowMat->cols : 1) * sizeof(cl_float3);
+  size_t bufferSizes[14] = {matrixSize, rowMat->rows * k * sizeof(cl_float3),
+    res->vectorSize * k * sizeof(cl_float3), 0, k * k * sizeof(cl_float3),
+    k * k * sizeof(cl_float3), k * sizeof(cl_float3), 0, (k * 2 + 1) * sizeof(cl_float3),
+    columnStatSize, columnStatSize, k * sizeof(cl_float3),
+    (size_t)rowMat->rows * rowMat->rows * sizeof(cl_float3),
+    rowMat->rows * k * sizeof(cl_float3)};
+
+  // The transposed product sums the residual of each group
+  // of columns. The group width is only known once the
+  // kernels are built, so this fits the usual groups of
+  // PCA_MAX_TILE columns and grows below if they are
+  // narrower.
+  bufferSizes[RESIDUAL_PARTIAL_BUFF] = (res->iterateSize + PCA_MAX_TILE - 1) / PCA_MAX_TILE *
+    k * sizeof(cl_float3);
+
+  // The snapshot method orthonormalizes both the short
+  // vectors it iterates on and the long ones it lifts
+  // them to, so its partial sums fit either.
+  size_t chunks = (res->vectorSize + pca_gram_chunk_length(k, res->vectorSize) - 1) /
+    pca_gram_chunk_length(k, res->vectorSize);
+  if (res->snapshot) {
+    size_t length = res->iterateSize;
+    size_t snapshotChunks = (length + pca_gram_chunk_length(k, length) - 1) /
+      pca_gram_chunk_length(k, length);
+    chunks = snapshotChunks > chunks ? snapshotChunks : chunks;
+  }
+  bufferSizes[GRAM_PARTIAL_BUFF] = chunks * k * k * sizeof(cl_float3);
 
   context_params_t params;
-  params.program = multProgram;
-  params.kernelCount = 2;
+  params.program = pcaProgram;
+  params.kernelCount = 16;
   params.kernelNames = kernelNames;
-  params.bufferCount = 4;
+  params.bufferCount = res->snapshot ? 14 : 12;
   params.bufferSizes = bufferSizes;
-  context_t * ctx = context_create(&params);
+  params.hostPointers = NULL;
+  context_t * ctx = context_create_in(session, &params);
   if (!ctx) {
+    if (ownSession) {
+      session_free(ownSession);
+    }
+    power_iter_free(res);
     return NULL;
   }
+  ctx->ownsSession = ownSession != NULL;
+  res->context = ctx;
 
-  void * mappedBuff = context_map(ctx, ROW_MATRIX_BUFF, CL_TRUE);
+  void * mappedBuff = context_map(ctx, MATRIX_BUFF, CL_TRUE);
   if (!mappedBuff) {
-    context_free(ctx);
+    power_iter_free(res);
     return NULL;
   }
   memcpy(mappedBuff, rowMat->entries, matrixSize);
-  context_unmap(ctx, ROW_MATRIX_BUFF, mappedBuff);
+  context_unmap(ctx, MATRIX_BUFF, mappedBuff);
 
-  matrix_t * colMat = matrix_transpose(rowMat);
-  if (!colMat) {
-    context_free(ctx);
-    return NULL;
-  }
+  // The transposed product reads the same row-major matrix,
+  // so only one copy of it lives on the device.
+  res->rowGroup = pca_group_size(pca_group_limit(ctx, ROW_MULT_KERNEL), MAX_ROW_GROUP);
+  res->factorGroup = pca_group_size(pca_group_limit(ctx, FACTOR_KERNEL),
+    PCA_MAX_FACTOR_GROUP);
 
-  mappedBuff = context_map(ctx, COL_MATRIX_BUFF, CL_TRUE);
-  if (!mappedBuff) {
-    matrix_free(colMat);
-    context_free(ctx);
-    return NULL;
+  // Devices which can't fit COL_GROUP_WIDTH columns get
+  // narrower groups, and the lanes are bounded by the
+  // device's second dimension as well as the kernel.
+  size_t colLimit = context_work_group_size(ctx, COL_MULT_KERNEL);
+  res->colWidth = pca_group_size(pca_group_limit(ctx, COL_MULT_KERNEL), COL_GROUP_WIDTH);
+  size_t laneLimit = context_work_item_size(ctx, 1);
+  if (res->colWidth && colLimit / res->colWidth < laneLimit) {
+    laneLimit = colLimit / res->colWidth;
   }
-  memcpy(mappedBuff, colMat->entries, matrixSize);
-  matrix_free(colMat);
-  context_unmap(ctx, COL_MATRIX_BUFF, mappedBuff);
+  res->colLanes = pca_group_size(laneLimit, MAX_COL_LANES);
 
-  cl_int cols = rowMat->cols;
-  cl_int rows = rowMat->rows;
-  void * args[4] = {&ctx->buffers[ROW_MATRIX_BUFF], &cols, &ctx->buffers[COL_OUTPUT_BUFF],
-    &ctx->buffers[ROW_OUTPUT_BUFF]};
-  size_t argSizes[4] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem)};
-  if (context_set_params(ctx, ROW_MULT_KERNEL, 4, args, argSizes)) {
-    context_free(ctx);
+  size_t sumLimit = pca_group_limit(ctx, SQUARES_KERNEL);
+  size_t centerLimit = pca_group_limit(ctx, CENTER_DOT_KERNEL);
+  res->sumGroup = pca_group_size(centerLimit < sumLimit ? centerLimit : sumLimit,
+    PCA_MAX_SUM_GROUP);
+  const int blockKernels[6] = {BLOCK_ROW_MULT_KERNEL, BLOCK_COL_MULT_KERNEL, GRAM_KERNEL,
+    ORTHONORMALIZE_KERNEL, SNAPSHOT_KERNEL, SNAPSHOT_ROW_KERNEL};
+  res->tile = pca_tile_size(ctx, blockKernels, 6);
+  if (!res->rowGroup || !res->colWidth || !res->colLanes || !res->factorGroup ||
+      !res->sumGroup || !res->tile) {
+    power_iter_free(res);
     return NULL;
   }
-  args[0] = &ctx->buffers[COL_MATRIX_BUFF];
-  args[1] = &rows;
-  args[2] = &ctx->buffers[ROW_OUTPUT_BUFF];
-  args[3] = &ctx->buffers[COL_OUTPUT_BUFF];
-  if (context_set_params(ctx, COL_MULT_KERNEL, 4, args, argSizes)) {
-    context_free(ctx);
+  size_t groupWidth = k == 1 && !res->snapshot ? res->colWidth : res->tile;
+  res->residualGroups = (res->iterateSize + groupWidth - 1) / groupWidth;
+  size_t residualSize = res->residualGroups * k * sizeof(cl_float3);
+  if (residualSize > ctx->bufferSizes[RESIDUAL_PARTIAL_BUFF] &&
+      context_resize_buffer(ctx, RESIDUAL_PARTIAL_BUFF, residualSize)) {
+    power_iter_free(res);
     return NULL;
   }
 
-  power_iter_t * res = (power_iter_t *)malloc(sizeof(power_iter_t));
-  res->context = ctx;
-  res->vectorSize = rowMat->cols;
-  res->intermediateSize = rowMat->rows;
-  res->vector = (cl_float3 *)malloc(sizeof(cl_float3) * res->vectorSize);
-  if (!res->vector) {
-    free(res);
-    context_free(ctx);
+  if (set_kernel_params(res, rowMat) || (centering && find_column_stats(res)) ||
+      (res->snapshot && form_snapshot(res)) || randomize_vectors(res)) {
+    power_iter_free(res);
     return NULL;
   }
-  for (size_t i = 0; i < res->vectorSize; ++i) {
-    cl_float3 r;
-    r.s[0] = random_float();
-    r.s[1] = random_float();
-    r.s[2] = random_float();
-    res->vector[i] = r;
-  }
 
   return res;
 }
 
-int power_iter_run(power_iter_t * iter, int iterations) {
-  if (write_output_vector(iter)) {
+int power_iter_run(power_iter_t * iter, int maxIterations, cl_float tolerance) {
+  // The queue is in-order, so the kernels can be queued
+  // back to back without waiting on each other. Each
+  // iteration's statistics are read back while the next
+  // one runs, so checking them does not stall the device.
+  //
+  // The entry after the statistics counts the pivots
+  // which broke down in the Cholesky QR, and starts at
+  // zero for each run.
+  static const cl_float3 noBreakdowns;
+  size_t k = iter->componentCount;
+  size_t statsSize = k * 2 + 1;
+  cl_event pending[2] = {NULL, NULL};
+  int count = 0;
+  int converged = 0;
+  int failed = context_write_async(iter->context, STATS_BUFF, k * 2 * sizeof(cl_float3),
+    sizeof(cl_float3), &noBreakdowns, 0, NULL, NULL);
+  while (count < maxIterations && !converged && !failed) {
+    cl_float3 * stats = &iter->stats[(count % 2) * statsSize];
+    if (run_iteration(iter, stats, &pending[count % 2])) {
+      failed = 1;
+      break;
+    }
+    ++count;
+    if (count > 1) {
+      int prev = count % 2;
+      converged = wait_for_stats(iter, &pending[prev], &iter->stats[prev * statsSize],
+        tolerance);
+      failed = converged < 0;
+    }
+  }
+
+  // Report on the last iteration which finished. Its
+  // residuals may be a little over the tolerance again
+  // even when the one before it converged.
+  int last = (count + 1) % 2;
+  if (pending[last]) {
+    int lastConverged = wait_for_stats(iter, &pending[last], &iter->stats[last * statsSize],
+      tolerance);
+    failed = failed || lastConverged < 0;
+    converged = converged || lastConverged;
+  }
+  if (pending[count % 2]) {
+    clReleaseEvent(pending[count % 2]);
+  }
+  if (failed || (iter->snapshot && lift_vectors(iter)) || read_output_vector(iter)) {
     return -1;
   }
 
-  for (int i = 0; i < iterations; ++i) {
-    size_t outputSize = iter->intermediateSize;
-    if (context_run_nd(iter->context, ROW_MULT_KERNEL, 1, NULL, &outputSize)) {
+  iter->iterations += count;
+  iter->converged = converged;
+  return count;
+}
+
+void power_iter_free(power_iter_t * iter) {
+  if (iter->context) {
+    context_free(iter->context);
+  }
+  free(iter->vector);
+  free(iter->eigenvalues);
+  free(iter->residuals);
+  free(iter->stats);
+  free(iter);
+}
+
+static cl_float random_float() {
+  return ((cl_float)(rand() % 1025) / 1024.0)*2 - 1;
+}
+
+// The snapshot method iterates on a rows by rows matrix of
+// float3 instead of the uchar4 image matrix. It only pays
+// off when that matrix is much smaller, and it must fit in
+// a single buffer on the device.
+static int prefer_snapshot(session_t * session, matrix_t * rowMat) {
+  size_t snapshotSize = (size_t)rowMat->rows * rowMat->rows * sizeof(cl_float3);
+  size_t matrixSize = (size_t)rowMat->rows * rowMat->cols * sizeof(cl_uchar4);
+  device_attributes_t attrs;
+  if (device_get_attributes(session->device, &attrs)) {
+    return 0;
+  }
+  return snapshotSize * SNAPSHOT_SAVING <= matrixSize && snapshotSize <= attrs.maxAllocSize;
+}
+
+static int set_kernel_params(power_iter_t * iter, matrix_t * rowMat) {
+  context_t * ctx = iter->context;
+  cl_int rows = rowMat->rows;
+  cl_int cols = rowMat->cols;
+  cl_int k = iter->componentCount;
+  cl_int centered = iter->centering != PCA_CENTER_NONE;
+  cl_int standardize = iter->centering == PCA_CENTER_STANDARDIZE;
+  size_t tileSize = sizeof(cl_float3) * iter->tile * (iter->tile + 1);
+  void * mean = &ctx->buffers[MEAN_BUFF];
+  void * scale = &ctx->buffers[PIXEL_SCALE_BUFF];
+  void * center = &ctx->buffers[CENTER_BUFF];
+
+  void * statsArgs[6] = {&ctx->buffers[MATRIX_BUFF], &rows, &cols, &standardize, mean, scale};
+  size_t statsArgSizes[6] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int),
+    sizeof(cl_mem), sizeof(cl_mem)};
+  if (context_set_params(ctx, COLUMN_STATS_KERNEL, 6, statsArgs, statsArgSizes)) {
+    return -1;
+  }
+
+  // The transposed products need the sum of each input
+  // vector when centering, which sum_rows finds on the
+  // vectors which they are about to read.
+  cl_int square = 0;
+  cl_int offset = 0;
+  void * rowSumArgs[6] = {&ctx->buffers[iter->snapshot ? SNAPSHOT_VECTOR_BUFF : ROW_OUTPUT_BUFF],
+    &rows, &square, center, &offset, NULL};
+  size_t sumArgSizes[6] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_mem),
+    sizeof(cl_int), sizeof(cl_float3) * iter->sumGroup};
+  if (context_set_params(ctx, ROW_SUM_KERNEL, 6, rowSumArgs, sumArgSizes)) {
+    return -1;
+  }
+
+  if (iter->snapshot) {
+    // The snapshot is symmetric, so both of its products
+    // read it by columns. It is centered as it is formed.
+    // The transposed product of the image matrix only lifts
+    // the vectors at the end.
+    void * snapshotArgs[9] = {&ctx->buffers[MATRIX_BUFF], &rows, &cols,
+      &ctx->buffers[SNAPSHOT_BUFF], &centered, mean, scale, NULL, NULL};
+    size_t snapshotArgSizes[9] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int),
+      sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem), tileSize, tileSize};
+    if (context_set_params(ctx, SNAPSHOT_KERNEL, 9, snapshotArgs, snapshotArgSizes) ||
+        set_block_params(iter, SNAPSHOT_ROW_KERNEL, SNAPSHOT_BUFF, rows, rows,
+          SNAPSHOT_VECTOR_BUFF, ROW_OUTPUT_BUFF, 0, 0) ||
+        set_block_params(iter, SNAPSHOT_COL_KERNEL, SNAPSHOT_BUFF, rows, rows,
+          ROW_OUTPUT_BUFF, SNAPSHOT_VECTOR_BUFF, 0, 1) ||
+        set_block_params(iter, BLOCK_COL_MULT_KERNEL, MATRIX_BUFF, rows, cols,
+          SNAPSHOT_VECTOR_BUFF, VECTOR_BUFF, centered, 0)) {
       return -1;
     }
-    outputSize = iter->vectorSize;
-    if (context_run_nd(iter->context, COL_MULT_KERNEL, 1, NULL, &outputSize)) {
+  } else {
+    void * centerArgs[6] = {&ctx->buffers[VECTOR_BUFF], &cols, mean, scale, center, NULL};
+    size_t centerArgSizes[6] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem),
+      sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_float3) * iter->sumGroup};
+    if (context_set_params(ctx, CENTER_DOT_KERNEL, 6, centerArgs, centerArgSizes)) {
+      return -1;
+    }
+
+    void * args[9] = {&ctx->buffers[MATRIX_BUFF], &cols, &ctx->buffers[VECTOR_BUFF],
+      &ctx->buffers[ROW_OUTPUT_BUFF], &centered, mean, scale, center, NULL};
+    size_t argSizes[9] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem),
+      sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_mem),
+      sizeof(cl_float3) * iter->rowGroup};
+    if (context_set_params(ctx, ROW_MULT_KERNEL, 9, args, argSizes)) {
+      return -1;
+    }
+    void * colArgs[12] = {&ctx->buffers[MATRIX_BUFF], &rows, &cols,
+      &ctx->buffers[ROW_OUTPUT_BUFF], &ctx->buffers[VECTOR_BUFF], &centered, mean, scale,
+      center, &ctx->buffers[STATS_BUFF], &ctx->buffers[RESIDUAL_PARTIAL_BUFF], NULL};
+    size_t colArgSizes[12] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_mem),
+      sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_mem),
+      sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_float3) * iter->colWidth * iter->colLanes};
+    if (context_set_params(ctx, COL_MULT_KERNEL, 12, colArgs, colArgSizes)) {
+      return -1;
+    }
+
+    void * blockArgs[12] = {&ctx->buffers[MATRIX_BUFF], &rows, &cols, &k,
+      &ctx->buffers[VECTOR_BUFF], &ctx->buffers[ROW_OUTPUT_BUFF], &centered, mean, scale,
+      center, NULL, NULL};
+    size_t blockArgSizes[12] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int),
+      sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem),
+      sizeof(cl_mem), sizeof(cl_mem), tileSize, tileSize};
+    if (context_set_params(ctx, BLOCK_ROW_MULT_KERNEL, 12, blockArgs, blockArgSizes) ||
+        set_block_params(iter, BLOCK_COL_MULT_KERNEL, MATRIX_BUFF, rows, cols,
+          ROW_OUTPUT_BUFF, VECTOR_BUFF, centered, 1)) {
       return -1;
     }
   }
 
-  if (read_output_vector(iter)) {
+  // The eigenvalue estimates are the squared lengths of the
+  // first product's rows, and go in the first k entries of
+  // the statistics. The squared residuals follow them.
+  square = 1;
+  void * sumArgs[6] = {&ctx->buffers[ROW_OUTPUT_BUFF], &rows, &square,
+    &ctx->buffers[STATS_BUFF], &offset, NULL};
+  if (context_set_params(ctx, SQUARES_KERNEL, 6, sumArgs, sumArgSizes)) {
+    return -1;
+  }
+  cl_int residualGroups = iter->residualGroups;
+  square = 0;
+  offset = k;
+  sumArgs[0] = &ctx->buffers[RESIDUAL_PARTIAL_BUFF];
+  sumArgs[1] = &residualGroups;
+  if (context_set_params(ctx, RESIDUAL_KERNEL, 6, sumArgs, sumArgSizes)) {
     return -1;
   }
 
-  normalize_output(iter);
+  return set_orthonormalize_params(iter, iter->snapshot ? SNAPSHOT_VECTOR_BUFF : VECTOR_BUFF,
+    iter->iterateSize);
+}
 
-  return 0;
+// set_block_params sets up a product by the transpose of a
+// matrix, which is read by columns, one tile at a time.
+// With residuals, it also sums how far each vector moved
+// from its eigenvalue estimate times the old vector.
+static int set_block_params(power_iter_t * iter, int kernelIdx, int matrixBuff, cl_int rows,
+                            cl_int cols, int inputBuff, int outputBuff, cl_int centered,
+                            cl_int withResiduals) {
+  context_t * ctx = iter->context;
+  cl_int k = iter->componentCount;
+  size_t tileSize = sizeof(cl_float3) * iter->tile * (iter->tile + 1);
+  void * args[15] = {&ctx->buffers[matrixBuff], &rows, &cols, &k, &ctx->buffers[inputBuff],
+    &ctx->buffers[outputBuff], &centered, &ctx->buffers[MEAN_BUFF],
+    &ctx->buffers[PIXEL_SCALE_BUFF], &ctx->buffers[CENTER_BUFF], &withResiduals,
+    &ctx->buffers[STATS_BUFF], &ctx->buffers[RESIDUAL_PARTIAL_BUFF], NULL, NULL};
+  size_t argSizes[15] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int),
+    sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem),
+    sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem), tileSize, tileSize};
+  return context_set_params(ctx, kernelIdx, 15, args, argSizes);
 }
 
-void power_iter_free(power_iter_t * iter) {
-  context_free(iter->context);
-  free(iter->vector);
-  free(iter);
+// set_orthonormalize_params points the Cholesky QR kernels
+// at k vectors of the given length.
+static int set_orthonormalize_params(power_iter_t * iter, int vectorBuff, size_t length) {
+  context_t * ctx = iter->context;
+  cl_int k = iter->componentCount;
+  cl_int vectorLength = length;
+  size_t tileSize = sizeof(cl_float3) * iter->tile * (iter->tile + 1);
+  iter->gramChunkLength = pca_gram_chunk_length(k, length);
+  iter->gramChunks = (length + iter->gramChunkLength - 1) / iter->gramChunkLength;
+  cl_int chunkLength = iter->gramChunkLength;
+  cl_int chunks = iter->gramChunks;
+
+  void * gramArgs[7] = {&ctx->buffers[vectorBuff], &vectorLength, &k, &chunkLength,
+    &ctx->buffers[GRAM_PARTIAL_BUFF], NULL, NULL};
+  size_t gramArgSizes[7] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int),
+    sizeof(cl_mem), tileSize, tileSize};
+  if (context_set_params(ctx, GRAM_KERNEL, 7, gramArgs, gramArgSizes)) {
+    return -1;
+  }
+
+  // Only the first pass of the Cholesky QR is shifted.
+  // Its breakdowns are counted after the statistics.
+  cl_float shift = 0;
+  cl_float firstShift = pca_cholqr_shift(k);
+  cl_int statusOffset = k * 2;
+  void * factorArgs[9] = {&ctx->buffers[GRAM_PARTIAL_BUFF], &chunks, &k,
+    &ctx->buffers[GRAM_BUFF], &ctx->buffers[FACTOR_BUFF], &ctx->buffers[SCALE_BUFF], &shift,
+    &ctx->buffers[STATS_BUFF], &statusOffset};
+  size_t factorArgSizes[9] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_mem),
+    sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_float), sizeof(cl_mem), sizeof(cl_int)};
+  if (context_set_params(ctx, FACTOR_KERNEL, 9, factorArgs, factorArgSizes)) {
+    return -1;
+  }
+  factorArgs[6] = &firstShift;
+  if (context_set_params(ctx, SHIFTED_FACTOR_KERNEL, 9, factorArgs, factorArgSizes)) {
+    return -1;
+  }
+
+  void * orthoArgs[6] = {&ctx->buffers[vectorBuff], &vectorLength, &k,
+    &ctx->buffers[FACTOR_BUFF], NULL, NULL};
+  size_t orthoArgSizes[6] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_mem),
+    tileSize, tileSize};
+  return context_set_params(ctx, ORTHONORMALIZE_KERNEL, 6, orthoArgs, orthoArgSizes);
 }
 
-static cl_float random_float() {
-  return ((cl_float)(rand() % 1025) / 1024.0)*2 - 1;
+// find_column_stats finds the mean image and, when
+// standardizing, the scale of each pixel, in one pass over
+// the matrix.
+static int find_column_stats(power_iter_t * iter) {
+  size_t size = iter->vectorSize;
+  return context_run_nd_async(iter->context, COLUMN_STATS_KERNEL, 1, NULL, &size, NULL,
+    0, NULL, NULL);
 }
 
-static int write_output_vector(power_iter_t * iter) {
-  cl_float3 * mappedInput = (cl_float3 *)context_map(iter->context, COL_OUTPUT_BUFF, CL_TRUE);
-  if (!mappedInput) {
+// form_snapshot computes rowMat*rowMat' once. Only the
+// tiles on and above the diagonal are summed, and each is
+// written to both halves.
+static int form_snapshot(power_iter_t * iter) {
+  size_t tile = iter->tile;
+  size_t tileLocal[2] = {tile, tile};
+  size_t sizes[2] = {pca_round_up(iter->intermediateSize, tile),
+    pca_round_up(iter->intermediateSize, tile)};
+  return context_run_nd_async(iter->context, SNAPSHOT_KERNEL, 2, NULL, sizes, tileLocal,
+    0, NULL, NULL);
+}
+
+// randomize_vectors fills the vectors which are iterated
+// on with random starting values.
+static int randomize_vectors(power_iter_t * iter) {
+  context_t * ctx = iter->context;
+  int buff = iter->snapshot ? SNAPSHOT_VECTOR_BUFF : VECTOR_BUFF;
+  cl_float3 * vectors = (cl_float3 *)context_map(ctx, buff, CL_TRUE);
+  if (!vectors) {
     return -1;
   }
-  memcpy(mappedInput, iter->vector, iter->context->bufferSizes[COL_OUTPUT_BUFF]);
-  context_unmap(iter->context, COL_OUTPUT_BUFF, mappedInput);
-  return 0;
+  for (size_t i = 0; i < iter->iterateSize * iter->componentCount; ++i) {
+    cl_float3 r;
+    r.s[0] = random_float();
+    r.s[1] = random_float();
+    r.s[2] = random_float();
+    vectors[i] = r;
+  }
+  context_unmap(ctx, buff, vectors);
+  return context_finish(ctx);
 }
 
-static int read_output_vector(power_iter_t * iter) {
-  cl_float3 * mappedInput = (cl_float3 *)context_map(iter->context, COL_OUTPUT_BUFF, CL_FALSE);
-  if (!mappedInput) {
+// run_iteration applies rowMat'*rowMat to every vector and
+// then orthonormalizes them with a Cholesky QR: the vectors
+// V are replaced by V*R^-1, where R'R = V'V. The columns
+// of V are scaled to unit length first, which keeps the
+// factorization stable as the vectors converge, and the
+// QR is repeated PCA_CHOLQR_PASSES times.
+//
+// Along the way, it sums the eigenvalue estimate and the
+// squared residual of each vector, and starts reading them
+// into stats.
+//
+// The snapshot method applies (rowMat*rowMat')^2 instead,
+// which has the same eigenvectors and squared eigenvalues.
+static int run_iteration(power_iter_t * iter, cl_float3 * stats, cl_event * statsEvent) {
+  context_t * ctx = iter->context;
+  size_t k = iter->componentCount;
+  size_t tile = iter->tile;
+  size_t tileLocal[3] = {tile, tile, 1};
+
+  if (iter->snapshot) {
+    size_t sizes[2] = {pca_round_up(iter->iterateSize, tile), pca_round_up(k, tile)};
+    if (context_run_nd_async(ctx, SNAPSHOT_ROW_KERNEL, 2, NULL, sizes, tileLocal,
+        0, NULL, NULL)) {
+      return -1;
+    }
+    size_t sumSize = iter->sumGroup * k;
+    if (context_run_nd_async(ctx, SQUARES_KERNEL, 1, NULL, &sumSize, &iter->sumGroup,
+        0, NULL, NULL)) {
+      return -1;
+    }
+    if (context_run_nd_async(ctx, SNAPSHOT_COL_KERNEL, 2, NULL, sizes, tileLocal,
+        0, NULL, NULL)) {
+      return -1;
+    }
+  } else if (k == 1) {
+    size_t rowSize = iter->intermediateSize * iter->rowGroup;
+    if (run_center_sums(iter, CENTER_DOT_KERNEL) ||
+        context_run_nd_async(ctx, ROW_MULT_KERNEL, 1, NULL, &rowSize, &iter->rowGroup,
+        0, NULL, NULL)) {
+      return -1;
+    }
+    size_t sumSize = iter->sumGroup;
+    if (context_run_nd_async(ctx, SQUARES_KERNEL, 1, NULL, &sumSize, &iter->sumGroup,
+        0, NULL, NULL) || run_center_sums(iter, ROW_SUM_KERNEL)) {
+      return -1;
+    }
+    // With a single lane the launch is 1-D, which every
+    // device supports whatever its second dimension.
+    size_t colSizes[2] = {pca_round_up(iter->vectorSize, iter->colWidth), iter->colLanes};
+    size_t colLocal[2] = {iter->colWidth, iter->colLanes};
+    if (context_run_nd_async(ctx, COL_MULT_KERNEL, iter->colLanes > 1 ? 2 : 1, NULL,
+        colSizes, colLocal, 0, NULL, NULL)) {
+      return -1;
+    }
+  } else {
+    size_t rowSizes[2] = {pca_round_up(iter->intermediateSize, tile), pca_round_up(k, tile)};
+    if (run_center_sums(iter, CENTER_DOT_KERNEL) ||
+        context_run_nd_async(ctx, BLOCK_ROW_MULT_KERNEL, 2, NULL, rowSizes, tileLocal,
+        0, NULL, NULL)) {
+      return -1;
+    }
+    size_t sumSize = iter->sumGroup * k;
+    if (context_run_nd_async(ctx, SQUARES_KERNEL, 1, NULL, &sumSize, &iter->sumGroup,
+        0, NULL, NULL) || run_center_sums(iter, ROW_SUM_KERNEL)) {
+      return -1;
+    }
+    size_t colSizes[2] = {pca_round_up(iter->vectorSize, tile), pca_round_up(k, tile)};
+    if (context_run_nd_async(ctx, BLOCK_COL_MULT_KERNEL, 2, NULL, colSizes, tileLocal,
+        0, NULL, NULL)) {
+      return -1;
+    }
+  }
+
+  size_t sumSize = iter->sumGroup * k;
+  if (context_run_nd_async(ctx, RESIDUAL_KERNEL, 1, NULL, &sumSize, &iter->sumGroup,
+      0, NULL, NULL)) {
     return -1;
   }
-  for (size_t i = 0; i < iter->vectorSize; ++i) {
-    iter->vector[i] = mappedInput[i];
+
+  if (run_orthonormalize(iter, iter->iterateSize)) {
+    return -1;
   }
-  context_unmap(iter->context, COL_OUTPUT_BUFF, mappedInput);
-  return 0;
+  return context_read_async(ctx, STATS_BUFF, 0, ctx->bufferSizes[STATS_BUFF], stats,
+    0, NULL, statsEvent);
 }
 
-static void normalize_output(power_iter_t * iter) {
-  for (size_t i = 0; i < 3; ++i) {
-    cl_float mag = 0;
-    for (size_t j = 0; j < iter->vectorSize; ++j) {
-      cl_float val = iter->vector[j].s[i];
-      mag += val * val;
+// run_center_sums finds the per-component sums which the
+// next product needs to act on the centered matrix: the
+// dot product of each vector with the scaled mean before
+// a product by rowMat, or the sum of each vector before a
+// product by its transpose. It does nothing uncentered.
+static int run_center_sums(power_iter_t * iter, int kernelIdx) {
+  if (!iter->centering) {
+    return 0;
+  }
+  size_t sumSize = iter->sumGroup * iter->componentCount;
+  return context_run_nd_async(iter->context, kernelIdx, 1, NULL, &sumSize, &iter->sumGroup,
+    0, NULL, NULL);
+}
+
+// run_orthonormalize runs the Cholesky QR passes on the
+// vectors which the kernels were last pointed at.
+static int run_orthonormalize(power_iter_t * iter, size_t length) {
+  context_t * ctx = iter->context;
+  size_t k = iter->componentCount;
+  size_t tile = iter->tile;
+  size_t tileLocal[3] = {tile, tile, 1};
+  size_t gramSizes[3] = {pca_round_up(k, tile), pca_round_up(k, tile), iter->gramChunks};
+  size_t orthoSizes[2] = {pca_round_up(length, tile), tile};
+  for (int pass = 0; pass < PCA_CHOLQR_PASSES; ++pass) {
+    int factorKernel = pass ? FACTOR_KERNEL : SHIFTED_FACTOR_KERNEL;
+    if (context_run_nd_async(ctx, GRAM_KERNEL, 3, NULL, gramSizes, tileLocal, 0, NULL,
+        NULL) ||
+        context_run_nd_async(ctx, factorKernel, 1, NULL, &iter->factorGroup,
+        &iter->factorGroup, 0, NULL, NULL) ||
+        context_run_nd_async(ctx, ORTHONORMALIZE_KERNEL, 2, NULL, orthoSizes, tileLocal,
+        0, NULL, NULL)) {
+      return -1;
     }
-    cl_float recip = 1.0f / sqrtf(mag);
-    for (size_t j = 0; j < iter->vectorSize; ++j) {
-      iter->vector[j].s[i] *= recip;
+  }
+  return 0;
+}
+
+// lift_vectors maps the eigenvectors v of the snapshot to
+// those of rowMat'*rowMat, which are rowMat'*v scaled to
+// unit length. They are orthonormalized again to take out
+// the rounding error.
+static int lift_vectors(power_iter_t * iter) {
+  size_t k = iter->componentCount;
+  size_t tile = iter->tile;
+  size_t tileLocal[2] = {tile, tile};
+  size_t sizes[2] = {pca_round_up(iter->vectorSize, tile), pca_round_up(k, tile)};
+  if (run_center_sums(iter, ROW_SUM_KERNEL) ||
+      context_run_nd_async(iter->context, BLOCK_COL_MULT_KERNEL, 2, NULL, sizes, tileLocal,
+      0, NULL, NULL) ||
+      set_orthonormalize_params(iter, VECTOR_BUFF, iter->vectorSize) ||
+      run_orthonormalize(iter, iter->vectorSize)) {
+    return -1;
+  }
+  return set_orthonormalize_params(iter, SNAPSHOT_VECTOR_BUFF, iter->iterateSize);
+}
+
+// wait_for_stats waits for an iteration's statistics and
+// records its eigenvalues and relative residuals. It
+// returns 1 if every residual is within tolerance, 0 if
+// not and -1 on error, or if the vectors have lost rank.
+static int wait_for_stats(power_iter_t * iter, cl_event * event, cl_float3 * stats,
+                          cl_float tolerance) {
+  cl_int status = clWaitForEvents(1, event);
+  clReleaseEvent(*event);
+  (*event) = NULL;
+  size_t k = iter->componentCount;
+  if (status || lost_rank(stats[k * 2])) {
+    return -1;
+  }
+
+  int converged = 1;
+  for (size_t i = 0; i < k; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      cl_float value = fabsf(stats[i].s[j]);
+      cl_float residual = value > 0 ? sqrtf(stats[k + i].s[j]) / value : INFINITY;
+      iter->eigenvalues[i].s[j] = iter->snapshot ? sqrtf(value) : stats[i].s[j];
+      iter->residuals[i].s[j] = residual;
+      if (!(residual <= tolerance)) {
+        converged = 0;
+      }
     }
   }
+  return converged;
+}
+
+// read_output_vector reads the vectors back, and fails if
+// they lost rank while being lifted.
+static int read_output_vector(power_iter_t * iter) {
+  size_t size = iter->context->bufferSizes[VECTOR_BUFF];
+  cl_float3 breakdowns;
+  if (context_read_async(iter->context, VECTOR_BUFF, 0, size, iter->vector,
+      0, NULL, NULL) ||
+      context_read_async(iter->context, STATS_BUFF, iter->componentCount * 2 *
+      sizeof(cl_float3), sizeof(cl_float3), &breakdowns, 0, NULL, NULL) ||
+      context_finish(iter->context)) {
+    return -1;
+  }
+  return lost_rank(breakdowns) ? -1 : 0;
+}
+
+// lost_rank says whether a Cholesky QR pivot broke down in
+// any channel.
+static int lost_rank(cl_float3 breakdowns) {
+  return breakdowns.s[0] > 0 || breakdowns.s[1] > 0 || breakdowns.s[2] > 0;
 }
@@ -3,18 +3,95 @@
 
 #include "matrix.h"
 #include "context.h"
+#include "pca_kernels.h"
 
+typedef enum {
+  // POWER_ITER_AUTO picks the snapshot method when the
+  // rows by rows matrix is much smaller than rowMat and
+  // fits in one device buffer, and the direct one
+  // otherwise.
+  POWER_ITER_AUTO = 0,
+  // POWER_ITER_DIRECT applies rowMat' and then rowMat to
+  // the vectors, passing over the whole matrix twice per
+  // iteration.
+  POWER_ITER_DIRECT,
+  // POWER_ITER_SNAPSHOT forms the rows by rows matrix
+  // rowMat*rowMat' once, iterates on that, and lifts the
+  // results back with rowMat' at the end.
+  POWER_ITER_SNAPSHOT
+} power_iter_method_t;
+
+// power_iter_t finds the leading eigenvectors of
+// rowMat'*rowMat by subspace iteration, one per channel.
 typedef struct {
   context_t * context;
+  int componentCount;
+  int snapshot;
+  pca_centering_t centering;
+  size_t rowGroup;
+  size_t colWidth;
+  size_t colLanes;
+  size_t tile;
+  size_t factorGroup;
+  size_t sumGroup;
+  size_t residualGroups;
+  size_t gramChunks;
+  size_t gramChunkLength;
+
+  // vector holds componentCount vectors of vectorSize
+  // entries, one after another, in order of eigenvalue.
+  // It is only updated by power_iter_run.
   cl_float3 * vector;
   size_t vectorSize;
   size_t intermediateSize;
+
+  // iterateSize is the length of the vectors which are
+  // iterated on, which is intermediateSize for the snapshot
+  // method and vectorSize otherwise.
+  size_t iterateSize;
+
+  // eigenvalues and residuals hold the estimates from the
+  // last iteration run, per component and channel. Each
+  // residual is |A'Av - lambda*v| / |lambda| for the vector
+  // v going into the iteration. The snapshot method's
+  // residuals are those of (rowMat*rowMat')^2, whose
+  // eigenvalues are the squares of these.
+  cl_float3 * eigenvalues;
+  cl_float3 * residuals;
+  int iterations;
+  int converged;
+
+  // stats holds two iterations' worth of eigenvalues,
+  // squared residuals and Cholesky QR breakdowns as read
+  // from the device.
+  cl_float3 * stats;
 } power_iter_t;
 
 // power_iter_new creates a new power iterator
-// which applies rowMat'*rowMat to a vector.
-power_iter_t * power_iter_new(matrix_t * rowMat);
-int power_iter_run(power_iter_t * iter, int iterations);
+// which applies rowMat'*rowMat to componentCount vectors
+// at once. Only rowMat itself is copied to the device;
+// rowMat' is applied by reading it by columns. The method
+// is picked automatically.
+power_iter_t * power_iter_new(matrix_t * rowMat, int componentCount);
+
+// power_iter_new_in is like power_iter_new, but runs on an
+// existing session which must outlive the iterator, with
+// the given method. The centering is applied to rowMat's
+// columns on the fly; rowMat is not changed.
+power_iter_t * power_iter_new_in(session_t * session, matrix_t * rowMat, int componentCount,
+                                 power_iter_method_t method, pca_centering_t centering);
+
+// power_iter_run runs iterations until every residual is
+// at most tolerance, or until maxIterations have run. Each
+// iteration is one pass over the matrix in each direction
+// for all the vectors, and orthonormalizes the vectors on
+// the device. The vectors are then read back.
+//
+// The check lags one iteration behind, so one more runs
+// than is needed. It returns the number of iterations run,
+// or -1 on error or if the vectors lose rank, which leaves
+// them unusable.
+int power_iter_run(power_iter_t * iter, int maxIterations, cl_float tolerance);
 void power_iter_free(power_iter_t * iter);
 
 #endif
@@ -0,0 +1,545 @@
+#include "randomized_svd.h"
+#include "pca_kernels.h"
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+
+#define MATRIX_BUFF 0
+#define SAMPLE_ROWS_BUFF 1
+#define SAMPLE_BUFF 2
+#define GRAM_PARTIAL_BUFF 3
+#define GRAM_BUFF 4
+#define FACTOR_BUFF 5
+#define SCALE_BUFF 6
+#define VECTOR_BUFF 7
+#define MEAN_BUFF 8
+#define PIXEL_SCALE_BUFF 9
+#define CENTER_BUFF 10
+#define STATUS_BUFF 11
+
+#define ROW_MULT_KERNEL 0
+#define COL_MULT_KERNEL 1
+#define GRAM_KERNEL 2
+#define FACTOR_KERNEL 3
+#define ORTHONORMALIZE_KERNEL 4
+#define COMBINE_KERNEL 5
+#define COLUMN_STATS_KERNEL 6
+#define CENTER_DOT_KERNEL 7
+#define ROW_SUM_KERNEL 8
+#define SHIFTED_FACTOR_KERNEL 9
+
+// The small eigenproblem is solved by Jacobi sweeps until
+// the off-diagonal part is this small relative to the
+// whole, or MAX_SWEEPS have run.
+#define JACOBI_TOLERANCE 1e-24
+#define MAX_SWEEPS 64
+
+static cl_float random_float();
+static int set_kernel_params(randomized_svd_t * svd, matrix_t * rowMat);
+static int randomize_samples(randomized_svd_t * svd);
+static int run_apply(randomized_svd_t * svd, int kernelIdx, size_t length);
+static int run_center_sums(randomized_svd_t * svd, int kernelIdx);
+static int run_gram(randomized_svd_t * svd, int vectorBuff, size_t length, cl_int count);
+static int run_orthonormalize(randomized_svd_t * svd, int vectorBuff, size_t length,
+                              cl_int count);
+static int solve_subspace(randomized_svd_t * svd);
+static int solve_channels(randomized_svd_t * svd, cl_float3 * partial, cl_float3 * factor);
+static void jacobi_eigen(double * a, double * v, int n);
+
+randomized_svd_t * randomized_svd_new(matrix_t * rowMat, int componentCount, int oversampling) {
+  return randomized_svd_new_in(NULL, rowMat, componentCount, oversampling, PCA_CENTER_NONE);
+}
+
+randomized_svd_t * randomized_svd_new_in(session_t * session, matrix_t * rowMat,
+                                         int componentCount, int oversampling,
+                                         pca_centering_t centering) {
+  randomized_svd_t * res = (randomized_svd_t *)malloc(sizeof(randomized_svd_t));
+  if (!res) {
+    return NULL;
+  }
+  bzero(res, sizeof(randomized_svd_t));
+  res->componentCount = componentCount;
+  res->centering = centering;
+  res->vectorSize = rowMat->cols;
+  res->intermediateSize = rowMat->rows;
+
+  // The subspace can be no larger than the matrix's rank,
+  // which can be no larger than either side. Centering
+  // takes one more off the rows' side.
+  size_t rank = res->intermediateSize - (centering && res->intermediateSize > 1);
+  size_t l = componentCount + oversampling;
+  l = l > rank ? rank : l;
+  l = l > res->vectorSize ? res->vectorSize : l;
+  l = l < (size_t)componentCount ? componentCount : l;
+  res->sampleCount = l;
+
+  size_t k = componentCount;
+  res->vector = (cl_float3 *)malloc(sizeof(cl_float3) * res->vectorSize * k);
+  res->eigenvalues = (cl_float3 *)calloc(k, sizeof(cl_float3));
+  if (!res->vector || !res->eigenvalues) {
+    randomized_svd_free(res);
+    return NULL;
+  }
+
+  const char * kernelNames[10] = {"block_apply", "block_apply_transpose", "gram", "factor",
+    "orthonormalize", "combine", "column_stats", "center_dot", "sum_rows", "factor"};
+  size_t matrixSize = (size_t)rowMat->cols * rowMat->rows * sizeof(cl_uchar4);
+  size_t columnStatSize = (centering ? rowMat->cols : 1) * sizeof(cl_float3);
+  size_t bufferSizes[12] = {matrixSize, res->intermediateSize * l * sizeof(cl_float3),
+    res->vectorSize * l * sizeof(cl_float3), 0, l * l * sizeof(cl_float3),
+    l * l * sizeof(cl_float3), l * sizeof(cl_float3), res->vectorSize * k * sizeof(cl_float3),
+    columnStatSize, columnStatSize, l * sizeof(cl_float3), sizeof(cl_float3)};
+
+  // Samples of both lengths are orthonormalized, and so are
+  // the results, so the partial sums of the Gram matrix fit
+  // any of them.
+  size_t partialSize = 0;
+  size_t lengths[3] = {res->intermediateSize, res->vectorSize, res->vectorSize};
+  size_t counts[3] = {l, l, k};
+  for (int i = 0; i < 3; ++i) {
+    size_t chunkLength = pca_gram_chunk_length(counts[i], lengths[i]);
+    size_t size = (lengths[i] + chunkLength - 1) / chunkLength * counts[i] * counts[i];
+    partialSize = size > partialSize ? size : partialSize;
+  }
+  bufferSizes[GRAM_PARTIAL_BUFF] = partialSize * sizeof(cl_float3);
+
+  context_params_t params;
+  params.program = pcaProgram;
+  params.kernelCount = 10;
+  params.kernelNames = kernelNames;
+  params.bufferCount = 12;
+  params.bufferSizes = bufferSizes;
+  params.hostPointers = NULL;
+  context_t * ctx = session ? context_create_in(session, &params) : context_create(&params);
+  if (!ctx) {
+    randomized_svd_free(res);
+    return NULL;
+  }
+  res->context = ctx;
+
+  void * mappedBuff = context_map(ctx, MATRIX_BUFF, CL_TRUE);
+  if (!mappedBuff) {
+    randomized_svd_free(res);
+    return NULL;
+  }
+  memcpy(mappedBuff, rowMat->entries, matrixSize);
+  context_unmap(ctx, MATRIX_BUFF, mappedBuff);
+
+  const int blockKernels[5] = {ROW_MULT_KERNEL, COL_MULT_KERNEL, GRAM_KERNEL,
+    ORTHONORMALIZE_KERNEL, COMBINE_KERNEL};
+  res->tile = pca_tile_size(ctx, blockKernels, 5);
+  res->factorGroup = pca_group_size(pca_group_limit(ctx, FACTOR_KERNEL),
+    PCA_MAX_FACTOR_GROUP);
+  size_t sumLimit = pca_group_limit(ctx, ROW_SUM_KERNEL);
+  size_t centerLimit = pca_group_limit(ctx, CENTER_DOT_KERNEL);
+  res->sumGroup = pca_group_size(centerLimit < sumLimit ? centerLimit : sumLimit,
+    PCA_MAX_SUM_GROUP);
+  if (!res->tile || !res->factorGroup || !res->sumGroup || set_kernel_params(res, rowMat)) {
+    randomized_svd_free(res);
+    return NULL;
+  }
+
+  // The mean and scale of each pixel are found once, in
+  // one pass over the matrix.
+  size_t statsSize = res->vectorSize;
+  if (centering && context_run_nd_async(ctx, COLUMN_STATS_KERNEL, 1, NULL, &statsSize, NULL,
+      0, NULL, NULL)) {
+    randomized_svd_free(res);
+    return NULL;
+  }
+
+  return res;
+}
+
+int randomized_svd_run(randomized_svd_t * svd, int powerPasses) {
+  // The samples start as random combinations of the rows,
+  // Z = rowMat'*Y. Each power pass replaces them with
+  // rowMat'*rowMat*Z, which tilts them towards the leading
+  // eigenvectors, and both sides are orthonormalized along
+  // the way so that the small directions are not lost.
+  //
+  // The status counts the pivots which broke down in the
+  // Cholesky QRs, and starts at zero for each run.
+  static const cl_float3 noBreakdowns;
+  size_t rows = svd->intermediateSize;
+  size_t cols = svd->vectorSize;
+  cl_int l = svd->sampleCount;
+  if (context_write_async(svd->context, STATUS_BUFF, 0, sizeof(cl_float3), &noBreakdowns,
+      0, NULL, NULL) ||
+      randomize_samples(svd) ||
+      run_center_sums(svd, ROW_SUM_KERNEL) ||
+      run_apply(svd, COL_MULT_KERNEL, cols) ||
+      run_orthonormalize(svd, SAMPLE_BUFF, cols, l)) {
+    return -1;
+  }
+  for (int i = 0; i < powerPasses; ++i) {
+    if (run_center_sums(svd, CENTER_DOT_KERNEL) ||
+        run_apply(svd, ROW_MULT_KERNEL, rows) ||
+        run_orthonormalize(svd, SAMPLE_ROWS_BUFF, rows, l) ||
+        run_center_sums(svd, ROW_SUM_KERNEL) ||
+        run_apply(svd, COL_MULT_KERNEL, cols) ||
+        run_orthonormalize(svd, SAMPLE_BUFF, cols, l)) {
+      return -1;
+    }
+  }
+
+  // The last pass projects rowMat'*rowMat onto the samples,
+  // Z'*rowMat'*rowMat*Z = Y'*Y, for the small eigenproblem.
+  if (run_center_sums(svd, CENTER_DOT_KERNEL) ||
+      run_apply(svd, ROW_MULT_KERNEL, rows) || solve_subspace(svd)) {
+    return -1;
+  }
+
+  // The combinations are orthonormal up to rounding, which
+  // one more Cholesky QR takes out.
+  size_t k = svd->componentCount;
+  size_t tile = svd->tile;
+  size_t tileLocal[2] = {tile, tile};
+  size_t sizes[2] = {pca_round_up(cols, tile), pca_round_up(k, tile)};
+  if (context_run_nd_async(svd->context, COMBINE_KERNEL, 2, NULL, sizes, tileLocal,
+      0, NULL, NULL) ||
+      run_orthonormalize(svd, VECTOR_BUFF, cols, k)) {
+    return -1;
+  }
+  size_t size = svd->context->bufferSizes[VECTOR_BUFF];
+  cl_float3 breakdowns;
+  if (context_read_async(svd->context, VECTOR_BUFF, 0, size, svd->vector, 0, NULL, NULL) ||
+      context_read_async(svd->context, STATUS_BUFF, 0, sizeof(cl_float3), &breakdowns,
+      0, NULL, NULL) ||
+      context_finish(svd->context)) {
+    return -1;
+  }
+  return breakdowns.s[0] > 0 || breakdowns.s[1] > 0 || breakdowns.s[2] > 0 ? -1 : 0;
+}
+
+void randomized_svd_free(randomized_svd_t * svd) {
+  if (svd->context) {
+    context_free(svd->context);
+  }
+  free(svd->vector);
+  free(svd->eigenvalues);
+  free(svd);
+}
+
+static cl_float random_float() {
+  return ((cl_float)(rand() % 1025) / 1024.0)*2 - 1;
+}
+
+static int set_kernel_params(randomized_svd_t * svd, matrix_t * rowMat) {
+  context_t * ctx = svd->context;
+  cl_int rows = rowMat->rows;
+  cl_int cols = rowMat->cols;
+  cl_int l = svd->sampleCount;
+  cl_int k = svd->componentCount;
+  cl_int withResiduals = 0;
+  cl_int centered = svd->centering != PCA_CENTER_NONE;
+  cl_int standardize = svd->centering == PCA_CENTER_STANDARDIZE;
+  size_t tileSize = sizeof(cl_float3) * svd->tile * (svd->tile + 1);
+  void * mean = &ctx->buffers[MEAN_BUFF];
+  void * scale = &ctx->buffers[PIXEL_SCALE_BUFF];
+  void * center = &ctx->buffers[CENTER_BUFF];
+
+  void * statsArgs[6] = {&ctx->buffers[MATRIX_BUFF], &rows, &cols, &standardize, mean, scale};
+  size_t statsArgSizes[6] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int),
+    sizeof(cl_mem), sizeof(cl_mem)};
+  if (context_set_params(ctx, COLUMN_STATS_KERNEL, 6, statsArgs, statsArgSizes)) {
+    return -1;
+  }
+
+  // The centering sums are over the samples each product
+  // is about to read: their dot products with the scaled
+  // mean before a product by rowMat, and their plain sums
+  // before a product by rowMat'.
+  cl_int square = 0;
+  cl_int offset = 0;
+  void * centerArgs[6] = {&ctx->buffers[SAMPLE_BUFF], &cols, mean, scale, center, NULL};
+  size_t centerArgSizes[6] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem),
+    sizeof(cl_mem), sizeof(cl_float3) * svd->sumGroup};
+  void * sumArgs[6] = {&ctx->buffers[SAMPLE_ROWS_BUFF], &rows, &square, center, &offset, NULL};
+  size_t sumArgSizes[6] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_mem),
+    sizeof(cl_int), sizeof(cl_float3) * svd->sumGroup};
+  if (context_set_params(ctx, CENTER_DOT_KERNEL, 6, centerArgs, centerArgSizes) ||
+      context_set_params(ctx, ROW_SUM_KERNEL, 6, sumArgs, sumArgSizes)) {
+    return -1;
+  }
+
+  void * rowArgs[12] = {&ctx->buffers[MATRIX_BUFF], &rows, &cols, &l,
+    &ctx->buffers[SAMPLE_BUFF], &ctx->buffers[SAMPLE_ROWS_BUFF], &centered, mean, scale,
+    center, NULL, NULL};
+  size_t rowArgSizes[12] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int),
+    sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem),
+    sizeof(cl_mem), tileSize, tileSize};
+  if (context_set_params(ctx, ROW_MULT_KERNEL, 12, rowArgs, rowArgSizes)) {
+    return -1;
+  }
+
+  // No residuals are taken, so the statistics buffers are
+  // never touched.
+  void * colArgs[15] = {&ctx->buffers[MATRIX_BUFF], &rows, &cols, &l,
+    &ctx->buffers[SAMPLE_ROWS_BUFF], &ctx->buffers[SAMPLE_BUFF], &centered, mean, scale,
+    center, &withResiduals, &ctx->buffers[SCALE_BUFF], &ctx->buffers[SCALE_BUFF], NULL, NULL};
+  size_t colArgSizes[15] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int),
+    sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem),
+    sizeof(cl_mem), sizeof(cl_int), sizeof(cl_mem), sizeof(cl_mem), tileSize, tileSize};
+  if (context_set_params(ctx, COL_MULT_KERNEL, 15, colArgs, colArgSizes)) {
+    return -1;
+  }
+
+  // The eigenvectors of the subspace, as combinations of
+  // the samples, go in the factor buffer.
+  void * combineArgs[8] = {&ctx->buffers[SAMPLE_BUFF], &cols, &l, &ctx->buffers[FACTOR_BUFF],
+    &k, &ctx->buffers[VECTOR_BUFF], NULL, NULL};
+  size_t combineArgSizes[8] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_mem),
+    sizeof(cl_int), sizeof(cl_mem), tileSize, tileSize};
+  return context_set_params(ctx, COMBINE_KERNEL, 8, combineArgs, combineArgSizes);
+}
+
+// randomize_samples fills the samples on the row side,
+// which are the shorter ones.
+static int randomize_samples(randomized_svd_t * svd) {
+  context_t * ctx = svd->context;
+  cl_float3 * samples = (cl_float3 *)context_map(ctx, SAMPLE_ROWS_BUFF, CL_TRUE);
+  if (!samples) {
+    return -1;
+  }
+  for (size_t i = 0; i < svd->intermediateSize * svd->sampleCount; ++i) {
+    cl_float3 r;
+    r.s[0] = random_float();
+    r.s[1] = random_float();
+    r.s[2] = random_float();
+    samples[i] = r;
+  }
+  context_unmap(ctx, SAMPLE_ROWS_BUFF, samples);
+  return 0;
+}
+
+// run_apply applies rowMat or rowMat' to all the samples,
+// giving samples of the given length.
+static int run_apply(randomized_svd_t * svd, int kernelIdx, size_t length) {
+  size_t tile = svd->tile;
+  size_t tileLocal[2] = {tile, tile};
+  size_t sizes[2] = {pca_round_up(length, tile), pca_round_up(svd->sampleCount, tile)};
+  return context_run_nd_async(svd->context, kernelIdx, 2, NULL, sizes, tileLocal,
+    0, NULL, NULL);
+}
+
+// run_center_sums finds the sums which the next product
+// needs to act on the centered matrix, if it is centered.
+static int run_center_sums(randomized_svd_t * svd, int kernelIdx) {
+  if (!svd->centering) {
+    return 0;
+  }
+  size_t sumSize = svd->sumGroup * svd->sampleCount;
+  return context_run_nd_async(svd->context, kernelIdx, 1, NULL, &sumSize, &svd->sumGroup,
+    0, NULL, NULL);
+}
+
+// run_gram points the gram and factor kernels at the
+// count vectors in vectorBuff and sums their Gram matrix
+// in chunks. Only the shifted factor kernel, used by the
+// first Cholesky QR pass, has a shift.
+static int run_gram(randomized_svd_t * svd, int vectorBuff, size_t length, cl_int count) {
+  context_t * ctx = svd->context;
+  cl_int vectorLength = length;
+  size_t tile = svd->tile;
+  size_t tileSize = sizeof(cl_float3) * tile * (tile + 1);
+  svd->gramChunkLength = pca_gram_chunk_length(count, length);
+  svd->gramChunks = (length + svd->gramChunkLength - 1) / svd->gramChunkLength;
+  cl_int chunkLength = svd->gramChunkLength;
+  cl_int chunks = svd->gramChunks;
+
+  void * gramArgs[7] = {&ctx->buffers[vectorBuff], &vectorLength, &count, &chunkLength,
+    &ctx->buffers[GRAM_PARTIAL_BUFF], NULL, NULL};
+  size_t gramArgSizes[7] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_int),
+    sizeof(cl_mem), tileSize, tileSize};
+  cl_float shift = 0;
+  cl_float firstShift = pca_cholqr_shift(count);
+  cl_int statusOffset = 0;
+  void * factorArgs[9] = {&ctx->buffers[GRAM_PARTIAL_BUFF], &chunks, &count,
+    &ctx->buffers[GRAM_BUFF], &ctx->buffers[FACTOR_BUFF], &ctx->buffers[SCALE_BUFF], &shift,
+    &ctx->buffers[STATUS_BUFF], &statusOffset};
+  size_t factorArgSizes[9] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_mem),
+    sizeof(cl_mem), sizeof(cl_mem), sizeof(cl_float), sizeof(cl_mem), sizeof(cl_int)};
+  if (context_set_params(ctx, GRAM_KERNEL, 7, gramArgs, gramArgSizes) ||
+      context_set_params(ctx, FACTOR_KERNEL, 9, factorArgs, factorArgSizes)) {
+    return -1;
+  }
+  factorArgs[6] = &firstShift;
+  if (context_set_params(ctx, SHIFTED_FACTOR_KERNEL, 9, factorArgs, factorArgSizes)) {
+    return -1;
+  }
+
+  size_t tileLocal[3] = {tile, tile, 1};
+  size_t gramSizes[3] = {pca_round_up(count, tile), pca_round_up(count, tile),
+    svd->gramChunks};
+  return context_run_nd_async(ctx, GRAM_KERNEL, 3, NULL, gramSizes, tileLocal, 0, NULL, NULL);
+}
+
+// run_orthonormalize replaces the count vectors in
+// vectorBuff by an orthonormal basis of the same subspace,
+// with the same Cholesky QR passes as power_iter_t.
+static int run_orthonormalize(randomized_svd_t * svd, int vectorBuff, size_t length,
+                              cl_int count) {
+  context_t * ctx = svd->context;
+  cl_int vectorLength = length;
+  size_t tile = svd->tile;
+  size_t tileSize = sizeof(cl_float3) * tile * (tile + 1);
+  void * orthoArgs[6] = {&ctx->buffers[vectorBuff], &vectorLength, &count,
+    &ctx->buffers[FACTOR_BUFF], NULL, NULL};
+  size_t orthoArgSizes[6] = {sizeof(cl_mem), sizeof(cl_int), sizeof(cl_int), sizeof(cl_mem),
+    tileSize, tileSize};
+  if (context_set_params(ctx, ORTHONORMALIZE_KERNEL, 6, orthoArgs, orthoArgSizes)) {
+    return -1;
+  }
+
+  size_t tileLocal[2] = {tile, tile};
+  size_t orthoSizes[2] = {pca_round_up(length, tile), tile};
+  for (int pass = 0; pass < PCA_CHOLQR_PASSES; ++pass) {
+    int factorKernel = pass ? FACTOR_KERNEL : SHIFTED_FACTOR_KERNEL;
+    if (run_gram(svd, vectorBuff, length, count) ||
+        context_run_nd_async(ctx, factorKernel, 1, NULL, &svd->factorGroup,
+          &svd->factorGroup, 0, NULL, NULL) ||
+        context_run_nd_async(ctx, ORTHONORMALIZE_KERNEL, 2, NULL, orthoSizes, tileLocal,
+          0, NULL, NULL)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// solve_subspace reads back the Gram matrix of the row
+// side samples and solves for its eigenvectors on the
+// host. It is at most a few dozen entries a side. The
+// leading componentCount eigenvectors are written to the
+// factor buffer for the combine kernel.
+static int solve_subspace(randomized_svd_t * svd) {
+  size_t l = svd->sampleCount;
+  size_t k = svd->componentCount;
+  if (run_gram(svd, SAMPLE_ROWS_BUFF, svd->intermediateSize, l)) {
+    return -1;
+  }
+
+  size_t partialCount = svd->gramChunks * l * l;
+  cl_float3 * partial = (cl_float3 *)malloc(sizeof(cl_float3) * partialCount);
+  if (!partial) {
+    return -1;
+  }
+  if (context_read_async(svd->context, GRAM_PARTIAL_BUFF, 0, sizeof(cl_float3) * partialCount,
+      partial, 0, NULL, NULL) || context_finish(svd->context)) {
+    free(partial);
+    return -1;
+  }
+
+  cl_float3 * factor = (cl_float3 *)calloc(l * k, sizeof(cl_float3));
+  int res = factor ? solve_channels(svd, partial, factor) : -1;
+  free(partial);
+  if (!res) {
+    res = context_write_async(svd->context, FACTOR_BUFF, 0, sizeof(cl_float3) * l * k, factor,
+      0, NULL, NULL) || context_finish(svd->context) ? -1 : 0;
+  }
+  free(factor);
+  return res;
+}
+
+// solve_channels sums the chunks of the Gram matrix and
+// diagonalizes it for each channel. The eigenvectors go
+// in the columns of factor, in order of eigenvalue.
+static int solve_channels(randomized_svd_t * svd, cl_float3 * partial, cl_float3 * factor) {
+  size_t l = svd->sampleCount;
+  size_t k = svd->componentCount;
+  double * a = (double *)malloc(sizeof(double) * l * l);
+  double * v = (double *)malloc(sizeof(double) * l * l);
+  size_t * order = (size_t *)malloc(sizeof(size_t) * l);
+  if (!a || !v || !order) {
+    free(a);
+    free(v);
+    free(order);
+    return -1;
+  }
+
+  for (int chan = 0; chan < 3; ++chan) {
+    for (size_t i = 0; i < l * l; ++i) {
+      double sum = 0;
+      for (size_t c = 0; c < svd->gramChunks; ++c) {
+        sum += partial[c * l * l + i].s[chan];
+      }
+      a[i] = sum;
+    }
+    jacobi_eigen(a, v, l);
+
+    for (size_t i = 0; i < l; ++i) {
+      size_t j = i;
+      while (j > 0 && a[order[j - 1] * (l + 1)] < a[i * (l + 1)]) {
+        order[j] = order[j - 1];
+        --j;
+      }
+      order[j] = i;
+    }
+    for (size_t c = 0; c < k; ++c) {
+      svd->eigenvalues[c].s[chan] = a[order[c] * (l + 1)];
+      for (size_t j = 0; j < l; ++j) {
+        factor[j * k + c].s[chan] = v[j * l + order[c]];
+      }
+    }
+  }
+
+  free(a);
+  free(v);
+  free(order);
+  return 0;
+}
+
+// jacobi_eigen diagonalizes the symmetric n by n matrix a
+// in place with cyclic Jacobi rotations, leaving the
+// eigenvalues on its diagonal and the eigenvectors in the
+// columns of v.
+static void jacobi_eigen(double * a, double * v, int n) {
+  double norm = 0;
+  for (int i = 0; i < n * n; ++i) {
+    v[i] = i % (n + 1) == 0 ? 1 : 0;
+    norm += a[i] * a[i];
+  }
+
+  for (int sweep = 0; sweep < MAX_SWEEPS; ++sweep) {
+    double off = 0;
+    for (int p = 0; p < n; ++p) {
+      for (int q = p + 1; q < n; ++q) {
+        off += a[p * n + q] * a[p * n + q];
+      }
+    }
+    if (off <= norm * JACOBI_TOLERANCE) {
+      return;
+    }
+
+    for (int p = 0; p < n; ++p) {
+      for (int q = p + 1; q < n; ++q) {
+        double apq = a[p * n + q];
+        if (apq == 0) {
+          continue;
+        }
+        double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+        double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+        double c = 1 / sqrt(t * t + 1);
+        double s = t * c;
+        for (int i = 0; i < n; ++i) {
+          double aip = a[i * n + p];
+          double aiq = a[i * n + q];
+          a[i * n + p] = c * aip - s * aiq;
+          a[i * n + q] = s * aip + c * aiq;
+        }
+        for (int i = 0; i < n; ++i) {
+          double api = a[p * n + i];
+          double aqi = a[q * n + i];
+          a[p * n + i] = c * api - s * aqi;
+          a[q * n + i] = s * api + c * aqi;
+        }
+        for (int i = 0; i < n; ++i) {
+          double vip = v[i * n + p];
+          double viq = v[i * n + q];
+          v[i * n + p] = c * vip - s * viq;
+          v[i * n + q] = s * vip + c * viq;
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef __RANDOMIZED_SVD_H__
+#define __RANDOMIZED_SVD_H__
+
+#include "matrix.h"
+#include "context.h"
+#include "pca_kernels.h"
+
+// randomized_svd_t finds the leading eigenvectors of
+// rowMat'*rowMat, one set per channel, with a randomized
+// range finder. A random subspace of rowMat's row space
+// is refined by a few power passes, and the eigenvectors
+// are then solved for within it. Unlike power_iter_t, the
+// number of passes over the matrix is fixed up front.
+typedef struct {
+  context_t * context;
+  int componentCount;
+  pca_centering_t centering;
+
+  // sampleCount is the dimension of the subspace, which is
+  // componentCount plus the oversampling, but no more than
+  // rowMat has columns or rows, less one when centered.
+  int sampleCount;
+  size_t tile;
+  size_t factorGroup;
+  size_t sumGroup;
+  size_t gramChunks;
+  size_t gramChunkLength;
+
+  // vector holds componentCount vectors of vectorSize
+  // entries, one after another, in order of eigenvalue.
+  // It is only updated by randomized_svd_run.
+  cl_float3 * vector;
+  size_t vectorSize;
+  size_t intermediateSize;
+
+  // eigenvalues holds the estimates for each component and
+  // channel.
+  cl_float3 * eigenvalues;
+} randomized_svd_t;
+
+// randomized_svd_new creates a solver for componentCount
+// components which samples oversampling more directions
+// than it needs. Only rowMat itself is copied to the
+// device.
+randomized_svd_t * randomized_svd_new(matrix_t * rowMat, int componentCount, int oversampling);
+
+// randomized_svd_new_in is like randomized_svd_new, but
+// runs on an existing session which must outlive it, and
+// centers rowMat's columns as it goes.
+randomized_svd_t * randomized_svd_new_in(session_t * session, matrix_t * rowMat,
+                                         int componentCount, int oversampling,
+                                         pca_centering_t centering);
+
+// randomized_svd_run starts from a new random subspace and
+// makes 2*powerPasses + 2 passes over the matrix. The
+// vectors and eigenvalues are then read back. It returns
+// -1 on error or if the samples lose rank.
+int randomized_svd_run(randomized_svd_t * svd, int powerPasses);
+void randomized_svd_free(randomized_svd_t * svd);
+
+#endif
@@ -40,7 +40,8 @@ int main() {
     return 1;
   }
 
-  cl_command_queue queue = clCreateCommandQueue(context, device, 0, &statusCode);
+  cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE,
+    &statusCode);
   if (statusCode) {
     clReleaseContext(context);
     fprintf(stderr, "Unable to create command queue.\n");
@@ -151,6 +152,17 @@ int main() {
 
   printf("GPU completed %d multiplies in %lld microseconds.\n", NUMBER_LIST_SIZE, duration);
 
+  cl_ulong kernelStart;
+  cl_ulong kernelEnd;
+  if (!clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong),
+        &kernelStart, NULL) &&
+      !clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong),
+        &kernelEnd, NULL)) {
+    printf("Kernel itself ran for %lld microseconds.\n",
+      (long long)(kernelEnd - kernelStart) / 1000);
+  }
+  clReleaseEvent(event);
+
   int i = 0;
   int remaining = NUMBER_LIST_SIZE;
   while (remaining > 0) {